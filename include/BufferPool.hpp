@@ -0,0 +1,38 @@
+#ifndef BUFFERPOOL_HPP
+#define BUFFERPOOL_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// ワーカー単位の受信バッファプール（スレッドごとに1つなのでロックなし）。
+// - recv 用の作業領域（最大 RECV_CHUNK_MAX）を1枚だけ持つ
+// - 接続の recvBuffer は、空になったら容量ごとプールへ返し、
+//   次に受信する接続へ swap で貸し出す（確保 / 解放の繰り返しを避ける）
+class BufferPool {
+public:
+    static const size_t RECV_CHUNK_MIN = 16 * 1024;
+    static const size_t RECV_CHUNK_MAX = 256 * 1024;
+
+private:
+    std::vector<std::string> freeList;
+    std::vector<char> scratch;
+    size_t maxFree;      // 保持する空きバッファの数
+    size_t maxCapacity;  // これより大きいバッファはプールせず解放する
+
+    BufferPool(const BufferPool &);
+    BufferPool &operator=(const BufferPool &);
+
+public:
+    explicit BufferPool(size_t maxFree = 64, size_t maxCapacity = 1024 * 1024);
+
+    // recv の読み込み先（RECV_CHUNK_MAX バイト）
+    char *recvScratch();
+    // buf（空）にプール済みの容量を持たせる
+    void acquire(std::string &buf);
+    // buf（空）の容量をプールへ返す。buf は容量0になる
+    void release(std::string &buf);
+    size_t freeCount() const { return freeList.size(); }
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define CGIPROCESS_HPP
 
 #include <string>
+#include <vector>
 #include <ctime>
 #include "RequestParser.hpp"  // Request構造体を使うために必要
 
@@ -11,10 +12,36 @@ struct CgiProcess {
     int outFd;               // CGIからの読み取り用
     int clientFd;            // このCGIリクエストのクライアントFD
     Request req;
-    std::string buffer;      // CGI出力の一時保存
+    std::string buffer;      // CGI出力のヘッダ部（揃うまでの一時保存）
     std::string inputBuffer; // CGIへの入力データ残り
     int events;              // 現在監視するpollイベント (POLLIN / POLLOUT)
-    int remainingMs;       // タイムアウトまでの残り時間（ミリ秒）
+    long long deadline;      // タイムアウト期限（monotonicMs基準）
+    bool headersSent;        // ステータス行とヘッダをクライアントへ積んだ
+    bool chunked;            // 本文を chunked で転送する
+    long long bodyLeft;      // 本文の残り（Content-Length 指定時のみ, -1 = 指定なし）
+    bool paused;             // クライアントの送信待ちが多いので読み取りを止めている
+    bool outputDone;         // stdout の EOF まで読んだ（outFd は監視から外して保持）
+    bool exited;             // 子を回収済み（status が有効）
+    int status;              // waitpid の終了ステータス
+};
+
+// location ごとに設定の読み込み時に組み立てておく起動情報
+struct CgiTemplate {
+    std::string cgiPath;               // argv[0]（インタプリタ）
+    std::string scriptRoot;            // location の root（末尾 '/' なし）
+    std::string locKey;                // cfg.location のキー（URI から外す部分）
+    std::vector<std::string> fixedEnv; // リクエストで変わらない "KEY=VALUE"
+};
+
+// 起動待ちの CGI（cgi_max_procs に達している間は Server が列に積む）
+struct CgiPending {
+    int clientFd;
+    const CgiTemplate *tmpl;
+    std::string scriptPath;        // argv[1]
+    std::vector<std::string> env;  // リクエストごとの "KEY=VALUE"
+    int bodyFd;                    // 一時ファイルのボディ（-1 = body をパイプで渡す）
+    std::string body;
+    Request req;                   // method / uri / version のみ（応答の組み立て用）
 };
 
 #endif
@@ -2,18 +2,36 @@
 #define CLIENTINFO_HPP
 
 #include <string>
+#include <sys/types.h>
 #include "RequestParser.hpp"
+#include "SendQueue.hpp"
+
+class MultipartParser;
+struct CgiProcess;
 
 struct ClientInfo {
     std::string recvBuffer;    // 受信バッファ
-    std::string sendBuffer;    // 送信バッファ
+    SendQueue sendQueue;       // 送信待ち（バッファ / ファイル範囲）
     bool requestComplete;      // リクエスト受信完了フラグ
 	bool shouldClose;  // レスポンス送信後に接続を閉じる必要がある場合に true
 	Request currentRequest;
-    int timeoutCounter;
-    size_t receivedBodySize; // 受信したボディのサイズ
+    RequestParser parser;      // 受信途中のリクエストの解析状態
+    long long deadline;        // タイムアウト期限（monotonicMs基準, 0 = 無期限）
+    long long queuedDeadline;  // TimerQueue に積んである期限（0 = 未登録）
+    bool waitingCgi;           // CGI の応答待ち（この間はCGI側のタイマーで管理）
+    unsigned long long receivedBodySize; // 受信したボディのサイズ
+    int requestCount;        // この接続で受け付けたリクエスト数（keepalive_requests 用）
+    size_t recvChunk;        // 1回の recv で読む量（受信量に合わせて増減）
+    bool continueSent;       // このリクエストに 100 Continue を返したか
+    MultipartParser *upload; // 受信しながら解析中の multipart（Server が所有）
+    int statMethod;          // 次に積むレスポンスを数えるメソッド（-1 = 数えない）
+    long long requestStartUs; // 送り終えていないリクエストを受け取った時刻（0 = なし）
+    size_t statLocation;     // そのリクエストの location（ServerStats::latency の添字）
+    CgiProcess *pausedUpstream; // 送信待ちが多くて読み取りを止めている CGI / FastCGI の応答（NULL = なし）
+
+    ClientInfo(): recvBuffer(""), sendQueue(), requestComplete(false), shouldClose(false), currentRequest(), parser(), deadline(0), queuedDeadline(0), waitingCgi(false), receivedBodySize(0), requestCount(0), recvChunk(16 * 1024), continueSent(false), upload(NULL), statMethod(-1), requestStartUs(0), statLocation(0), pausedUpstream(NULL) {}
 
-    ClientInfo(): recvBuffer(""), sendBuffer(""), requestComplete(false), currentRequest(), timeoutCounter(0), receivedBodySize(0) {}
+    bool hasPendingOutput() const { return !sendQueue.empty(); }
 };
 
 #endif
@@ -10,23 +10,43 @@ struct ServerConfig {
   std::string host;
   std::string root;
   std::map<int, std::string> errorPages;
+  int keepaliveTimeout;  // 秒（0 = keep-alive しない）
+  int keepaliveRequests; // 1接続あたりの最大リクエスト数（0 = 無制限）
+  int openFileCacheMax;   // open_file_cache のエントリ数（0 = off, -1 = 未指定: fd の上限から決める）
+  int openFileCacheValid; // 再検証までの秒数
+  int cgiMaxProcs;        // 同時に動かす CGI プロセス数（ワーカー単位, 0 = 無制限）
   struct Location {
     std::string root;
     std::string autoindex;
+    std::string autoindex_format; // "html"（空も同じ）/ "json"
     std::string upload_path;
     std::string index;
-    size_t max_body_size;
+    unsigned long long max_body_size;           // 0 = 無制限
+    unsigned long long client_body_buffer_size; // これを超えるボディは一時ファイルへ（0 = 既定値）
     std::string cgi_path;
+    std::string fastcgi_pass; // "unix:/path" / "host:port"（空 = fork する CGI）
+    std::string etag;          // "on"（空も同じ）/ "weak" / "off"
+    std::string cache_control; // 静的ファイルに付ける Cache-Control の値（空 = 付けない）
+    std::string gzip;          // "on" / "off"（空 = off）
+    unsigned long long gzip_min_length; // これより小さいファイルは圧縮しない（0 = 既定値）
+    std::string stub_status;   // "on" ならこの location はメトリクスを返す
 	  std::vector<std::string> method;
     std::map<int, std::string> ret;
   };
   std::map<std::string, Location> location;
 };
 
+// server ブロックの外に書くプロセス全体の設定
+struct GlobalConfig {
+  int workerThreads;      // イベントループのスレッド数（0 = auto: CPU数）
+  bool workerCpuAffinity; // スレッドをCPUにピン留めするか
+};
+
 class ConfigParser {
 private:
   std::vector<ServerConfig> _serverConfigs;
   ServerConfig _cfg;
+  GlobalConfig _global;
   bool _inside_server;
   bool _inside_location;
   std::string _tmp_location_name;
@@ -35,7 +55,9 @@ private:
   std::string trim_first_last_space(const std::string &input);
   std::vector<std::string> parse_by_space(const std::string &str);
   void parse_server_inside(const std::string &str);
+  void parse_global(const std::string &str);
   void init_ServerConfig();
+  bool parse_size(const std::string &str, unsigned long long &out) const;
   // void print_configServers();
 //   void printLocation(const Location &loc);
   void printLocation(const ServerConfig::Location &loc);
@@ -46,4 +68,5 @@ private:
 public:
   //   void parse(const std::string &path);
   std::vector<ServerConfig> getServerConfigs(const std::string &path);
+  const GlobalConfig &getGlobalConfig() const { return _global; }
 };
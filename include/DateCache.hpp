@@ -0,0 +1,28 @@
+#ifndef DATECACHE_HPP
+#define DATECACHE_HPP
+
+#include <ctime>
+#include <string>
+
+// t を IMF-fixdate にする（Last-Modified などにも使う）
+std::string formatHttpDate(time_t t);
+// IMF-fixdate を読む（If-Modified-Since 用。古い形式は受け付けない）
+bool parseHttpDate(const std::string &s, time_t &out);
+
+// Date ヘッダの値（RFC 7231 の IMF-fixdate: "Sun, 06 Nov 1994 08:49:37 GMT"）。
+// ワーカーがループ1周ごとに update() し、秒が変わったときだけ作り直す。
+// 所有スレッドだけが読み書きするのでロックはしない。
+class DateCache {
+private:
+    time_t sec;
+    std::string value;
+
+public:
+    DateCache();
+
+    void update();             // time() で現在時刻を取り直す
+    void update(time_t now);
+    const std::string &str() const { return value; }
+};
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef FASTCGI_HPP
+#define FASTCGI_HPP
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <sys/socket.h>
+#include "CgiProcess.hpp"
+
+// FastCGI（version 1）のレコード種別
+enum FastCgiType {
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_ABORT_REQUEST = 2,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7
+};
+
+// 1本の接続で同時に扱うのは1リクエストなので ID は固定
+enum { FCGI_REQUEST_ID = 1 };
+
+// レコードの組み立て（out の末尾に追記する）
+void fcgiAppendBeginRequest(std::string &out, unsigned short id, bool keepConn);
+// 名前-値ペアを PARAMS レコードに詰め、終端の空レコードまで付ける
+void fcgiAppendParams(std::string &out, unsigned short id,
+                      const std::map<std::string, std::string> &params);
+// STDIN などのストリーム。len が 0 なら終端の空レコード
+void fcgiAppendStream(std::string &out, unsigned char type, unsigned short id,
+                      const char *data, size_t len);
+
+// fastcgi_pass の宛先を起動時に解決したもの（イベントループでは DNS を引かない）
+struct FastCgiAddr {
+    struct sockaddr_storage sa;
+    socklen_t len; // 0 = 解決できなかった
+
+    FastCgiAddr() : sa(), len(0) {}
+};
+
+// "unix:/path" / "host:port" を解決する（getaddrinfo はここだけ。設定の読み込み時に呼ぶ）
+bool fcgiResolve(const std::string &addr, FastCgiAddr &out);
+// 解決済みの宛先へノンブロッキングで接続する。
+// 接続中なら inProgress = true（POLLOUT で完了を待つ）。失敗は -1
+int fcgiConnect(const FastCgiAddr &addr, bool &inProgress);
+
+// 受信したバイト列からレコードを1つずつ取り出す
+class FastCgiDecoder {
+private:
+    std::string buf;
+    size_t pos; // 次のレコードの先頭
+
+public:
+    FastCgiDecoder() : buf(), pos(0) {}
+
+    void append(const char *data, size_t len);
+    // 完全なレコードがあれば取り出す（content は次の append / compact まで有効）
+    bool next(unsigned char &type, unsigned short &id, const char *&content, size_t &len);
+    // 取り出し済みの分を捨てる
+    void compact();
+    void clear() { buf.clear(); pos = 0; }
+};
+
+// アプリケーションサーバへの常設接続（1本につき同時に1リクエスト）。
+// 応答の転送状態は CGI と同じ CgiProcess を使う（pid / パイプは使わない）。
+struct FastCgiConn {
+    int fd;
+    std::string addr;      // fastcgi_pass の値
+    bool connecting;       // ノンブロッキング connect の完了待ち
+    bool busy;             // リクエスト処理中
+    std::string out;       // 未送信のレコード
+    size_t outOff;
+    int bodyFd;            // STDIN に流す一時ファイル（-1 = 無し / 送り終えた）
+    FastCgiDecoder in;
+    CgiProcess stream;     // stream.clientFd = -1 ならクライアントは切断済み
+    long long queuedDeadline; // TimerQueue に積んである期限（0 = 未登録）
+
+    FastCgiConn()
+        : fd(-1), addr(), connecting(false), busy(false), out(), outOff(0), bodyFd(-1),
+          in(), stream(), queuedDeadline(0) {}
+};
+
+// 接続が空くのを待っているリクエスト（レコードは組み立て済み）
+struct FastCgiPending {
+    int clientFd;
+    std::string addr;
+    const FastCgiAddr *target; // LocationRuntime::fastcgiAddr
+    std::string records;
+    int bodyFd;
+    std::string version;   // chunked で返せるか
+};
+
+#endif
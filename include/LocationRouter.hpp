@@ -0,0 +1,40 @@
+#ifndef LOCATIONROUTER_HPP
+#define LOCATIONROUTER_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "ConfigParser.hpp"
+#include "LocationRuntime.hpp"
+
+// cfg.location を起動時に基数木（radix trie）へ組み立てたもの。
+// 各 location の LocationRuntime もここで作って持つ。
+// location のキー（末尾 '/' を除いたもの）のうち URI の先頭に一致する最長のものを、
+// URI を1回なぞるだけで求める（location 数によらず O(URI 長)、確保なし）。
+// 一致は従来どおり文字単位の前方一致（"/old" は "/older" にも当たる）。
+class LocationRouter {
+private:
+    struct Node {
+        std::string label;         // 親からこのノードまでの文字列（根は空）
+        std::vector<size_t> children;
+        int route;                 // runtimes の添字（-1 = ここで終わる location なし）
+
+        Node() : label(), children(), route(-1) {}
+    };
+
+    std::vector<Node> nodes;       // nodes[0] が根
+    std::vector<LocationRuntime> runtimes; // 構築後は増やさない（ポインタを返すため）
+
+    size_t findChild(size_t node, unsigned char c) const;
+    void insert(const std::string &path, int route);
+
+public:
+    LocationRouter();
+    explicit LocationRouter(const ServerConfig &cfg);
+
+    // 一致する location が無ければ NULL
+    const LocationRuntime *match(const std::string &uri) const;
+    const std::vector<LocationRuntime> &locations() const { return runtimes; }
+};
+
+#endif
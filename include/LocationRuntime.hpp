@@ -0,0 +1,62 @@
+#ifndef LOCATIONRUNTIME_HPP
+#define LOCATIONRUNTIME_HPP
+
+#include <string>
+#include "CgiProcess.hpp"
+#include "ConfigParser.hpp"
+#include "FastCgi.hpp"
+
+// 許可メソッドのビット
+enum MethodBit {
+    METHOD_GET = 1 << 0,
+    METHOD_HEAD = 1 << 1,
+    METHOD_POST = 1 << 2,
+    METHOD_DELETE = 1 << 3
+};
+
+// 静的ファイルに付ける ETag の種類（etag ディレクティブ）
+enum EtagMode {
+    ETAG_STRONG,
+    ETAG_WEAK,
+    ETAG_OFF
+};
+
+// "GET" などをビットにする（対応していないメソッドは 0）
+unsigned methodBit(const std::string &method);
+
+// location の設定を起動時に1回だけ組み立てた実行時の情報（以降は読み取り専用）。
+// リクエストの処理中は設定から文字列を作り直さず、ここにある値をそのまま使う。
+struct LocationRuntime {
+    const ServerConfig::Location *conf; // 元の設定
+    std::string key;              // cfg.location のキー（例: "/delete/"）
+    std::string root;             // 実効ルート（server の root と結合済み）
+    unsigned methods;             // method に書かれたメソッドのビット
+    bool methodsListed;           // method の指定があるか
+    std::string allow;            // Allow ヘッダの値（", " 区切り）
+    bool hasRedirect;             // return の指定がある
+    std::string redirectKeepAlive; // return の応答（そのまま送る）
+    std::string redirectClose;     // 同じく Connection: close 版
+    std::string index;            // ディレクトリに補うファイル名
+    bool autoindex;
+    bool autoindexJson;           // autoindex_format json（?format= で上書きできる）
+    std::string uploadPath;       // 空 = アップロード不可
+    std::string spoolPattern;     // 大きいボディの一時ファイル（mkstemp の雛形）
+    unsigned long long maxBodySize;    // 0 = 無制限
+    unsigned long long bodyBufferSize; // これを超えるボディは一時ファイルへ（0 = 既定値）
+    std::string fastcgiPass;      // 空 = CGI を fork して動かす
+    FastCgiAddr fastcgiAddr;      // fastcgiPass を起動時に解決したもの
+    EtagMode etag;
+    std::string cacheControl;     // "Cache-Control: ...\r\n"（空 = 付けない）
+    bool gzip;                    // テキスト系を圧縮して返す（.gz / .br があればそれを使う）
+    unsigned long long gzipMinLength;
+    bool stubStatus;              // メトリクス（Prometheus 形式）を返す location
+    CgiTemplate cgi;              // CGI の argv[0] / 固定の環境変数
+
+    LocationRuntime();
+    LocationRuntime(const ServerConfig &cfg, const std::string &key,
+                    const ServerConfig::Location &loc);
+
+    bool allows(unsigned bit) const { return (methods & bit) != 0; }
+};
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <vector>
+#include "ConfigParser.hpp"
+#include "LocationRuntime.hpp"
+#include "WorkerStats.hpp"
+
+// stub_status の出力。各ワーカーの Server が起動時に自分の ServerStats を登録し、
+// 問い合わせを受けた Server が同じ server ブロックの分を足し合わせて
+// Prometheus のテキスト形式にする。登録 / 削除はワーカーのスレッドが
+// 動いていないとき（起動時・終了時）だけなので、読み取りにロックはいらない。
+
+// locations は LocationRouter::locations()（ラベルに key を使う）
+void registerServerStats(const ServerConfig *cfg, const std::vector<LocationRuntime> *locations,
+                         const ServerStats *stats);
+void unregisterServerStats(const ServerStats *stats);
+
+// 全 server ブロックのカウンタを out に追記する
+void renderPrometheusMetrics(std::string &out);
+
+// us マイクロ秒を数えるヒストグラムの区間（LATENCY_BUCKETS なら +Inf）
+size_t latencyBucket(long long us);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef MULTIPARTPARSER_HPP
+#define MULTIPARTPARSER_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "RequestParser.hpp"
+
+// multipart/form-data を受信しながら解析し、各パートの中身をそのまま
+// アップロード先のファイルへ書き出す（ボディ全体をメモリに持たない）。
+// 区切り "\r\n--boundary" は Boyer-Moore-Horspool で探し、チャンク境界を
+// またぐ区切り候補とパートヘッダだけを小さく持ち越す。
+// 各パートはまず同じディレクトリの一時ファイル（.upload_XXXXXX, 0600）に書き、
+// 全部受け取れた finish() で 0644 にして本来の名前に rename する。途中で失敗しても
+// 同じ名前の既存ファイルは壊さない（rename の途中で失敗したら、確定済みの分も戻す）。
+class MultipartParser : public BodySink {
+public:
+    enum { MAX_BOUNDARY = 70 }; // RFC 2046
+
+private:
+    enum State {
+        ST_PREAMBLE,  // 最初の区切りまで（読み捨て）
+        ST_DELIM_END, // 区切り直後の "\r\n" か終端の "--"
+        ST_HEAD,      // パートヘッダ（空行待ち）
+        ST_DATA,      // パートの中身
+        ST_DONE,      // 終端の区切りまで読んだ（以降は読み捨て）
+        ST_ERROR
+    };
+
+    State state;
+    std::string delim;        // "\r\n--" + boundary
+    size_t skip[256];         // BMH のずらし表
+    std::string dir;          // 保存先ディレクトリ（末尾 '/' 付き）
+    std::string pending;      // 前回解析しきれなかった残り
+    struct Part {
+        std::string tmp;    // 書き出し先の一時ファイル（rename したら空）
+        std::string dest;   // 確定後の名前
+        std::string backup; // 置き換える前の dest のハードリンク（空 = 元は無かった）
+    };
+    int partFd;               // 書き出し中のファイル（-1 = 読み捨て）
+    std::vector<Part> parts;  // 作った一時ファイル（確定しなければ消す）
+    int status;               // 0 = 正常 / 400 / 500
+    bool committed;
+
+    MultipartParser(const MultipartParser &);
+    MultipartParser &operator=(const MultipartParser &);
+
+    size_t parse(const char *p, size_t n);
+    size_t search(const char *p, size_t n) const;
+    size_t partialTail(const char *p, size_t n) const;
+    bool openPart(const std::string &head);
+    bool emit(const char *p, size_t n);
+    void closePart();
+    void fail(int code);
+    bool commitParts();
+
+public:
+    // boundary は Content-Type の boundary パラメータ（"--" なし）
+    MultipartParser(const std::string &boundary, const std::string &uploadDir);
+    ~MultipartParser();
+
+    // Content-Type から boundary を取り出す（無い / 不正なら空）
+    static std::string boundaryOf(const std::string &contentType);
+
+    // false は書き込み失敗（形式の誤りは finish() で 400 として返す）
+    bool write(const char *data, size_t len);
+    // 終端まで正しく読めていればファイルを確定して 201、それ以外は 400 / 500
+    int finish();
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <cstddef>
+#include <vector>
+#include <poll.h>
+
+class Server;
+
+// FD の種類。イベントの配送先をこれで決める（Server 側で map を引き直さない）
+enum FdKind {
+    FD_NONE,      // 未登録
+    FD_WAKEUP,    // Worker の起床用パイプ（owner なし）
+    FD_LISTENER,  // listen ソケット
+    FD_CLIENT,    // クライアント接続（state = ClientInfo）
+    FD_CGI_IN,    // 親 → CGI の stdin（state = CgiProcess）
+    FD_CGI_OUT,   // CGI の stdout → 親（state = CgiProcess）
+    FD_FASTCGI    // FastCGI の接続（state = FastCgiConn）
+};
+
+// fd を添字にした配送表の1要素（add で埋め、remove で FD_NONE に戻す）
+struct FdSlot {
+    FdKind kind;
+    short events;   // 現在の監視イベント
+    Server *owner;
+    void *state;    // kind ごとの状態オブジェクト（登録中は owner が生かしておく）
+    size_t index;   // PollReactor の pfds の添字
+
+    FdSlot() : kind(FD_NONE), events(0), owner(NULL), state(NULL), index(0) {}
+};
+
+// wait() で返る1イベント分（events/revents は poll と同じ POLLIN/POLLOUT 表記）
+struct ReactorEvent {
+    int fd;
+    short revents;
+    FdKind kind;
+    Server *server;
+    void *state;
+};
+
+// イベントループの多重化部分だけを切り出した小さなインターフェース。
+// FD は接続/CGI登録時に一度だけ add し、POLLOUT の要否が変わったときだけ
+// modify する。毎ループ pollfd 配列を組み直す必要はない。
+// 登録情報は fd を添字にした配列で持つので、イベントごとの振り分けは O(1)。
+class Reactor {
+protected:
+    std::vector<FdSlot> slots; // fd -> 登録情報
+
+    // 登録済みの fd の slot（未登録なら NULL）
+    FdSlot *slotOf(int fd) {
+        if (fd < 0 || static_cast<size_t>(fd) >= slots.size() || slots[fd].kind == FD_NONE)
+            return NULL;
+        return &slots[fd];
+    }
+    FdSlot &bind(int fd, short events, FdKind kind, Server *owner, void *state);
+    void fillEvent(ReactorEvent &e, int fd, short revents) const;
+
+public:
+    virtual ~Reactor() {}
+
+    // state は kind ごとの状態オブジェクト。remove するまで有効であること
+    virtual bool add(int fd, short events, FdKind kind, Server *owner, void *state) = 0;
+    virtual bool modify(int fd, short events) = 0;
+    // close() する前に必ず呼ぶこと（fork した子が同じFDを持っていると
+    // close だけでは epoll から外れないため）
+    virtual void remove(int fd) = 0;
+
+    // 準備できたイベントを返す。返したベクタは次の wait() まで有効で、
+    // 処理中に remove() された FD のイベントは revents = 0 に潰される。
+    virtual const std::vector<ReactorEvent> &wait(int timeoutMs) = 0;
+
+    // 環境に合ったバックエンドを生成（Linux: epoll / その他: poll）
+    static Reactor *create();
+};
+
+#ifdef __linux__
+// epoll バックエンド（レベルトリガ）。起床コストはアクティブFD数に比例する。
+class EpollReactor : public Reactor {
+private:
+    int epfd;
+    std::vector<ReactorEvent> ready;
+
+    EpollReactor(const EpollReactor &);
+    EpollReactor &operator=(const EpollReactor &);
+
+public:
+    EpollReactor();
+    ~EpollReactor();
+
+    bool isOpen() const { return epfd >= 0; }
+    bool add(int fd, short events, FdKind kind, Server *owner, void *state);
+    bool modify(int fd, short events);
+    void remove(int fd);
+    const std::vector<ReactorEvent> &wait(int timeoutMs);
+};
+#endif
+
+// poll バックエンド（epoll の無い環境向け）。pollfd 配列は常駐させ、
+// 追加/削除は slot に持たせた添字で O(1) に行う。
+class PollReactor : public Reactor {
+private:
+    std::vector<pollfd> pfds;
+    std::vector<ReactorEvent> ready;
+
+public:
+    bool add(int fd, short events, FdKind kind, Server *owner, void *state);
+    bool modify(int fd, short events);
+    void remove(int fd);
+    const std::vector<ReactorEvent> &wait(int timeoutMs);
+};
+
+#endif
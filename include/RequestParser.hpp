@@ -11,19 +11,83 @@ struct Request {
   std::string version;
   std::map<std::string, std::string> headers;
   std::string body;
+  std::string bodyPath;        // 空でなければボディはこの一時ファイル（body は空）
+  unsigned long long bodySize; // ボディ長（メモリ / ファイルどちらでも）
+
+  Request() : method(), uri(), version(), headers(), body(), bodyPath(), bodySize(0) {}
+};
+
+// 受信しながらボディを受け取る先（multipart の逐次解析など）。
+// write が false を返すと 500 で打ち切る。
+class BodySink {
+public:
+  virtual ~BodySink() {}
+  virtual bool write(const char *data, size_t len) = 0;
 };
 
+// 接続ごとに ClientInfo が持つインクリメンタルなパーサ。
+// recvBuffer に追記されるたびに feed() を呼ぶと、前回見た位置から続きを
+// 解析する。リクエスト行とヘッダは1回だけ解析し、ボディは Content-Length
+// または chunk の状態で進捗を追う（1リクエストあたり線形）。
 class RequestParser {
+public:
+  enum Status { PARSE_INCOMPLETE, PARSE_COMPLETE, PARSE_ERROR };
+
 private:
-  size_t parsedLength;
-  bool isClearlyInvalidRequest(const std::string &buffer);
+  enum State {
+    ST_HEAD,        // リクエスト行 + ヘッダ（空行待ち）
+    ST_BODY,        // Content-Length 分のボディ待ち
+    ST_CHUNK_SIZE,  // chunk サイズ行
+    ST_CHUNK_DATA,  // chunk データ
+    ST_CHUNK_CRLF,  // chunk データ後の CRLF
+    ST_TRAILER,     // 最終 chunk 後のトレーラ（空行で終わり）
+    ST_DONE,
+    ST_ERROR
+  };
+
+  State state;
+  size_t scanPos;        // buffer 先頭から、次に解析する位置
+  unsigned long long contentLength;
+  size_t chunkRemaining;
+  size_t parsedLength;   // 完了 / エラー時に消費したバイト数
+  Request req;
+  int spoolFd;           // ボディの書き出し先（-1 = メモリに持つ）
+  BodySink *sink;         // ボディの渡し先（所有しない。NULL = 使わない）
+  unsigned long long spooled; // spoolFd / sink に書いたバイト数
+  int errorStatus;       // PARSE_ERROR 時に返すステータス（400 / 500）
+
+  Status fail(const std::string &buffer);
+  bool looksLikeHttp(const std::string &buffer, size_t lineEnd) const;
+  bool parseHead(const std::string &buffer, size_t headEnd);
+  Status parseBody(const std::string &buffer);
+  bool spoolWrite(const char *data, size_t len);
 
 public:
   RequestParser();
-  bool isRequestComplete(const std::string &buffer);
-  Request parse(const std::string &buffer);
+  // buffer は前回の呼び出し時の内容に追記されたもの（先頭は変えない）
+  Status feed(const std::string &buffer);
+  bool headersDone() const { return state != ST_HEAD && state != ST_ERROR; }
+  // ヘッダ解析済みで未完了のリクエスト（413 の早期判定用）
+  const Request &pending() const { return req; }
+  // 判明しているボディサイズ（Content-Length か、ここまでに復号した chunk の合計）
+  unsigned long long knownBodySize() const {
+    if (state == ST_BODY)
+      return contentLength;
+    return isSpooling() ? spooled : req.body.size();
+  }
+  bool isChunked() const { return state >= ST_CHUNK_SIZE && state <= ST_TRAILER; }
+  bool isSpooling() const { return spoolFd >= 0 || sink != NULL; }
+  // 以降のボディを fd（path）へ書き出す。所有権はパーサに移る
+  bool spoolTo(int fd, const std::string &path);
+  // 以降のボディを sink へ渡す（Request.body / bodyPath には残らない）
+  bool streamTo(BodySink *s);
+  // スプール中は解析済みの先頭を buffer から捨ててよい（メモリを一定に保つ）
+  void compact(std::string &buffer);
+  int getErrorStatus() const { return errorStatus; }
+  // 完了したリクエストを out に移し、次のリクエスト用に状態を戻す
+  void takeRequest(Request &out);
+  void reset();
   size_t getParsedLength() const { return parsedLength; }
-  std::map<std::string, std::string> parseHeaders(const std::string &headerPart);
 };
 
 // void printRequest(const Request &req);
@@ -0,0 +1,52 @@
+#ifndef SENDQUEUE_HPP
+#define SENDQUEUE_HPP
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <sys/types.h>
+
+// 接続ごとの送信キュー。メモリ上のバッファとファイル範囲をセグメントとして
+// 順番に並べ、メモリ部分は sendmsg（writev 相当）でまとめて、ファイル部分は
+// sendfile で送る。送った分はオフセットを進めるだけで、残りを詰め直さない。
+class SendQueue {
+public:
+    enum Result { SEND_DONE, SEND_AGAIN, SEND_ERROR };
+
+private:
+    struct Segment {
+        std::string data;   // fileFd < 0 のとき
+        size_t offset;      // data の送信済みバイト数
+        int fileFd;         // -1 以外ならファイル範囲（SendQueue が close する）
+        off_t fileOffset;
+        off_t fileRemaining;
+
+        Segment() : data(), offset(0), fileFd(-1), fileOffset(0), fileRemaining(0) {}
+    };
+
+    std::deque<Segment> segs;
+    size_t memBytes; // 未送信のメモリ上のバイト数
+    unsigned long long totalSent; // これまでに送ったバイト数（統計用）
+
+    void consume(size_t n);
+    void popFront();
+
+public:
+    SendQueue() : segs(), memBytes(0), totalSent(0) {}
+
+    // 小さい追記は末尾のバッファにまとめ、ヘッダと小さい本文を1パケットで出す
+    void append(const std::string &data);
+    void append(const char *data, size_t len);
+    // fd の所有権を受け取る
+    void appendFile(int fd, off_t offset, off_t length);
+    // ソケットが受け取れるだけ送る（1回の呼び出しで最大 budget バイト）
+    Result flush(int sock, size_t budget);
+    // 未送信を捨て、ファイル fd を閉じる
+    void clear();
+
+    bool empty() const { return segs.empty(); }
+    size_t bufferedBytes() const { return memBytes; }
+    unsigned long long sentBytes() const { return totalSent; }
+};
+
+#endif
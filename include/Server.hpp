@@ -12,14 +12,40 @@
 #include <string>
 #include <fcntl.h>
 #include <vector>
+#include <deque>
 
 #include "ClientInfo.hpp"
 #include "RequestParser.hpp"
 #include "ConfigParser.hpp"
 #include "CgiProcess.hpp"
+#include "FastCgi.hpp"
+#include "LocationRouter.hpp"
+#include "Reactor.hpp"
+#include "TimerQueue.hpp"
+#include "WorkerStats.hpp"
+#include "BufferPool.hpp"
+#include "DateCache.hpp"
+#include "resp/HttpResponse.hpp"
+#include "resp/OpenFileCache.hpp"
+#include "resp/DirListing.hpp"
+#include "resp/ErrorPages.hpp"
+#include "resp/GzipCache.hpp"
 
 #define MAX_CLIENTS 100
 
+// タイムアウト（ミリ秒）
+#define READ_TIMEOUT_MS 5000   // リクエスト受信途中で無通信
+#define WRITE_TIMEOUT_MS 5000  // レスポンス送信が進まない
+#define IDLE_TIMEOUT_MS 5000   // リクエストを待っている間
+#define CGI_TIMEOUT_MS 50000   // CGI の出力が途切れてよい時間
+#define CGI_KILL_GRACE_MS 2000 // 打ち切る CGI に SIGTERM してから SIGKILL するまで
+#define CGI_MAX_HEADER 8192    // これを超えてもヘッダが終わらない CGI 出力は全部本文として扱う
+#define CGI_PAUSE_BYTES (1024 * 1024)   // 送信待ちがこれを超えたら CGI の読み取りを止める
+#define CGI_RESUME_BYTES (256 * 1024)   // ここまで減ったら再開
+#define ACCEPT_RETRY_MS 100     // fd が尽きて accept できないとき、listen ソケットの監視を止める時間
+#define FASTCGI_MAX_CONNS 8    // fastcgi_pass の宛先ごとの常設接続数（ワーカー単位）
+#define CLIENT_BODY_BUFFER_SIZE (1024 * 1024) // これを超えるボディは一時ファイルへ（client_body_buffer_size の既定値）
+
 // サーバー全体を管理するクラス
 class Server
 {
@@ -27,9 +53,12 @@ private:
 	// -----------------------------
 	// メンバ変数
 	// -----------------------------
-	ServerConfig cfg;					   // サーバー設定
+	const ServerConfig &cfg;			   // サーバー設定（全ワーカーで共有・読み取り専用）
 	int serverFd;						   // listen用ソケット
-	pollfd fds[MAX_CLIENTS];			   // クライアントFD監視配列
+	Reactor *reactor;					   // FD監視（Worker が所有）
+	WorkerStats *stats;					   // ワーカー単位のカウンタ
+	BufferPool *pool;					   // ワーカー単位の受信バッファプール
+	const DateCache *date;				   // ワーカー単位の Date ヘッダ
 	int port;							   // 待ち受けポート番号
 	std::string host;					   // 追加: 待ち受けホストアドレス
 	std::string root;					   // 追加: ドキュメントルート
@@ -37,23 +66,38 @@ private:
 
 	std::map<int, ClientInfo> clients; // fd -> ClientInfo 対応表
 
-	// Locationマッチ結果構造体
+	LocationRouter router; // cfg.location を組み立てた基数木（LocationRuntime も持つ）
+
+	// Locationマッチ結果構造体（どちらも router を指すのでコピーしない）
 	struct LocationMatch
 	{
-		const ServerConfig::Location *loc;
-		std::string path; // cfg.location のキー（例: "/delete/"）
-		LocationMatch() : loc(NULL), path() {}
+		const LocationRuntime *loc;
+		const std::string *path; // cfg.location のキー（例: "/delete/"。一致なしなら空文字列）
+		LocationMatch() : loc(NULL), path(NULL) {}
 	};
 
 	// -----------------------------
 	// ここから追加：CGI対応用
 	// -----------------------------
 	std::map<int, CgiProcess> cgiMap; // key: outFd, value: 管理情報
+	std::deque<CgiPending> cgiWaiting; // cgi_max_procs の空き待ち（到着順）
+	std::map<pid_t, long long> dyingCgi; // SIGTERM した子 → SIGKILL する期限（回収まで持つ）
+
+	// FastCGI（fastcgi_pass）: 宛先ごとに常設接続を使い回す
+	std::map<int, FastCgiConn> fcgiConns;	// key: 接続FD
+	std::deque<FastCgiPending> fcgiWaiting; // 空き接続待ち（到着順）
+
+	TimerQueue timers; // クライアント / CGI の期限
+	OpenFileCache fileCache; // 静的ファイルの fd / メタデータ（open_file_cache）
+	ErrorPages errorResponses; // error_page などを組み立て済みのレスポンス
+	GzipCache gzipCache; // その場で gzip した静的ファイル
+	DirListingCache dirListings; // autoindex の一覧（ディレクトリの mtime で作り直す）
+	ServerStats serverStats; // この server ブロックのカウンタ（stub_status で全ワーカー分を足す）
 
 	// -----------------------------
 	// 初期化系
 	// -----------------------------
-	bool createSocket();
+	bool createSocket(bool reusePort);
 	bool bindAndListen();
 	bool setNonBlocking(int fd);
 
@@ -62,6 +106,7 @@ private:
 	// -----------------------------
 	void handleNewConnection();
 	int acceptClient(); // accept + nonblocking設定
+	void pauseAccept();
 	void handleDisconnect(int fd, int bytes);
 	void handleConnectionClose(int fd);
 	void removeClient(int fd);
@@ -71,37 +116,77 @@ private:
 	// クライアント受信処理
 	// -----------------------------
 	void handleClient(int fd);
-	std::string extractNextRequest(int clientFd, std::string &recvBuffer,
-									   Request &currentRequest);
-	bool isContentLengthExceeded(const Request &req, const std::string &recvBuffer);
+	void processBufferedRequests(int fd);
+	bool checkPendingBodySize(int fd);
+	void sendContinueIfExpected(int fd);
+	void rejectPendingBody(int fd, int status, const LocationRuntime *loc);
+	bool spoolBodyIfLarge(int fd);
+	bool streamMultipartUpload(int fd);
+	void discardBodyFile(Request &req);
+	void discardUpload(int fd);
+	bool wantsKeepAlive(const Request &req, const ClientInfo &client) const;
+	bool extractNextRequest(int clientFd, std::string &recvBuffer,
+							Request &currentRequest);
 	void sendHttpError(int clientFd, int status, const std::string &msg,
 					   size_t parsedLength, std::string &recvBuffer);
 	bool isMethodAllowed(const std::string &method,
-						 const ServerConfig::Location *loc);
-	bool checkMaxBodySize(int fd, int bytes, const ServerConfig &cfg, const ServerConfig::Location *loc);
-	bool handleMethodCheck(int fd, Request &req, const ServerConfig::Location *loc, size_t reqSize);
-	void processRequest(int fd, Request &req, const ServerConfig::Location *loc,
-						const std::string &locPath, size_t reqSize);
-	bool handleRedirect(int fd, const ServerConfig::Location *loc);
+						 const LocationRuntime *loc);
+	bool checkMaxBodySize(int fd, unsigned long long bytes, const ServerConfig &cfg, const LocationRuntime *loc);
+	bool handleMethodCheck(int fd, Request &req, const LocationRuntime *loc);
+	void processRequest(int fd, Request &req, const LocationRuntime *loc,
+						const std::string &locPath);
+	bool handleRedirect(int fd, const LocationRuntime *loc);
 
 	// -----------------------------
 	// クライアント送信処理
 	// -----------------------------
 	void handleClientSend(int fd);
 	void queueSend(int fd, const std::string &data);
+	void queueSend(int fd, const HttpResponse &res);
+	void updateClientEvents(int fd);
+
+	// -----------------------------
+	// 統計（stub_status）
+	// -----------------------------
+	void beginRequestStats(ClientInfo &client, const Request &req, const LocationRuntime *loc);
+	void countResponse(ClientInfo &client, const std::string &data);
+	void endRequestStats(ClientInfo &client);
+	void refreshCgiGauge();
+	void sendStubStatus(int fd, const Request &req);
+
+	// -----------------------------
+	// タイムアウト管理
+	// -----------------------------
+	void refreshClientTimer(int fd);
+	void endCgiWait(int clientFd);
+	void expireClient(const TimerEntry &t, long long now);
+	void expireCgi(const TimerEntry &t, long long now);
+	void expireFastCgi(const TimerEntry &t, long long now);
+	void expireCgiKill(const TimerEntry &t, long long now);
 
 	// -----------------------------
 	// ここから追加：CGI対応用
 	// -----------------------------
 	bool isCgiRequest(const Request &req);													   // CGI判定関数
-	void startCgiProcess(int clientFd, const Request &req, const ServerConfig::Location &loc); // CGI実行関数
-	void handleCgiOutput(int outFd);
+	void startCgiProcess(int clientFd, const Request &req, const LocationRuntime &loc); // CGI実行関数
+	bool launchCgi(CgiPending &p);
+	void dispatchWaitingCgi();
+	void handleCgiOutput(CgiProcess &proc);
 	void handleCgiClose(int outFd);
+	void completeCgi(int outFd);
 	void handleCgiError(int outFd);
-	void handleCgiInput(int fd);
-	CgiProcess* getCgiProcessByFd(int fd);
-	CgiProcess* getCgiProcessByInFd(int inFd);
-	std::string buildHttpResponseFromCgi(const std::string &cgiOutput);
+	void discardCgi(std::map<int, CgiProcess>::iterator it);
+	void terminateCgi(pid_t pid);
+	void handleCgiInput(CgiProcess *proc);
+	void closeCgiFd(int &fd);
+	void consumeCgiOutput(CgiProcess &proc, const char *buf, size_t n);
+	void finishCgiResponse(CgiProcess &proc, bool failed);
+	void queueCgiError(int clientFd, int code, const std::string &message);
+	std::string buildCgiResponseHead(const std::string &cgiHeaders, CgiProcess &proc, long long knownLength);
+	void forwardCgiBody(CgiProcess &proc, const char *data, size_t len);
+	void resumeCgiOutput(int clientFd);
+	void closeIfDone(int clientFd);
+	bool clientShouldClose(int clientFd) const;
 	std::string buildHttpErrorPage(int code, const std::string &message);
 	void registerCgiProcess(int clientFd, pid_t pid,
 								int inFd, int outFd, const std::string &body,
@@ -109,13 +194,28 @@ private:
 	Server::LocationMatch getLocationForUri(const std::string &uri) const;
 	void sendGatewayTimeout(int clientFd);
 
+	// -----------------------------
+	// FastCGI
+	// -----------------------------
+	void startFastCgi(int clientFd, const Request &req, const LocationRuntime &loc);
+	bool dispatchFastCgi(FastCgiPending &p);
+	void dispatchWaitingFastCgi(const std::string &addr);
+	void failFastCgiRequest(FastCgiPending &p, int status);
+	void handleFastCgiEvent(FastCgiConn &c, short revents);
+	void readFastCgi(int fd);
+	void flushFastCgi(int fd);
+	void updateFastCgiEvents(int fd);
+	void finishFastCgi(int fd, bool failed);
+	void dropFastCgiConn(int fd, int status);
+	void detachFastCgiClient(int clientFd);
+
 	// -----------------------------
 	// ここから追加： POST処理用
 	// -----------------------------
-	void handlePost(int fd, Request &req, const ServerConfig::Location *loc);
-	void handleMultipartForm(int fd, Request &req, const ServerConfig::Location *loc);
-	void handleUrlEncodedForm(int fd, Request &req, const ServerConfig::Location *loc);
-	void handleChunkedBody(int fd, Request &req, const ServerConfig::Location *loc);
+	void handlePost(int fd, Request &req, const LocationRuntime *loc);
+	void handleMultipartForm(int fd, Request &req, const LocationRuntime *loc);
+	void handleUrlEncodedForm(int fd, Request &req, const LocationRuntime *loc);
+	void handleChunkedBody(int fd, Request &req, const LocationRuntime *loc);
 
 	int findFdByRecvBuffer(const std::string &buffer) const;
 
@@ -129,19 +229,18 @@ public:
 	// -----------------------------
 	// 初期化 / メインループ
 	// -----------------------------
-	bool init();
+	bool init(Reactor *reactor, WorkerStats *stats, BufferPool *pool, const DateCache *date,
+			  bool reusePort);
 
 	int getServerFd() const;
-	std::vector<int> getClientFds() const;
-	CgiProcess* getCgiProcess(int fd);
 
 	// ServerManager から呼ばれる安全な公開インターフェース
-	void onPollEvent(int fd, short revents);
+	void onPollEvent(const ReactorEvent &ev);
 
-	std::vector<int> getCgiFds() const; // 現在監視中のCGI出力FDリスト
-	void checkCgiTimeouts(int maxLoops);
-	bool hasPendingSend(int fd) const;
-	void checkClientTimeouts(const int POLL_SLICE_MS, const int READ_TIMEOUT_MS);
+	long long nextTimerDeadline() const; // 最も近い期限（無ければ -1）
+	void processTimers(long long now);
+	void reapChildren(); // SIGCHLD の後に Worker から呼ばれる（ブロックしない）
+	void reloadErrorPages(); // SIGHUP の後に Worker から呼ばれる
 };
 
 #endif
@@ -4,25 +4,20 @@
 #include <vector>
 #include <string>
 #include <map>
-#include <poll.h>
 #include "Server.hpp"
 #include "ConfigParser.hpp"
-
-// pollで管理するFD情報
-struct PollEntry {
-    int fd;
-    short events;
-    Server* server;
-    int clientFd;        // どのクライアントに紐づくCGIか
-    bool isCgiFd;        // CGI用パイプかどうか
-};
+#include "Worker.hpp"
 
 class ServerManager {
 private:
-    std::vector<Server*> servers;
-    std::vector<ServerConfig> configs;
-    std::vector<PollEntry> buildPollEntries();
-    void handlePollEvents(struct pollfd* fds, size_t nfds, const std::vector<PollEntry>& entries);
+    std::vector<ServerConfig> configs;  // 全ワーカーで読み取り専用に共有
+    GlobalConfig global;
+    std::vector<Worker*> workers;       // イベントループ（スレッド）ごと
+    int resolveWorkerCount() const;
+    void budgetOpenFileCache(int workerCount);
+    WorkerStats aggregateStats() const;
+    void runWorkerThreads();
+    void installChildHandler();
 
     public:
       ServerManager();
@@ -0,0 +1,45 @@
+#ifndef TIMERQUEUE_HPP
+#define TIMERQUEUE_HPP
+
+#include <cstddef>
+#include <vector>
+
+// CLOCK_MONOTONIC の現在時刻（ミリ秒）
+long long monotonicMs();
+// 同じくマイクロ秒（レイテンシの計測用）
+long long monotonicUs();
+
+// タイマーの種類
+enum TimerKind {
+    TIMER_CLIENT, // クライアント（read / write / idle）
+    TIMER_CGI,    // CGI の実行時間
+    TIMER_FASTCGI, // FastCGI の応答待ち
+    TIMER_CGI_KILL, // SIGTERM した CGI を SIGKILL する
+    TIMER_ACCEPT   // fd が尽きて止めた accept を再開する
+};
+
+struct TimerEntry {
+    long long deadline; // monotonicMs() 基準の期限
+    int fd;             // クライアントFD / CGI outFd / FastCGI 接続FD / listen FD（TIMER_CGI_KILL は pid）
+    TimerKind kind;
+};
+
+// 期限付きタイマーの最小ヒープ。
+// エントリの取り消しはせず、取り出した側が持ち主の現在の期限と照合する
+// （遅延削除）。期限の延長は持ち主側の値を書き換えるだけで O(1) になり、
+// ヒープ操作は実際に期限が来たものだけに発生する。
+class TimerQueue {
+private:
+    std::vector<TimerEntry> heap;
+
+public:
+    void schedule(int fd, TimerKind kind, long long deadline);
+    bool empty() const { return heap.empty(); }
+    size_t size() const { return heap.size(); }
+    // 最も近い期限（空なら -1）
+    long long nextDeadline() const;
+    // now までに期限が来たものを1つ取り出す
+    bool popExpired(long long now, TimerEntry &out);
+};
+
+#endif
@@ -9,12 +9,13 @@
 
 inline std::string makeUniqueName(const std::string &prefix, const std::string &ext)
 {
-    static unsigned long counter = 0;  // 同一プロセス内での重複回避
+    static unsigned long counter = 0;  // 同一プロセス内での重複回避（全スレッド共通）
     std::ostringstream oss;
 
-    // 現在時刻の取得
+    // 現在時刻の取得（ワーカースレッドから呼ばれるので localtime_r）
     std::time_t now = std::time(NULL);
-    struct std::tm *tm_now = std::localtime(&now);
+    struct std::tm tm_buf;
+    struct std::tm *tm_now = localtime_r(&now, &tm_buf);
 
     // 日時を YYYYMMDD_HHMMSS の形式で出力
     oss << prefix << "_"
@@ -24,7 +25,7 @@ inline std::string makeUniqueName(const std::string &prefix, const std::string &
         << std::setw(2) << std::setfill('0') << tm_now->tm_hour
         << std::setw(2) << std::setfill('0') << tm_now->tm_min
         << std::setw(2) << std::setfill('0') << tm_now->tm_sec
-        << "_" << counter++;
+        << "_" << __sync_fetch_and_add(&counter, 1);
 
     // 拡張子を追加
     if (!ext.empty())
@@ -0,0 +1,57 @@
+#ifndef WORKER_HPP
+#define WORKER_HPP
+
+#include <pthread.h>
+#include <vector>
+#include "ConfigParser.hpp"
+#include "Reactor.hpp"
+#include "Server.hpp"
+#include "WorkerStats.hpp"
+#include "BufferPool.hpp"
+#include "DateCache.hpp"
+
+// 起床用パイプに書くバイト（SIGHUP はエラーページの読み直し、それ以外は起こすだけ）
+enum { WAKE_RELOAD = 'h' };
+
+// 1スレッド分のイベントループ。
+// Reactor と Server（clients / cgiMap）とカウンタをスレッドごとに持ち、
+// ServerConfig だけを全スレッドで読み取り専用に共有する。
+class Worker {
+private:
+    int id;
+    int cpu;                       // ピン留め先CPU（-1 = しない）
+    Reactor *reactor;
+    std::vector<Server*> servers;
+    WorkerStats stats;
+    BufferPool pool;               // 受信バッファ（このスレッドの Server で共有）
+    DateCache date;                // Date ヘッダ（ループ1周ごとに更新）
+    int wakeFds[2];                // 停止要求などでループを起こすためのパイプ
+    int stopRequested;
+    pthread_t thread;
+    bool started;
+
+    Worker(const Worker &);
+    Worker &operator=(const Worker &);
+
+    void handleEvents(const std::vector<ReactorEvent> &events);
+    bool drainWakeup(); // WAKE_RELOAD を受け取っていれば true
+    int nextWaitMs() const;
+    void pinToCpu();
+    static void *threadMain(void *arg);
+
+public:
+    Worker(int id, int cpu);
+    ~Worker();
+
+    // reusePort: 複数ワーカーで同じポートを SO_REUSEPORT で共有する
+    bool init(const std::vector<ServerConfig> &configs, bool reusePort);
+    void run();           // 呼び出したスレッドでループする
+    bool start();         // 新しいスレッドで run()
+    void stop();          // 停止要求（別スレッドから呼んでよい）
+    int wakeupFd() const { return wakeFds[1]; } // 1バイト書くとループが起きる
+    void join();
+
+    const WorkerStats &getStats() const { return stats; }
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef WORKERSTATS_HPP
+#define WORKERSTATS_HPP
+
+#include <cstring>
+#include <vector>
+
+// ワーカースレッドごとのカウンタ。書き込むのは所有スレッドだけで、
+// 集計は ServerManager が各ワーカーの値を足し合わせて行う。
+struct WorkerStats {
+    unsigned long accepted;  // accept した接続数
+    unsigned long rejected;  // MAX_CLIENTS 超過で拒否した接続数
+    unsigned long requests;  // 処理したリクエスト数
+
+    WorkerStats() : accepted(0), rejected(0), requests(0) {}
+};
+
+// レイテンシのヒストグラムの区切り: 上限 LATENCY_FIRST_US * 2^i（i < LATENCY_BUCKETS）
+// 250us 〜 約 8.2 秒。最後の1つはそれより遅いもの（+Inf）
+#define LATENCY_BUCKETS 16
+#define LATENCY_FIRST_US 250
+
+// リクエスト数を数えるメソッドの区分
+enum StatMethod { STAT_GET, STAT_HEAD, STAT_POST, STAT_DELETE, STAT_PUT, STAT_OTHER, STAT_METHODS };
+#define STAT_STATUS_MIN 100
+#define STAT_STATUS_COUNT 500 // 100 〜 599
+
+struct LatencyHistogram {
+    unsigned long buckets[LATENCY_BUCKETS + 1]; // 累積ではなく区間ごとの件数
+    unsigned long count;
+    unsigned long sumUs;
+
+    LatencyHistogram() : count(0), sumUs(0) { std::memset(buckets, 0, sizeof(buckets)); }
+};
+
+// Server（listen ソケット）ごと・ワーカーごとのカウンタ（stub_status 用）。
+// WorkerStats と同じく書き込むのは所有スレッドだけで、読む側が全ワーカー分を足す。
+struct ServerStats {
+    unsigned long accepted;
+    unsigned long rejected;
+    unsigned long connections; // 開いている接続（ゲージ）
+    unsigned long active;      // リクエストを受けてレスポンスを送り終えていない接続（ゲージ）
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+    unsigned long cgiProcesses; // 回収前の CGI プロセス（ゲージ）
+    unsigned long cgiTimeouts;
+    unsigned long responses[STAT_METHODS][STAT_STATUS_COUNT];
+    // LocationRouter::locations() と同じ順。最後の1つは location に一致しなかったもの
+    // （起動時に大きさを決めたら変えない）
+    std::vector<LatencyHistogram> latency;
+
+    ServerStats()
+        : accepted(0), rejected(0), connections(0), active(0), bytesIn(0), bytesOut(0),
+          cgiProcesses(0), cgiTimeouts(0), latency() {
+        std::memset(responses, 0, sizeof(responses));
+    }
+};
+
+// 所有スレッドの加算と集計側の読み取りが競合しないよう relaxed な
+// atomic load/store を使う（ロック命令にはならないのでホットパスでも安い）
+inline void statAdd(unsigned long &counter, unsigned long n = 1) {
+    __atomic_store_n(&counter, counter + n, __ATOMIC_RELAXED);
+}
+
+inline void statSub(unsigned long &counter, unsigned long n = 1) {
+    __atomic_store_n(&counter, counter - n, __ATOMIC_RELAXED);
+}
+
+inline void statSet(unsigned long &counter, unsigned long v) {
+    __atomic_store_n(&counter, v, __ATOMIC_RELAXED);
+}
+
+inline unsigned long statLoad(const unsigned long &counter) {
+    return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef DIR_LISTING_HPP
+#define DIR_LISTING_HPP
+
+#include <list>
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#define AUTOINDEX_CACHE_MAX_DIRS 64  // 一覧を覚えておくディレクトリ数（ワーカー単位）
+#define AUTOINDEX_DEFAULT_LIMIT 1000 // ?limit= が無いときの1ページの件数
+#define AUTOINDEX_MAX_LIMIT 10000
+
+struct DirEntry {
+  std::string name;
+  bool isDir;
+};
+
+// 1ディレクトリ分の一覧（ディレクトリが先、その中は名前順）
+struct DirListing {
+  std::string path;
+  ino_t ino;
+  time_t mtime;
+  long mtimeNsec;
+  std::vector<DirEntry> entries;
+
+  DirListing() : path(), ino(0), mtime(0), mtimeNsec(0), entries() {}
+};
+
+// autoindex の一覧の LRU。キーはディレクトリのパスで、ディレクトリの
+// inode / mtime が変わっていれば読み直す（ヒット時も stat は1回する）。
+// 読むときは d_type で種類を決め、分からないとき（DT_UNKNOWN / シンボリック
+// リンク）だけ fstatat する。Server（ワーカー）ごとに持つのでロックはしない。
+class DirListingCache {
+private:
+  typedef std::list<DirListing> EntryList;
+  EntryList lru; // 先頭ほど最近使った
+  std::map<std::string, EntryList::iterator> index;
+  size_t maxDirs;
+
+  DirListingCache(const DirListingCache &);
+  DirListingCache &operator=(const DirListingCache &);
+
+  static bool scan(const std::string &dirPath, DirListing &out);
+
+public:
+  explicit DirListingCache(size_t maxDirs = AUTOINDEX_CACHE_MAX_DIRS);
+
+  // 開けないときは NULL（errno はそのまま）
+  const DirListing *lookup(const std::string &dirPath);
+  size_t size() const { return lru.size(); }
+};
+
+// entries[(page-1)*limit ...] の1ページ分を out に追記する（page は 1 始まり）
+void renderDirListingHtml(std::string &out, const DirListing &dir, const std::string &uriPath,
+                          size_t page, size_t limit);
+void renderDirListingJson(std::string &out, const DirListing &dir, const std::string &uriPath,
+                          size_t page, size_t limit);
+
+#endif // DIR_LISTING_HPP
@@ -0,0 +1,43 @@
+#ifndef ERROR_PAGES_HPP
+#define ERROR_PAGES_HPP
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ConfigParser.hpp"
+#include "LocationRuntime.hpp"
+
+// エラーレスポンスの組み立て済みバッファ。
+// error_page / location の return で指定されたファイルと DEFAULT_ERROR_PAGE を
+// load() で読み込み、ステータス行からボディまでを keep-alive / close の両方で
+// 作っておく。リクエスト処理中はコピーするだけでディスクは読まない。
+// Server（ワーカー）ごとに持つのでロックはしない。SIGHUP で load() し直す。
+class ErrorPages {
+public:
+  ErrorPages();
+
+  // ファイルを読み直して全部作り直す（読めないファイルは既定ページ扱い）
+  void load(const ServerConfig &cfg, const std::vector<LocationRuntime> &locations);
+
+  // out の末尾にレスポンスを追記する（Date だけは送信時の値を差し込む）
+  void append(std::string &out, const LocationRuntime *loc, int status, bool close,
+              const std::string &date);
+
+private:
+  // "Date: ..." の前後で分けて持つ
+  struct Rendered {
+    std::string headKeepAlive; // ステータス行 〜 Connection: keep-alive
+    std::string headClose;     // ステータス行 〜 Connection: close
+    std::string tail;          // Server ヘッダ, 空行, ボディ
+  };
+
+  std::map<int, Rendered> server_; // error_page / 既定ページ
+  std::map<std::pair<const LocationRuntime *, int>, Rendered> located_; // return のページ
+  std::string defaultBody_;
+  bool hasDefault_;
+
+  static Rendered render(int status, const std::string *body);
+};
+
+#endif // ERROR_PAGES_HPP
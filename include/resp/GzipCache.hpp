@@ -0,0 +1,59 @@
+#ifndef GZIP_CACHE_HPP
+#define GZIP_CACHE_HPP
+
+#include <list>
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include "resp/OpenFileCache.hpp"
+
+#define GZIP_CACHE_MAX_BYTES (16 * 1024 * 1024) // 圧縮結果を持つ合計（ワーカー単位）
+// これより大きいファイルはその場で圧縮しない。圧縮はイベントループの中で
+// 同期的に行うので、その間このワーカーの他の接続は止まる（レベル 5 で
+// 1MB あたり 40ms ほど。256KB なら 10ms 程度に収まる）
+#define GZIP_MAX_FILE_SIZE (256 * 1024)
+#define GZIP_ENTRY_OVERHEAD 128 // 1エントリの固定分（リスト / map のノードとメタデータ）
+#define GZIP_LEVEL 5
+#define GZIP_MIN_LENGTH 256 // gzip_min_length の既定値（小さいものは縮んでも得が少ない）
+
+// その場で gzip したファイルの LRU。キーはパスで、inode / mtime / サイズが
+// 変わっていれば作り直す。合計（圧縮結果 + パス + GZIP_ENTRY_OVERHEAD）が
+// maxBytes を超えたら古いものから捨てる。
+// 圧縮しても小さくならないファイルは空の結果として覚えておき、次回は圧縮しない
+// （空でも固定分は数えるので、そういうエントリばかりでも上限は効く）。
+// Server（ワーカー）ごとに持つのでロックはしない。
+class GzipCache {
+private:
+  struct Entry {
+    std::string path;
+    time_t mtime;
+    off_t size;
+    ino_t ino;
+    std::string data; // 空 = 圧縮しても得にならない
+  };
+  typedef std::list<Entry> EntryList;
+  EntryList lru; // 先頭ほど最近使った
+  std::map<std::string, EntryList::iterator> index;
+  size_t bytes;
+  size_t maxBytes;
+
+  GzipCache(const GzipCache &);
+  GzipCache &operator=(const GzipCache &);
+
+  static size_t entryBytes(const Entry &e) {
+    return GZIP_ENTRY_OVERHEAD + e.path.size() + e.data.size();
+  }
+  void evictOverflow();
+
+public:
+  explicit GzipCache(size_t maxBytes = GZIP_CACHE_MAX_BYTES);
+
+  // file を gzip したもの（NULL = 圧縮しない / できない）
+  const std::string *lookup(const FileInfo &file);
+  size_t size() const { return lru.size(); }
+};
+
+// data を gzip 形式で圧縮する（失敗したら false）
+bool gzipCompress(const char *data, size_t len, std::string &out);
+
+#endif // GZIP_CACHE_HPP
@@ -0,0 +1,39 @@
+#ifndef HEADER_WRITER_HPP
+#define HEADER_WRITER_HPP
+
+#include <cstring>
+#include <string>
+
+// out の末尾に 10 進数を書く（ostringstream を通さない）
+void appendDecimal(std::string &out, unsigned long long n);
+
+// レスポンスのステータス行とヘッダを out に直接追記する。
+// 最初に容量を確保しておくので、1レスポンスで再確保はほぼ起きない。
+//   HeaderWriter w(out);
+//   w.status(200, "OK"); w.contentLength(n); w.connection(close); w.end();
+class HeaderWriter {
+public:
+  explicit HeaderWriter(std::string &out, size_t reserve = 256) : out_(out) {
+    out_.reserve(out_.size() + reserve);
+  }
+
+  void status(int code, const std::string &reason);
+  void header(const char *name, const std::string &value);
+  void contentLength(unsigned long long n);
+  void connection(bool close) {
+    if (close)
+      raw("Connection: close\r\n");
+    else
+      raw("Connection: keep-alive\r\n");
+  }
+  void date(const std::string &httpDate) { header("Date", httpDate); }
+  // 固定のヘッダ行（"\r\n" まで含める）
+  void raw(const char *fragment) { out_.append(fragment, std::strlen(fragment)); }
+  // Server ヘッダと空行でヘッダを閉じる
+  void end() { raw("Server: webserv/0.1\r\n\r\n"); }
+
+private:
+  std::string &out_;
+};
+
+#endif // HEADER_WRITER_HPP
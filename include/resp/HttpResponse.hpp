@@ -0,0 +1,33 @@
+#ifndef HTTP_RESPONSE_HPP
+#define HTTP_RESPONSE_HPP
+
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// ResponseBuilder が返すレスポンス。
+// data（ヘッダ + 小さい本文）の後ろに、ファイルの [fileOffset, fileOffset+fileLength)
+// を sendfile で続けて送る。fileFd の所有権は受け取った側（Server）に移る。
+// parts が空でなければ multipart/byteranges: fileOffset / fileLength の代わりに
+// 各 part の head と範囲を順に送り、最後に trailer を送る。
+struct HttpResponse {
+    struct Part {
+        std::string head;  // 区切り行と part のヘッダ
+        off_t offset;
+        off_t length;
+    };
+
+    std::string data;
+    int fileFd;        // -1 = ファイル本文なし
+    off_t fileOffset;
+    off_t fileLength;
+    std::vector<Part> parts;
+    std::string trailer; // 閉じの区切り行
+
+    HttpResponse() : data(), fileFd(-1), fileOffset(0), fileLength(0), parts(), trailer() {}
+    // 文字列だけのレスポンスはそのまま変換できるようにしておく
+    HttpResponse(const std::string &s)
+        : data(s), fileFd(-1), fileOffset(0), fileLength(0), parts(), trailer() {}
+};
+
+#endif // HTTP_RESPONSE_HPP
@@ -0,0 +1,67 @@
+#ifndef OPEN_FILE_CACHE_HPP
+#define OPEN_FILE_CACHE_HPP
+
+#include <list>
+#include <map>
+#include <string>
+#include <sys/types.h>
+
+// open_file_cache を書かなかったときの上限。実際にはこれと fd の上限から
+// 決めた値の小さい方になる（ServerManager::budgetOpenFileCache）
+#define OPEN_FILE_CACHE_DEFAULT_MAX 256
+
+// キャッシュ済みのファイル情報。fd はキャッシュが所有するので、
+// レスポンスに持たせるときは dup() すること（sendfile はオフセットを
+// 引数で渡すので共有 fd でも位置は競合しない）。
+struct FileInfo {
+    std::string path;
+    int fd;             // 通常ファイルのみ（ディレクトリは -1）
+    bool isDir;
+    off_t size;
+    time_t mtime;
+    ino_t ino;
+    dev_t dev;
+    std::string mime;   // 空なら未設定（呼び出し側が埋める）
+    std::string etag;   // 強い ETag（同上）
+    std::string lastModified; // Last-Modified の値（同上）
+    long long validatedAt; // 最後に stat で確かめた時刻（monotonicMs）
+
+    FileInfo() : path(), fd(-1), isDir(false), size(0), mtime(0), ino(0), dev(0),
+                 mime(), etag(), lastModified(), validatedAt(0) {}
+};
+
+// nginx の open_file_cache 相当。パス → (fd, サイズ, mtime, inode, MIME, dir判定)
+// の LRU。validMs 以内のヒットはシステムコールなしで返し、過ぎたら stat で
+// 変化を確かめて（inode / mtime / サイズ）変わっていれば開き直す。
+// ワーカー（Server）ごとに持つのでロックはしない。
+class OpenFileCache {
+private:
+    typedef std::list<FileInfo> EntryList;
+    EntryList lru;                                  // 先頭ほど最近使った
+    std::map<std::string, EntryList::iterator> index;
+    size_t maxEntries;
+    long long validMs;
+
+    OpenFileCache(const OpenFileCache &);
+    OpenFileCache &operator=(const OpenFileCache &);
+
+    bool load(const std::string &path, FileInfo &out) const;
+    void release(FileInfo &e) const;
+    void evictOverflow();
+
+public:
+    // maxEntries 0 ならキャッシュしない（毎回 stat で確認し、直近1件だけ保持）
+    OpenFileCache(size_t maxEntries = 0, long long validMs = 0);
+    ~OpenFileCache();
+
+    void configure(size_t maxEntries, long long validMs);
+    // 見つからない / 開けないときは NULL（errno は stat / open のもの。
+    // 呼び出し側は ENOENT と EACCES などを区別して 404 / 403 / 500 を返す）
+    FileInfo *lookup(const std::string &path);
+    void invalidate(const std::string &path);
+    // fd が尽きた（EMFILE / ENFILE）ときに古い方の半分を閉じる。閉じた数を返す
+    size_t shed();
+    size_t size() const { return lru.size(); }
+};
+
+#endif // OPEN_FILE_CACHE_HPP
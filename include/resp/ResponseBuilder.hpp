@@ -3,32 +3,62 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include "RequestParser.hpp"
 #include "ConfigParser.hpp"
+#include "DateCache.hpp"
+#include "LocationRuntime.hpp"
+#include "resp/DirListing.hpp"
+#include "resp/HttpResponse.hpp"
+#include "resp/OpenFileCache.hpp"
 
 #define DEFAULT_ERROR_PAGE "./assets/errors/404_default.html"
 
+class ErrorPages;
+class GzipCache;
+
+// Range（bytes=...）の1範囲。last は含む
+struct ByteRange {
+    off_t first;
+    off_t last;
+};
+
+// 簡易 reason phrase（知らないコードは "Unknown"）
+std::string reasonPhrase(int code);
+
 class ResponseBuilder {
 public:
-    // メインディスパッチャ
-    std::string generateResponse(
+    // リクエストごとに作るので、キャッシュは全部ワーカー（Server）のものを借りる。
+    // keepAlive: 正常系レスポンスに "Connection: keep-alive" を付ける
+    // files: ワーカーの open_file_cache（必須）
+    // errors: 組み立て済みのエラーページ（NULL なら本文なしで返す）
+    // date: ワーカーの Date キャッシュ（必須）
+    // gzip: その場で圧縮した結果のキャッシュ（NULL なら .gz / .br があるときだけ圧縮で返す）
+    // dirs: autoindex の一覧キャッシュ（必須）
+    ResponseBuilder(bool keepAlive, OpenFileCache *files, ErrorPages *errors,
+                    const DateCache *date, GzipCache *gzip, DirListingCache *dirs)
+        : keepAlive_(keepAlive), files_(files), errors_(errors), date_(date), gzip_(gzip),
+          varyEncoding_(false), dirs_(dirs) {}
+
+    // メインディスパッチャ（GET の本文はファイル fd のまま返す）
+    HttpResponse generateResponse(
         const Request &req,
         const ServerConfig &cfg,
-        const ServerConfig::Location *loc,
+        const LocationRuntime *loc,
         const std::string &locPath);
 
     // GET / HEAD
-    std::string handleGetLike(
+    HttpResponse handleGetLike(
         const Request &req,
         const ServerConfig &cfg,
-        const ServerConfig::Location *loc,
+        const LocationRuntime *loc,
         const std::string &locPath);
 
     // DELETE
     std::string handleDelete(
         const Request &req,
         const ServerConfig &cfg,
-        const ServerConfig::Location *loc,
+        const LocationRuntime *loc,
         const std::string &locPath);
 
     // 405
@@ -52,7 +82,7 @@ public:
     // 追加分: エラーページ
     std::string buildErrorResponse(
         const ServerConfig &cfg,
-        const ServerConfig::Location *loc,
+        const LocationRuntime *loc,
         int statusCode,
         bool close = true) const;
 
@@ -62,9 +92,17 @@ public:
         bool close = true) const;
 
   private:
+    bool keepAlive_;
+    OpenFileCache *files_;
+    ErrorPages *errors_;
+    const DateCache *date_;
+    GzipCache *gzip_;
+    bool varyEncoding_; // このレスポンスに Vary: Accept-Encoding を付ける
+    DirListingCache *dirs_;
+
     bool isTraversal(const std::string &uri) const;
     std::string mergeRoots(const ServerConfig &cfg,
-                           const ServerConfig::Location *loc) const;
+                           const LocationRuntime *loc) const;
     std::string stripLocationPrefix(const std::string &uri,
                                     const std::string &locPath) const;
     std::string resolvePathForGet(const std::string &docRoot,
@@ -73,18 +111,35 @@ public:
                                   bool &isDirOut) const;
     std::string resolvePathForDelete(const std::string &docRoot,
                                      const std::string &relativeUri) const;
-    std::string buildOkResponseFromFile(
-        const std::string &absPath,
+    HttpResponse buildOkResponseFromFile(
+        FileInfo &file,
+        const LocationRuntime *loc,
         bool headOnly,
         bool close);
+    // 条件付き GET と Range / If-Range を見て 200 / 206 / 304 / 416 を選ぶ
+    HttpResponse serveFile(const Request &req, FileInfo &file, const LocationRuntime *loc);
+    HttpResponse buildRangeResponse(FileInfo &file, const LocationRuntime *loc,
+                                    const std::vector<ByteRange> &ranges, bool close);
+    std::string buildNotModified(FileInfo &file, const LocationRuntime *loc,
+                                 const char *encoding, bool close) const;
+    // Accept-Encoding に合う圧縮表現があれば out に作って true
+    bool serveEncoded(const Request &req, FileInfo &file, const LocationRuntime *loc,
+                      HttpResponse &out);
+    HttpResponse buildEncodedResponse(FileInfo &file, const LocationRuntime *loc,
+                                      const char *encoding, int fd, off_t length,
+                                      const std::string *body, bool headOnly, bool close);
+    // autoindex（?page= / ?limit= / ?format=html|json）
+    HttpResponse buildAutoIndexResponse(const DirListing &dir, const LocationRuntime *loc,
+                                        const std::string &uriPath, const std::string &query,
+                                        bool headOnly) const;
     std::string guessContentType(const std::string &path) const;
-    std::string httpDate_() const;
+    const std::string &httpDate_() const;
 
   // ★ここを追加：内部用の3引数版は private ヘルパとして別名にする
-  std::string handleGetLikeCore(const Request&, const ServerConfig&,
-                                const ServerConfig::Location*, const std::string &locPath);
+  HttpResponse handleGetLikeCore(const Request&, const ServerConfig&,
+                                const LocationRuntime*, const std::string &locPath);
   std::string handleDeleteCore(const Request&, const ServerConfig&,
-                               const ServerConfig::Location*);
+                               const LocationRuntime*);
 };
 
 #endif // RESPONSE_BUILDER_HPP
@@ -0,0 +1,39 @@
+#include "BufferPool.hpp"
+
+const size_t BufferPool::RECV_CHUNK_MIN;
+const size_t BufferPool::RECV_CHUNK_MAX;
+
+BufferPool::BufferPool(size_t maxFree, size_t maxCapacity)
+    : freeList(), scratch(), maxFree(maxFree), maxCapacity(maxCapacity) {
+    freeList.reserve(maxFree);
+}
+
+char *BufferPool::recvScratch() {
+    if (scratch.empty())
+        scratch.resize(RECV_CHUNK_MAX);
+    return &scratch[0];
+}
+
+void BufferPool::acquire(std::string &buf) {
+    if (!buf.empty() || buf.capacity() >= RECV_CHUNK_MIN)
+        return; // 受信途中 or すでに十分な容量がある
+    if (freeList.empty()) {
+        buf.reserve(RECV_CHUNK_MIN);
+        return;
+    }
+    buf.swap(freeList.back());
+    freeList.pop_back();
+}
+
+void BufferPool::release(std::string &buf) {
+    if (!buf.empty())
+        return;
+    if (buf.capacity() >= RECV_CHUNK_MIN && buf.capacity() <= maxCapacity &&
+        freeList.size() < maxFree) {
+        freeList.push_back(std::string());
+        freeList.back().swap(buf);
+        return;
+    }
+    // 大きすぎる / プールが満杯なら容量ごと捨てる
+    std::string().swap(buf);
+}
@@ -8,6 +8,8 @@ std::vector<ServerConfig>
 ConfigParser::getServerConfigs(const std::string &path) {
   std::ifstream file;
   init_ServerConfig();
+  _global.workerThreads = 1;
+  _global.workerCpuAffinity = false;
   file.open(path.c_str(), std::ios::in); // 読み込み専用で開く
 
   if (!file.is_open()) {
@@ -24,6 +26,10 @@ ConfigParser::getServerConfigs(const std::string &path) {
       continue;
     }
     if (_inside_server == false && _inside_location == false) {
+      if (line.substr(0, 6) != "server" && line[line.length() - 1] == ';') {
+        parse_global(line.substr(0, line.length() - 1));
+        continue;
+      }
       if (line.substr(0, 6) == "server") {
         line = trim_first_last_space(line.substr(6, line.length()));
         if (line.length() == 1 && line[0] == '{') {
@@ -127,6 +133,10 @@ bool ConfigParser::is_duplicate_item(std::string nest, std::string item,
       if (loc->autoindex != "")
         return true;
     }
+    if (item == "autoindex_format") {
+      if (loc->autoindex_format != "")
+        return true;
+    }
     if (item == "upload_path") {
       if (loc->upload_path != "")
         return true;
@@ -139,6 +149,26 @@ bool ConfigParser::is_duplicate_item(std::string nest, std::string item,
       if (loc->cgi_path != "")
         return true;
     }
+    if (item == "fastcgi_pass") {
+      if (loc->fastcgi_pass != "")
+        return true;
+    }
+    if (item == "etag") {
+      if (loc->etag != "")
+        return true;
+    }
+    if (item == "cache_control") {
+      if (loc->cache_control != "")
+        return true;
+    }
+    if (item == "gzip") {
+      if (loc->gzip != "")
+        return true;
+    }
+    if (item == "stub_status") {
+      if (loc->stub_status != "")
+        return true;
+    }
   }
   return false;
 }
@@ -176,6 +206,37 @@ void ConfigParser::parse_server_inside(const std::string &str) {
       }
       _tmp_location_name = words[1];
       _inside_location = true;
+    } else if (words[0] == "keepalive_timeout") {
+      if (words.size() != 2 || std::atoi(words[1].c_str()) < 0) {
+        throw std::runtime_error("Invalid Configuration File - keepalive_timeout");
+      }
+      _cfg.keepaliveTimeout = std::atoi(words[1].c_str());
+    } else if (words[0] == "keepalive_requests") {
+      if (words.size() != 2 || std::atoi(words[1].c_str()) < 0) {
+        throw std::runtime_error("Invalid Configuration File - keepalive_requests");
+      }
+      _cfg.keepaliveRequests = std::atoi(words[1].c_str());
+    } else if (words[0] == "open_file_cache") {
+      if (words.size() != 2) {
+        throw std::runtime_error("Invalid Configuration File - open_file_cache");
+      }
+      if (words[1] == "off") {
+        _cfg.openFileCacheMax = 0;
+      } else if (std::atoi(words[1].c_str()) > 0) {
+        _cfg.openFileCacheMax = std::atoi(words[1].c_str());
+      } else {
+        throw std::runtime_error("Invalid Configuration File - open_file_cache");
+      }
+    } else if (words[0] == "open_file_cache_valid") {
+      if (words.size() != 2 || std::atoi(words[1].c_str()) < 0) {
+        throw std::runtime_error("Invalid Configuration File - open_file_cache_valid");
+      }
+      _cfg.openFileCacheValid = std::atoi(words[1].c_str());
+    } else if (words[0] == "cgi_max_procs") {
+      if (words.size() != 2 || std::atoi(words[1].c_str()) < 0) {
+        throw std::runtime_error("Invalid Configuration File - cgi_max_procs");
+      }
+      _cfg.cgiMaxProcs = std::atoi(words[1].c_str());
     } else if (words[0] == "server_name") {
       ;
     }
@@ -194,6 +255,11 @@ void ConfigParser::parse_server_inside(const std::string &str) {
         throw std::runtime_error("Invalid Configuration File - autoindex");
       }
       _cfg.location[_tmp_location_name].autoindex = words[1];
+    } else if (words[0] == "autoindex_format") {
+      if (words.size() != 2 || (words[1] != "html" && words[1] != "json")) {
+        throw std::runtime_error("Invalid Configuration File - autoindex_format");
+      }
+      _cfg.location[_tmp_location_name].autoindex_format = words[1];
     } else if (words[0] == "upload_path") {
       if (words.size() != 2) {
         throw std::runtime_error("Invalid Configuration File - upload_path");
@@ -205,16 +271,56 @@ void ConfigParser::parse_server_inside(const std::string &str) {
       }
       _cfg.location[_tmp_location_name].index = words[1];
     } else if (words[0] == "max_body_size") {
-      if (words.size() != 2) {
+      if (words.size() != 2 ||
+          !parse_size(words[1], _cfg.location[_tmp_location_name].max_body_size)) {
         throw std::runtime_error("Invalid Configuration File - max_body_size");
       }
-      _cfg.location[_tmp_location_name].max_body_size =
-          std::atoi(words[1].c_str());
+    } else if (words[0] == "client_body_buffer_size") {
+      if (words.size() != 2 ||
+          !parse_size(words[1], _cfg.location[_tmp_location_name].client_body_buffer_size)) {
+        throw std::runtime_error("Invalid Configuration File - client_body_buffer_size");
+      }
     } else if (words[0] == "cgi_path") {
       if (words.size() != 2) {
         throw std::runtime_error("Invalid Configuration File - cgi_path");
       }
       _cfg.location[_tmp_location_name].cgi_path = words[1];
+    } else if (words[0] == "fastcgi_pass") {
+      if (words.size() != 2 ||
+          (words[1].compare(0, 5, "unix:") != 0 && words[1].find(':') == std::string::npos)) {
+        throw std::runtime_error("Invalid Configuration File - fastcgi_pass");
+      }
+      _cfg.location[_tmp_location_name].fastcgi_pass = words[1];
+    } else if (words[0] == "etag") {
+      if (words.size() != 2 ||
+          (words[1] != "on" && words[1] != "weak" && words[1] != "off")) {
+        throw std::runtime_error("Invalid Configuration File - etag");
+      }
+      _cfg.location[_tmp_location_name].etag = words[1];
+    } else if (words[0] == "cache_control") {
+      // "public, max-age=3600" のように空白を含むので残りを全部つなぐ
+      if (words.size() < 2) {
+        throw std::runtime_error("Invalid Configuration File - cache_control");
+      }
+      std::string value = words[1];
+      for (size_t i = 2; i < words.size(); ++i)
+        value += " " + words[i];
+      _cfg.location[_tmp_location_name].cache_control = value;
+    } else if (words[0] == "gzip") {
+      if (words.size() != 2 || (words[1] != "on" && words[1] != "off")) {
+        throw std::runtime_error("Invalid Configuration File - gzip");
+      }
+      _cfg.location[_tmp_location_name].gzip = words[1];
+    } else if (words[0] == "gzip_min_length") {
+      if (words.size() != 2 ||
+          !parse_size(words[1], _cfg.location[_tmp_location_name].gzip_min_length)) {
+        throw std::runtime_error("Invalid Configuration File - gzip_min_length");
+      }
+    } else if (words[0] == "stub_status") {
+      if (words.size() != 2 || (words[1] != "on" && words[1] != "off")) {
+        throw std::runtime_error("Invalid Configuration File - stub_status");
+      }
+      _cfg.location[_tmp_location_name].stub_status = words[1];
     } else if (words[0] == "return") {
       if (words.size() != 3) {
         throw std::runtime_error("Invalid Configuration File - return");
@@ -231,10 +337,70 @@ void ConfigParser::parse_server_inside(const std::string &str) {
   }
 }
 
+// server ブロック外の設定（worker_threads / worker_cpu_affinity）
+void ConfigParser::parse_global(const std::string &str) {
+  std::vector<std::string> words = parse_by_space(str);
+  if (words.empty()) {
+    throw std::runtime_error("Invalid Configuration File - not server");
+  }
+  if (words[0] == "worker_threads") {
+    if (words.size() != 2) {
+      throw std::runtime_error("Invalid Configuration File - worker_threads");
+    }
+    if (words[1] == "auto") {
+      _global.workerThreads = 0;
+    } else {
+      int n = std::atoi(words[1].c_str());
+      if (n < 1 || n > 256) {
+        throw std::runtime_error("Invalid Configuration File - worker_threads");
+      }
+      _global.workerThreads = n;
+    }
+  } else if (words[0] == "worker_cpu_affinity") {
+    if (words.size() != 2 || (words[1] != "on" && words[1] != "off")) {
+      throw std::runtime_error(
+          "Invalid Configuration File - worker_cpu_affinity");
+    }
+    _global.workerCpuAffinity = (words[1] == "on");
+  } else {
+    throw std::runtime_error("Invalid Configuration File - not server");
+  }
+}
+
+// "1024" / "512k" / "10m" / "4g" をバイト数に（64bit）
+bool ConfigParser::parse_size(const std::string &str, unsigned long long &out) const {
+  if (str.empty())
+    return false;
+  size_t digits = str.find_first_not_of("0123456789");
+  if (digits == 0)
+    return false;
+  unsigned long long unit = 1;
+  if (digits != std::string::npos) {
+    if (digits != str.size() - 1)
+      return false;
+    switch (str[digits]) {
+    case 'k': case 'K': unit = 1024ULL; break;
+    case 'm': case 'M': unit = 1024ULL * 1024; break;
+    case 'g': case 'G': unit = 1024ULL * 1024 * 1024; break;
+    default: return false;
+    }
+  }
+  unsigned long long value = std::strtoull(str.substr(0, digits).c_str(), NULL, 10);
+  if (value > ~0ULL / unit)
+    return false; // オーバーフロー
+  out = value * unit;
+  return true;
+}
+
 void ConfigParser::init_ServerConfig() {
   _cfg.port = -1;
   _cfg.host = "";
   _cfg.root = "";
+  _cfg.keepaliveTimeout = 5;
+  _cfg.keepaliveRequests = 100;
+  _cfg.openFileCacheMax = -1;
+  _cfg.openFileCacheValid = 10;
+  _cfg.cgiMaxProcs = 16;
 //   _cfg.server_name = "";
   _cfg.location.clear();
   _cfg.errorPages.clear();
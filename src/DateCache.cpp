@@ -0,0 +1,95 @@
+#include "DateCache.hpp"
+#include <cstring>
+
+static const char *const kDays[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char *const kMonths[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+static void put2(char *p, int v) {
+    p[0] = static_cast<char>('0' + v / 10);
+    p[1] = static_cast<char>('0' + v % 10);
+}
+
+// strftime はロケールに依存するので固定の表で組み立てる
+std::string formatHttpDate(time_t t) {
+    struct tm tm;
+    if (!gmtime_r(&t, &tm))
+        return std::string();
+
+    char buf[29]; // "Sun, 06 Nov 1994 08:49:37 GMT"
+    const char *d = kDays[tm.tm_wday];
+    const char *m = kMonths[tm.tm_mon];
+    int year = tm.tm_year + 1900;
+    buf[0] = d[0];
+    buf[1] = d[1];
+    buf[2] = d[2];
+    buf[3] = ',';
+    buf[4] = ' ';
+    put2(buf + 5, tm.tm_mday);
+    buf[7] = ' ';
+    buf[8] = m[0];
+    buf[9] = m[1];
+    buf[10] = m[2];
+    buf[11] = ' ';
+    put2(buf + 12, year / 100);
+    put2(buf + 14, year % 100);
+    buf[16] = ' ';
+    put2(buf + 17, tm.tm_hour);
+    buf[19] = ':';
+    put2(buf + 20, tm.tm_min);
+    buf[22] = ':';
+    put2(buf + 23, tm.tm_sec);
+    buf[25] = ' ';
+    buf[26] = 'G';
+    buf[27] = 'M';
+    buf[28] = 'T';
+    return std::string(buf, sizeof(buf));
+}
+
+static bool read2(const std::string &s, size_t pos, int &out) {
+    if (s[pos] < '0' || s[pos] > '9' || s[pos + 1] < '0' || s[pos + 1] > '9')
+        return false;
+    out = (s[pos] - '0') * 10 + (s[pos + 1] - '0');
+    return true;
+}
+
+bool parseHttpDate(const std::string &s, time_t &out) {
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    if (s.size() != 29 || s.compare(3, 2, ", ") != 0 || s.compare(25, 4, " GMT") != 0 ||
+        s[7] != ' ' || s[11] != ' ' || s[16] != ' ' || s[19] != ':' || s[22] != ':')
+        return false;
+    struct tm tm;
+    std::memset(&tm, 0, sizeof(tm));
+    int century, year;
+    if (!read2(s, 5, tm.tm_mday) || !read2(s, 12, century) || !read2(s, 14, year) ||
+        !read2(s, 17, tm.tm_hour) || !read2(s, 20, tm.tm_min) || !read2(s, 23, tm.tm_sec))
+        return false;
+    tm.tm_mon = -1;
+    for (int i = 0; i < 12; ++i) {
+        if (s.compare(8, 3, kMonths[i]) == 0)
+            tm.tm_mon = i;
+    }
+    if (tm.tm_mon < 0)
+        return false;
+    tm.tm_year = century * 100 + year - 1900;
+    out = timegm(&tm);
+    return out != static_cast<time_t>(-1);
+}
+
+DateCache::DateCache() : sec(-1), value() {
+    update();
+}
+
+void DateCache::update() {
+    update(time(NULL));
+}
+
+void DateCache::update(time_t now) {
+    if (now == sec)
+        return;
+    std::string s = formatHttpDate(now);
+    if (s.empty())
+        return;
+    sec = now;
+    value.swap(s);
+}
@@ -0,0 +1,164 @@
+#include "FastCgi.hpp"
+#include <cerrno>
+#include <cstring>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const unsigned char FCGI_VERSION_1 = 1;
+static const unsigned char FCGI_RESPONDER = 1;
+static const unsigned char FCGI_KEEP_CONN = 1;
+static const size_t FCGI_HEADER_LEN = 8;
+static const size_t FCGI_MAX_CONTENT = 65535;
+
+// ヘッダ 8 バイト（パディングで本文を 8 バイト境界に揃える）
+static void appendHeader(std::string &out, unsigned char type, unsigned short id,
+                         size_t len, unsigned char padding) {
+    char h[FCGI_HEADER_LEN];
+    h[0] = FCGI_VERSION_1;
+    h[1] = type;
+    h[2] = static_cast<char>(id >> 8);
+    h[3] = static_cast<char>(id & 0xff);
+    h[4] = static_cast<char>((len >> 8) & 0xff);
+    h[5] = static_cast<char>(len & 0xff);
+    h[6] = padding;
+    h[7] = 0;
+    out.append(h, FCGI_HEADER_LEN);
+}
+
+static void appendRecord(std::string &out, unsigned char type, unsigned short id,
+                         const char *data, size_t len) {
+    unsigned char padding = static_cast<unsigned char>((8 - len % 8) % 8);
+    appendHeader(out, type, id, len, padding);
+    out.append(data, len);
+    out.append(padding, '\0');
+}
+
+// 名前 / 値の長さは 127 以下なら1バイト、それ以上は4バイト（最上位ビット1）
+static void appendLength(std::string &out, size_t len) {
+    if (len < 128) {
+        out += static_cast<char>(len);
+        return;
+    }
+    out += static_cast<char>(((len >> 24) & 0x7f) | 0x80);
+    out += static_cast<char>((len >> 16) & 0xff);
+    out += static_cast<char>((len >> 8) & 0xff);
+    out += static_cast<char>(len & 0xff);
+}
+
+void fcgiAppendBeginRequest(std::string &out, unsigned short id, bool keepConn) {
+    char body[8];
+    std::memset(body, 0, sizeof(body));
+    body[1] = FCGI_RESPONDER;
+    body[2] = keepConn ? FCGI_KEEP_CONN : 0;
+    appendRecord(out, FCGI_BEGIN_REQUEST, id, body, sizeof(body));
+}
+
+void fcgiAppendParams(std::string &out, unsigned short id,
+                      const std::map<std::string, std::string> &params) {
+    std::string pairs;
+    for (std::map<std::string, std::string>::const_iterator it = params.begin();
+         it != params.end(); ++it) {
+        appendLength(pairs, it->first.size());
+        appendLength(pairs, it->second.size());
+        pairs += it->first;
+        pairs += it->second;
+    }
+    fcgiAppendStream(out, FCGI_PARAMS, id, pairs.data(), pairs.size());
+    if (!pairs.empty())
+        fcgiAppendStream(out, FCGI_PARAMS, id, NULL, 0);
+}
+
+void fcgiAppendStream(std::string &out, unsigned char type, unsigned short id,
+                      const char *data, size_t len) {
+    if (len == 0) {
+        appendHeader(out, type, id, 0, 0);
+        return;
+    }
+    while (len > 0) {
+        size_t n = len < FCGI_MAX_CONTENT ? len : FCGI_MAX_CONTENT;
+        appendRecord(out, type, id, data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+bool fcgiResolve(const std::string &addr, FastCgiAddr &out) {
+    out.len = 0;
+    if (addr.compare(0, 5, "unix:") == 0) {
+        struct sockaddr_un sun;
+        std::memset(&sun, 0, sizeof(sun));
+        std::string path = addr.substr(5);
+        if (path.empty() || path.size() >= sizeof(sun.sun_path))
+            return false;
+        sun.sun_family = AF_UNIX;
+        std::memcpy(sun.sun_path, path.c_str(), path.size());
+        std::memcpy(&out.sa, &sun, sizeof(sun));
+        out.len = sizeof(sun);
+        return true;
+    }
+
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos || colon == 0)
+        return false;
+    std::string host = addr.substr(0, colon);
+    std::string port = addr.substr(colon + 1);
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+        return false;
+    // 複数返ってきても使うのは最初の1つ
+    std::memcpy(&out.sa, res->ai_addr, res->ai_addrlen);
+    out.len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+int fcgiConnect(const FastCgiAddr &addr, bool &inProgress) {
+    inProgress = false;
+    if (addr.len == 0) {
+        errno = EDESTADDRREQ;
+        return -1;
+    }
+    int fd = socket(addr.sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int rc = connect(fd, reinterpret_cast<const struct sockaddr *>(&addr.sa), addr.len);
+    if (rc < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    inProgress = (rc < 0);
+    return fd;
+}
+
+void FastCgiDecoder::append(const char *data, size_t len) {
+    buf.append(data, len);
+}
+
+bool FastCgiDecoder::next(unsigned char &type, unsigned short &id, const char *&content, size_t &len) {
+    if (buf.size() - pos < FCGI_HEADER_LEN)
+        return false;
+    const unsigned char *h = reinterpret_cast<const unsigned char *>(buf.data() + pos);
+    size_t contentLen = (static_cast<size_t>(h[4]) << 8) | h[5];
+    size_t total = FCGI_HEADER_LEN + contentLen + h[6];
+    if (buf.size() - pos < total)
+        return false;
+    type = h[1];
+    id = static_cast<unsigned short>((h[2] << 8) | h[3]);
+    content = buf.data() + pos + FCGI_HEADER_LEN;
+    len = contentLen;
+    pos += total;
+    return true;
+}
+
+void FastCgiDecoder::compact() {
+    if (pos == 0)
+        return;
+    buf.erase(0, pos);
+    pos = 0;
+}
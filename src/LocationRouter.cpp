@@ -0,0 +1,95 @@
+#include "LocationRouter.hpp"
+
+static const size_t NO_NODE = static_cast<size_t>(-1);
+
+LocationRouter::LocationRouter() : nodes(1), runtimes() {}
+
+// map の順に入れるので、正規化すると同じになるキー（"/a" と "/a/"）は先のものが勝つ
+LocationRouter::LocationRouter(const ServerConfig &cfg)
+    : nodes(1), runtimes() {
+    runtimes.reserve(cfg.location.size());
+    for (std::map<std::string, ServerConfig::Location>::const_iterator it = cfg.location.begin();
+         it != cfg.location.end(); ++it) {
+        std::string path = it->first;
+        if (path.size() > 1 && path[path.size() - 1] == '/')
+            path.erase(path.size() - 1);
+        if (path.empty())
+            path = "/";
+        runtimes.push_back(LocationRuntime(cfg, it->first, it->second));
+        insert(path, static_cast<int>(runtimes.size() - 1));
+    }
+}
+
+// 子の先頭文字はすべて異なる（子の数は高々256）
+size_t LocationRouter::findChild(size_t node, unsigned char c) const {
+    const std::vector<size_t> &ch = nodes[node].children;
+    for (size_t i = 0; i < ch.size(); ++i) {
+        if (static_cast<unsigned char>(nodes[ch[i]].label[0]) == c)
+            return ch[i];
+    }
+    return NO_NODE;
+}
+
+void LocationRouter::insert(const std::string &path, int route) {
+    size_t node = 0;
+    size_t pos = 0;
+    while (pos < path.size()) {
+        size_t child = findChild(node, path[pos]);
+        if (child == NO_NODE) {
+            Node leaf;
+            leaf.label = path.substr(pos);
+            leaf.route = route;
+            nodes.push_back(leaf);
+            nodes[node].children.push_back(nodes.size() - 1);
+            return;
+        }
+
+        // 共通部分の長さ
+        const std::string &label = nodes[child].label;
+        size_t n = 0;
+        while (n < label.size() && pos + n < path.size() && label[n] == path[pos + n])
+            ++n;
+        if (n < label.size()) {
+            // ラベルの途中で分かれる → 共通部分を新しいノードに切り出す
+            Node mid;
+            mid.label = label.substr(0, n);
+            mid.children.push_back(child);
+            nodes[child].label.erase(0, n);
+            nodes.push_back(mid);
+            size_t midIdx = nodes.size() - 1;
+            std::vector<size_t> &siblings = nodes[node].children;
+            for (size_t i = 0; i < siblings.size(); ++i) {
+                if (siblings[i] == child)
+                    siblings[i] = midIdx;
+            }
+            child = midIdx;
+        }
+        node = child;
+        pos += n;
+    }
+    if (nodes[node].route < 0)
+        nodes[node].route = route;
+}
+
+// キーと同じく URI も末尾の '/' 1つは無いものとして比べる
+const LocationRuntime *LocationRouter::match(const std::string &uri) const {
+    size_t len = uri.size();
+    if (len > 1 && uri[len - 1] == '/')
+        --len;
+    int best = nodes[0].route;
+    size_t node = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t child = findChild(node, uri[pos]);
+        if (child == NO_NODE)
+            break;
+        const std::string &label = nodes[child].label;
+        if (label.size() > len - pos || uri.compare(pos, label.size(), label) != 0)
+            break;
+        pos += label.size();
+        node = child;
+        if (nodes[node].route >= 0)
+            best = nodes[node].route;
+    }
+    return best < 0 ? NULL : &runtimes[best];
+}
@@ -0,0 +1,107 @@
+#include "LocationRuntime.hpp"
+#include "log.hpp"
+#include "resp/GzipCache.hpp"
+#include <sstream>
+
+unsigned methodBit(const std::string &method) {
+    if (method == "GET")
+        return METHOD_GET;
+    if (method == "POST")
+        return METHOD_POST;
+    if (method == "DELETE")
+        return METHOD_DELETE;
+    if (method == "HEAD")
+        return METHOD_HEAD;
+    return 0;
+}
+
+static const char *redirectReason(int code) {
+    switch (code) {
+    case 302:
+        return "Found";
+    case 303:
+        return "See Other";
+    case 307:
+        return "Temporary Redirect";
+    case 308:
+        return "Permanent Redirect";
+    }
+    return "Moved Permanently";
+}
+
+// cfg.root と loc.root から実際に使うルートを決める。
+//  - loc.root が空 → cfg.root
+//  - "/" か "./" で始まる → そのまま（サーバルートとは結合しない）
+//  - それ以外 → cfg.root と連結（"./docs/" + "img/" → "./docs/img/"）
+static std::string mergeRoots(const std::string &serverRoot, const std::string &lr) {
+    if (lr.empty())
+        return serverRoot;
+    if (lr[0] == '/' || (lr.size() >= 2 && lr[0] == '.' && lr[1] == '/'))
+        return lr;
+    if (serverRoot.empty())
+        return lr;
+    if (serverRoot[serverRoot.size() - 1] == '/')
+        return serverRoot + lr;
+    return serverRoot + "/" + lr;
+}
+
+LocationRuntime::LocationRuntime()
+    : conf(NULL), key(), root(), methods(0), methodsListed(false), allow(),
+      hasRedirect(false), redirectKeepAlive(), redirectClose(), index(), autoindex(false),
+      autoindexJson(false), uploadPath(), spoolPattern(), maxBodySize(0), bodyBufferSize(0),
+      fastcgiPass(), fastcgiAddr(), etag(ETAG_STRONG), cacheControl(), gzip(false), gzipMinLength(0),
+      stubStatus(false), cgi() {}
+
+LocationRuntime::LocationRuntime(const ServerConfig &cfg, const std::string &k,
+                                 const ServerConfig::Location &loc)
+    : conf(&loc), key(k), root(mergeRoots(cfg.root, loc.root)), methods(0),
+      methodsListed(!loc.method.empty()), allow(), hasRedirect(!loc.ret.empty()),
+      redirectKeepAlive(), redirectClose(), index(loc.index), autoindex(loc.autoindex == "on"),
+      autoindexJson(loc.autoindex_format == "json"), uploadPath(loc.upload_path), spoolPattern(),
+      maxBodySize(loc.max_body_size), bodyBufferSize(loc.client_body_buffer_size),
+      fastcgiPass(loc.fastcgi_pass), fastcgiAddr(),
+      etag(loc.etag == "off" ? ETAG_OFF : loc.etag == "weak" ? ETAG_WEAK : ETAG_STRONG),
+      cacheControl(), gzip(loc.gzip == "on"),
+      gzipMinLength(loc.gzip_min_length ? loc.gzip_min_length : GZIP_MIN_LENGTH),
+      stubStatus(loc.stub_status == "on"), cgi() {
+    for (size_t i = 0; i < loc.method.size(); ++i) {
+        methods |= methodBit(loc.method[i]);
+        if (i)
+            allow += ", ";
+        allow += loc.method[i];
+    }
+    if (!methodsListed)
+        allow = "GET, HEAD, DELETE";
+
+    if (hasRedirect) {
+        // 複数あっても使うのは最初の1つ
+        std::map<int, std::string>::const_iterator it = loc.ret.begin();
+        std::ostringstream res;
+        res << "HTTP/1.1 " << it->first << " " << redirectReason(it->first) << "\r\n"
+            << "Location: " << it->second << "\r\n"
+            << "Content-Length: 0\r\n";
+        redirectKeepAlive = res.str() + "Connection: keep-alive\r\n\r\n";
+        redirectClose = res.str() + "Connection: close\r\n\r\n";
+    }
+
+    if (!loc.cache_control.empty())
+        cacheControl = "Cache-Control: " + loc.cache_control + "\r\n";
+
+    // 名前解決は起動時に1回だけ（リクエストのたびに getaddrinfo でループを止めない）。
+    // 解決できなければ、この location への FastCGI リクエストは 502 になる
+    if (!fastcgiPass.empty() && !fcgiResolve(fastcgiPass, fastcgiAddr))
+        logMessage(ERROR, "fastcgi_pass: cannot resolve " + fastcgiPass);
+
+    spoolPattern = uploadPath.empty() ? "/tmp" : uploadPath;
+    if (spoolPattern[spoolPattern.size() - 1] != '/')
+        spoolPattern += '/';
+    spoolPattern += ".body_XXXXXX";
+
+    cgi.cgiPath = loc.cgi_path;
+    cgi.scriptRoot = loc.root;
+    if (!cgi.scriptRoot.empty() && cgi.scriptRoot[cgi.scriptRoot.size() - 1] == '/')
+        cgi.scriptRoot.erase(cgi.scriptRoot.size() - 1);
+    cgi.locKey = k;
+    cgi.fixedEnv.push_back("GATEWAY_INTERFACE=CGI/1.1");
+    cgi.fixedEnv.push_back("REDIRECT_STATUS=200");
+}
@@ -0,0 +1,239 @@
+#include "Metrics.hpp"
+#include "resp/HeaderWriter.hpp"
+
+// 同じ server ブロック（全ワーカーで共有の ServerConfig）の Server をまとめる。
+// location の並びはどの Server でも同じなので、ラベルには先頭の Server のものを使う
+struct StatsMember {
+    const ServerStats *stats;
+    const std::vector<LocationRuntime> *locations;
+};
+
+struct StatsGroup {
+    const ServerConfig *cfg;
+    std::vector<StatsMember> members;
+
+    const std::vector<LocationRuntime> &locations() const { return *members[0].locations; }
+};
+
+static std::vector<StatsGroup> groups;
+
+static const char *const kMethodNames[STAT_METHODS] = {"GET", "HEAD", "POST", "DELETE", "PUT", "OTHER"};
+
+typedef unsigned long ServerStats::*Counter;
+
+static unsigned long sumCounter(const StatsGroup &g, Counter c) {
+    unsigned long total = 0;
+    for (size_t i = 0; i < g.members.size(); ++i)
+        total += statLoad(g.members[i].stats->*c);
+    return total;
+}
+
+static void appendLabelValue(std::string &out, const std::string &v) {
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (v[i] == '\\' || v[i] == '"')
+            out += '\\';
+        if (v[i] == '\n') {
+            out += "\\n";
+            continue;
+        }
+        out += v[i];
+    }
+}
+
+static void appendServerLabel(std::string &out, const StatsGroup &g) {
+    out += "server=\"";
+    appendLabelValue(out, g.cfg->host);
+    out += ':';
+    appendDecimal(out, static_cast<unsigned long long>(g.cfg->port));
+    out += '"';
+}
+
+static void appendFamily(std::string &out, const char *name, const char *type, const char *help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+// name{server="..."} value（extra は追加のラベル。"," から書く）
+static void appendSample(std::string &out, const char *name, const StatsGroup &g,
+                         const char *extra, unsigned long value) {
+    out += name;
+    out += '{';
+    appendServerLabel(out, g);
+    out += extra;
+    out += "} ";
+    appendDecimal(out, value);
+    out += '\n';
+}
+
+static void appendCounterFamily(std::string &out, const char *name, const char *type,
+                                const char *help, Counter c) {
+    appendFamily(out, name, type, help);
+    for (size_t i = 0; i < groups.size(); ++i)
+        appendSample(out, name, groups[i], "", sumCounter(groups[i], c));
+}
+
+// マイクロ秒を秒の小数で（末尾の 0 は書かない）
+static void appendSeconds(std::string &out, unsigned long long us) {
+    appendDecimal(out, us / 1000000);
+    unsigned long long frac = us % 1000000;
+    if (frac == 0)
+        return;
+    char digits[7];
+    for (int i = 5; i >= 0; --i) {
+        digits[i] = static_cast<char>('0' + frac % 10);
+        frac /= 10;
+    }
+    int len = 6;
+    while (digits[len - 1] == '0')
+        --len;
+    out += '.';
+    out.append(digits, len);
+}
+
+static void appendLatency(std::string &out, const StatsGroup &g, size_t slot,
+                          const std::string &location) {
+    unsigned long buckets[LATENCY_BUCKETS + 1] = {0};
+    unsigned long count = 0;
+    unsigned long sumUs = 0;
+    for (size_t m = 0; m < g.members.size(); ++m) {
+        const LatencyHistogram &h = g.members[m].stats->latency[slot];
+        for (size_t b = 0; b <= LATENCY_BUCKETS; ++b)
+            buckets[b] += statLoad(h.buckets[b]);
+        count += statLoad(h.count);
+        sumUs += statLoad(h.sumUs);
+    }
+    // location に一致しなかったリクエストは無ければ出さない
+    if (slot == g.locations().size() && count == 0)
+        return;
+
+    std::string labels = ",location=\"";
+    appendLabelValue(labels, location);
+    labels += '"';
+    std::string le;
+    unsigned long cumulative = 0;
+    for (size_t b = 0; b <= LATENCY_BUCKETS; ++b) {
+        cumulative += buckets[b];
+        le = labels + ",le=\"";
+        if (b == LATENCY_BUCKETS)
+            le += "+Inf";
+        else
+            appendSeconds(le, static_cast<unsigned long long>(LATENCY_FIRST_US) << b);
+        le += '"';
+        appendSample(out, "webserv_request_duration_seconds_bucket", g, le.c_str(), cumulative);
+    }
+    out += "webserv_request_duration_seconds_sum{";
+    appendServerLabel(out, g);
+    out += labels;
+    out += "} ";
+    appendSeconds(out, sumUs);
+    out += '\n';
+    appendSample(out, "webserv_request_duration_seconds_count", g, labels.c_str(), count);
+}
+
+void registerServerStats(const ServerConfig *cfg, const std::vector<LocationRuntime> *locations,
+                         const ServerStats *stats) {
+    StatsMember member;
+    member.stats = stats;
+    member.locations = locations;
+    for (size_t i = 0; i < groups.size(); ++i) {
+        if (groups[i].cfg == cfg) {
+            groups[i].members.push_back(member);
+            return;
+        }
+    }
+    StatsGroup g;
+    g.cfg = cfg;
+    g.members.push_back(member);
+    groups.push_back(g);
+}
+
+void unregisterServerStats(const ServerStats *stats) {
+    for (size_t i = 0; i < groups.size(); ++i) {
+        std::vector<StatsMember> &m = groups[i].members;
+        for (size_t j = 0; j < m.size(); ++j) {
+            if (m[j].stats != stats)
+                continue;
+            m.erase(m.begin() + j);
+            if (m.empty())
+                groups.erase(groups.begin() + i);
+            return;
+        }
+    }
+}
+
+size_t latencyBucket(long long us) {
+    long long bound = LATENCY_FIRST_US;
+    for (size_t b = 0; b < LATENCY_BUCKETS; ++b, bound <<= 1) {
+        if (us <= bound)
+            return b;
+    }
+    return LATENCY_BUCKETS;
+}
+
+void renderPrometheusMetrics(std::string &out) {
+    out.reserve(out.size() + 4096);
+
+    appendFamily(out, "webserv_connections", "gauge", "Open client connections by state.");
+    for (size_t i = 0; i < groups.size(); ++i) {
+        unsigned long open = sumCounter(groups[i], &ServerStats::connections);
+        unsigned long active = sumCounter(groups[i], &ServerStats::active);
+        if (active > open) // ワーカーごとに読む時点がずれるので
+            active = open;
+        appendSample(out, "webserv_connections", groups[i], ",state=\"active\"", active);
+        appendSample(out, "webserv_connections", groups[i], ",state=\"idle\"", open - active);
+    }
+    appendCounterFamily(out, "webserv_connections_accepted_total", "counter",
+                        "Accepted client connections.", &ServerStats::accepted);
+    appendCounterFamily(out, "webserv_connections_rejected_total", "counter",
+                        "Connections closed because MAX_CLIENTS was reached.",
+                        &ServerStats::rejected);
+
+    appendFamily(out, "webserv_http_requests_total", "counter",
+                 "Responses sent, by request method and status code.");
+    for (size_t i = 0; i < groups.size(); ++i) {
+        const StatsGroup &g = groups[i];
+        for (int m = 0; m < STAT_METHODS; ++m) {
+            for (int s = 0; s < STAT_STATUS_COUNT; ++s) {
+                unsigned long n = 0;
+                for (size_t k = 0; k < g.members.size(); ++k)
+                    n += statLoad(g.members[k].stats->responses[m][s]);
+                if (n == 0)
+                    continue;
+                std::string labels = ",method=\"";
+                labels += kMethodNames[m];
+                labels += "\",code=\"";
+                appendDecimal(labels, static_cast<unsigned long long>(STAT_STATUS_MIN + s));
+                labels += '"';
+                appendSample(out, "webserv_http_requests_total", g, labels.c_str(), n);
+            }
+        }
+    }
+
+    appendCounterFamily(out, "webserv_received_bytes_total", "counter",
+                        "Bytes read from client sockets.", &ServerStats::bytesIn);
+    appendCounterFamily(out, "webserv_sent_bytes_total", "counter",
+                        "Bytes written to client sockets.", &ServerStats::bytesOut);
+    appendCounterFamily(out, "webserv_cgi_processes", "gauge",
+                        "CGI processes that have not been reaped yet.",
+                        &ServerStats::cgiProcesses);
+    appendCounterFamily(out, "webserv_cgi_timeouts_total", "counter",
+                        "CGI processes stopped for not producing output in time.",
+                        &ServerStats::cgiTimeouts);
+
+    appendFamily(out, "webserv_request_duration_seconds", "histogram",
+                 "Time from a complete request to the last byte of its response, by location.");
+    static const std::string noLocation;
+    for (size_t i = 0; i < groups.size(); ++i) {
+        const StatsGroup &g = groups[i];
+        for (size_t l = 0; l < g.locations().size(); ++l)
+            appendLatency(out, g, l, g.locations()[l].key);
+        appendLatency(out, g, g.locations().size(), noLocation);
+    }
+}
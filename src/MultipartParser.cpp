@@ -0,0 +1,315 @@
+#include "MultipartParser.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// パートヘッダの上限（DoS防止）
+static const size_t MAX_PART_HEADER = 8192;
+
+static std::string toLower(const std::string &s) {
+    std::string r(s);
+    std::transform(r.begin(), r.end(), r.begin(), ::tolower);
+    return r;
+}
+
+// 本文が区切りで始まる場合も同じ "\r\n--boundary" で見つけられるよう、
+// 先頭に CRLF があったことにしておく（pending の初期値）
+MultipartParser::MultipartParser(const std::string &boundary, const std::string &uploadDir)
+    : state(ST_PREAMBLE), delim("\r\n--" + boundary), dir(uploadDir),
+      pending("\r\n"), partFd(-1), parts(), status(0), committed(false) {
+    if (!dir.empty() && dir[dir.size() - 1] != '/')
+        dir += '/';
+    const size_t m = delim.size();
+    for (size_t i = 0; i < 256; ++i)
+        skip[i] = m;
+    for (size_t i = 0; i + 1 < m; ++i)
+        skip[static_cast<unsigned char>(delim[i])] = m - 1 - i;
+}
+
+// 確定しなかった（途中で切断 / 413 / 形式エラー）アップロードは残さない。
+// 消すのは自分の一時ファイルだけ（rename 済みのものと既存のファイルには触らない）
+MultipartParser::~MultipartParser() {
+    closePart();
+    if (committed)
+        return;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        if (!parts[i].tmp.empty())
+            unlink(parts[i].tmp.c_str());
+        if (!parts[i].backup.empty())
+            unlink(parts[i].backup.c_str());
+    }
+}
+
+std::string MultipartParser::boundaryOf(const std::string &contentType) {
+    std::string lower = toLower(contentType);
+    size_t pos = lower.find("boundary=");
+    if (pos == std::string::npos)
+        return "";
+    pos += 9;
+    std::string b;
+    if (pos < contentType.size() && contentType[pos] == '"') {
+        size_t end = contentType.find('"', pos + 1);
+        if (end == std::string::npos)
+            return "";
+        b = contentType.substr(pos + 1, end - pos - 1);
+    } else {
+        size_t end = contentType.find_first_of("; \t", pos);
+        b = contentType.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+    }
+    if (b.empty() || b.size() > MAX_BOUNDARY)
+        return "";
+    return b;
+}
+
+// p[0..n) から区切りを探す（Horspool: 窓の末尾の文字でずらす）
+size_t MultipartParser::search(const char *p, size_t n) const {
+    const size_t m = delim.size();
+    const char *d = delim.data();
+    size_t i = 0;
+    while (i + m <= n) {
+        unsigned char last = static_cast<unsigned char>(p[i + m - 1]);
+        if (last == static_cast<unsigned char>(d[m - 1]) && std::memcmp(p + i, d, m - 1) == 0)
+            return i;
+        i += skip[last];
+    }
+    return std::string::npos;
+}
+
+// 末尾で区切りの途中かもしれないバイト数（区切りは '\r' で始まる）
+size_t MultipartParser::partialTail(const char *p, size_t n) const {
+    size_t from = n >= delim.size() ? n - (delim.size() - 1) : 0;
+    const void *cr = std::memchr(p + from, '\r', n - from);
+    if (!cr)
+        return 0;
+    return n - (static_cast<const char *>(cr) - p);
+}
+
+void MultipartParser::fail(int code) {
+    closePart();
+    if (status == 0)
+        status = code;
+    state = ST_ERROR;
+}
+
+// Content-Disposition の filename をファイル名にする（ディレクトリ部分は捨てる）。
+// Content-Disposition の無いパートは読み捨てる。
+bool MultipartParser::openPart(const std::string &head) {
+    std::string lower = toLower(head);
+    if (lower.find("content-disposition") == std::string::npos)
+        return true;
+
+    std::string name = "upload.bin";
+    size_t pos = lower.find("filename=\"");
+    if (pos != std::string::npos) {
+        pos += 10;
+        size_t end = head.find('"', pos);
+        std::string f = head.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        size_t slash = f.find_last_of("/\\");
+        if (slash != std::string::npos)
+            f.erase(0, slash + 1);
+        if (!f.empty() && f != "." && f != "..")
+            name = f;
+    }
+
+    // rename で置き換えられるよう、一時ファイルは保存先と同じディレクトリに作る
+    std::string tmpl = dir + ".upload_XXXXXX";
+    std::vector<char> buf(tmpl.begin(), tmpl.end());
+    buf.push_back('\0');
+    partFd = mkostemp(&buf[0], O_CLOEXEC);
+    if (partFd < 0) {
+        std::cerr << "Failed to open file for writing: " << tmpl << std::endl;
+        return false;
+    }
+    // 書き終わるまでは 0600 のまま（確定するときに 0644 にする）
+    Part part;
+    part.tmp.assign(&buf[0]);
+    part.dest = dir + name;
+    parts.push_back(part);
+    std::cout << "[INFO] Saving multipart upload to: " << part.dest << std::endl;
+    return true;
+}
+
+bool MultipartParser::emit(const char *p, size_t n) {
+    if (partFd < 0 || state != ST_DATA)
+        return true;
+    while (n > 0) {
+        ssize_t w = ::write(partFd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+void MultipartParser::closePart() {
+    if (partFd >= 0)
+        close(partFd);
+    partFd = -1;
+}
+
+// p[0..n) をできるだけ解析し、消費したバイト数を返す。
+// 残りは区切り / ヘッダの途中で、続きのデータが来るまで持ち越す。
+size_t MultipartParser::parse(const char *p, size_t n) {
+    size_t pos = 0;
+    while (pos < n) {
+        switch (state) {
+        case ST_PREAMBLE:
+        case ST_DATA: {
+            size_t hit = search(p + pos, n - pos);
+            if (hit == std::string::npos) {
+                size_t out = n - pos - partialTail(p + pos, n - pos);
+                if (!emit(p + pos, out)) {
+                    fail(500);
+                    return n;
+                }
+                return pos + out;
+            }
+            if (!emit(p + pos, hit)) {
+                fail(500);
+                return n;
+            }
+            closePart();
+            pos += hit + delim.size();
+            state = ST_DELIM_END;
+            break;
+        }
+
+        case ST_DELIM_END:
+            if (n - pos < 2)
+                return pos;
+            if (p[pos] == '-' && p[pos + 1] == '-') {
+                state = ST_DONE; // 以降（エピローグ）は読み捨て
+                return n;
+            }
+            if (p[pos] != '\r' || p[pos + 1] != '\n') {
+                fail(400);
+                return n;
+            }
+            pos += 2;
+            state = ST_HEAD;
+            break;
+
+        case ST_HEAD: {
+            // ヘッダが1つも無いパートは、いきなり空行
+            const char *end;
+            size_t skipLen;
+            if (n - pos >= 2 && p[pos] == '\r' && p[pos + 1] == '\n') {
+                end = p + pos;
+                skipLen = 2;
+            } else {
+                static const char crlf2[] = "\r\n\r\n";
+                end = std::search(p + pos, p + n, crlf2, crlf2 + 4);
+                skipLen = 4;
+                if (end == p + n) {
+                    if (n - pos > MAX_PART_HEADER)
+                        fail(400);
+                    return state == ST_ERROR ? n : pos;
+                }
+            }
+            if (!openPart(std::string(p + pos, end))) {
+                fail(500);
+                return n;
+            }
+            pos = (end - p) + skipLen;
+            state = ST_DATA;
+            break;
+        }
+
+        default: // ST_DONE / ST_ERROR
+            return n;
+        }
+    }
+    return pos;
+}
+
+bool MultipartParser::write(const char *data, size_t len) {
+    while (len > 0 && state != ST_DONE && state != ST_ERROR) {
+        if (pending.empty()) {
+            // 通常はここ: 受信バッファから直接書き出し、途中の分だけ持ち越す
+            size_t used = parse(data, len);
+            pending.assign(data + used, len - used);
+            break;
+        }
+        // 持ち越し分に、区切り1つ分（ヘッダ途中なら全部）を足して続きを解析
+        size_t old = pending.size();
+        size_t take = (state == ST_HEAD) ? len : std::min(len, delim.size());
+        pending.append(data, take);
+        data += take;
+        len -= take;
+        size_t used = parse(pending.data(), pending.size());
+        if (used >= old) {
+            // 持ち越し分は片付いた。残りは data の一部なので、そちらから直接続ける
+            size_t back = pending.size() - used;
+            data -= back;
+            len += back;
+            pending.clear();
+        } else {
+            pending.erase(0, used);
+        }
+    }
+    return status != 500;
+}
+
+// 全パートを本来の名前にする（全部か、何もしないか）。
+// 置き換える既存のファイルは先にハードリンクで取っておき、途中の rename が
+// 失敗したら確定済みの分を逆順に戻す。
+bool MultipartParser::commitParts() {
+    for (size_t i = 0; i < parts.size(); ++i) {
+        Part &p = parts[i];
+        if (chmod(p.tmp.c_str(), 0644) != 0)
+            return false;
+        std::string backup = p.tmp + ".orig";
+        if (link(p.dest.c_str(), backup.c_str()) == 0)
+            p.backup = backup;
+        else if (errno != ENOENT)
+            return false; // 戻せないので何も置き換えない
+    }
+
+    size_t done = 0;
+    for (; done < parts.size(); ++done) {
+        if (rename(parts[done].tmp.c_str(), parts[done].dest.c_str()) != 0)
+            break;
+        parts[done].tmp.clear();
+    }
+    if (done < parts.size()) {
+        std::cerr << "Failed to rename upload to: " << parts[done].dest << std::endl;
+        while (done > 0) {
+            Part &p = parts[--done];
+            if (!p.backup.empty() && rename(p.backup.c_str(), p.dest.c_str()) == 0)
+                p.backup.clear();
+            else if (p.backup.empty())
+                unlink(p.dest.c_str());
+        }
+        return false;
+    }
+
+    for (size_t i = 0; i < parts.size(); ++i) {
+        if (!parts[i].backup.empty())
+            unlink(parts[i].backup.c_str());
+        parts[i].backup.clear();
+    }
+    return true;
+}
+
+int MultipartParser::finish() {
+    closePart();
+    if (status != 0)
+        return status;
+    if (state != ST_DONE || parts.empty())
+        return 400;
+    if (!commitParts()) {
+        status = 500;
+        return status; // 一時ファイルはデストラクタで消える
+    }
+    committed = true;
+    return 201;
+}
@@ -0,0 +1,222 @@
+#include "Reactor.hpp"
+#include "log.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+// 1回の wait で受け取る最大イベント数
+#define REACTOR_MAX_EVENTS 256
+
+Reactor *Reactor::create() {
+#ifdef __linux__
+    EpollReactor *ep = new EpollReactor();
+    if (ep->isOpen())
+        return ep;
+    delete ep;
+    logMessage(WARNING, "epoll unavailable, falling back to poll");
+#endif
+    return new PollReactor();
+}
+
+FdSlot &Reactor::bind(int fd, short events, FdKind kind, Server *owner, void *state) {
+    if (static_cast<size_t>(fd) >= slots.size())
+        slots.resize(fd + 1 > 1024 ? fd + 1 : 1024);
+    FdSlot &s = slots[fd];
+    s.kind = kind;
+    s.events = events;
+    s.owner = owner;
+    s.state = state;
+    return s;
+}
+
+void Reactor::fillEvent(ReactorEvent &e, int fd, short revents) const {
+    const FdSlot &s = slots[fd];
+    e.fd = fd;
+    e.revents = revents;
+    e.kind = s.kind;
+    e.server = s.owner;
+    e.state = s.state;
+}
+
+// 処理待ちイベントの中から fd のものを無効化する
+// （close 後に同じ番号が再利用されても古いイベントを配送しないため）
+static void dropPending(std::vector<ReactorEvent> &ready, int fd) {
+    for (size_t i = 0; i < ready.size(); ++i) {
+        if (ready[i].fd == fd)
+            ready[i].revents = 0;
+    }
+}
+
+#ifdef __linux__
+// ----------------------------
+// epoll バックエンド
+// ----------------------------
+
+static unsigned int toEpoll(short events) {
+    unsigned int ev = 0;
+    if (events & POLLIN)
+        ev |= EPOLLIN;
+    if (events & POLLOUT)
+        ev |= EPOLLOUT;
+    return ev;
+}
+
+static short fromEpoll(unsigned int ev) {
+    short revents = 0;
+    if (ev & EPOLLIN)
+        revents |= POLLIN;
+    if (ev & EPOLLOUT)
+        revents |= POLLOUT;
+    if (ev & EPOLLERR)
+        revents |= POLLERR;
+    if (ev & EPOLLHUP)
+        revents |= POLLHUP;
+    return revents;
+}
+
+EpollReactor::EpollReactor() : epfd(epoll_create1(EPOLL_CLOEXEC)) {
+    if (epfd < 0)
+        logMessage(ERROR, "epoll_create1() failed: " + std::string(strerror(errno)));
+}
+
+EpollReactor::~EpollReactor() {
+    if (epfd >= 0)
+        close(epfd);
+}
+
+bool EpollReactor::add(int fd, short events, FdKind kind, Server *owner, void *state) {
+    if (fd < 0 || slotOf(fd))
+        return false;
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = toEpoll(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        logMessage(ERROR, "epoll_ctl(ADD) failed: " + std::string(strerror(errno)));
+        return false;
+    }
+    bind(fd, events, kind, owner, state);
+    return true;
+}
+
+bool EpollReactor::modify(int fd, short events) {
+    FdSlot *s = slotOf(fd);
+    if (!s)
+        return false;
+    if (s->events == events)
+        return true; // 変化なしならシステムコールしない
+
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = toEpoll(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        logMessage(ERROR, "epoll_ctl(MOD) failed: " + std::string(strerror(errno)));
+        return false;
+    }
+    s->events = events;
+    return true;
+}
+
+void EpollReactor::remove(int fd) {
+    FdSlot *s = slotOf(fd);
+    if (!s)
+        return;
+    *s = FdSlot();
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    dropPending(ready, fd);
+}
+
+const std::vector<ReactorEvent> &EpollReactor::wait(int timeoutMs) {
+    struct epoll_event evs[REACTOR_MAX_EVENTS];
+
+    ready.clear();
+    int n = epoll_wait(epfd, evs, REACTOR_MAX_EVENTS, timeoutMs);
+    if (n < 0) {
+        if (errno != EINTR)
+            perror("epoll_wait");
+        return ready;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        if (!slotOf(evs[i].data.fd))
+            continue;
+        ReactorEvent e;
+        fillEvent(e, evs[i].data.fd, fromEpoll(evs[i].events));
+        ready.push_back(e);
+    }
+    return ready;
+}
+#endif
+
+// ----------------------------
+// poll バックエンド
+// ----------------------------
+
+bool PollReactor::add(int fd, short events, FdKind kind, Server *owner, void *state) {
+    if (fd < 0 || slotOf(fd))
+        return false;
+    pollfd p;
+    p.fd = fd;
+    p.events = events;
+    p.revents = 0;
+    bind(fd, events, kind, owner, state).index = pfds.size();
+    pfds.push_back(p);
+    return true;
+}
+
+bool PollReactor::modify(int fd, short events) {
+    FdSlot *s = slotOf(fd);
+    if (!s)
+        return false;
+    s->events = events;
+    pfds[s->index].events = events;
+    return true;
+}
+
+void PollReactor::remove(int fd) {
+    FdSlot *s = slotOf(fd);
+    if (!s)
+        return;
+
+    // 末尾要素と入れ替えて削除
+    size_t pos = s->index;
+    size_t last = pfds.size() - 1;
+    if (pos != last) {
+        pfds[pos] = pfds[last];
+        slots[pfds[pos].fd].index = pos;
+    }
+    pfds.pop_back();
+    *s = FdSlot();
+    dropPending(ready, fd);
+}
+
+const std::vector<ReactorEvent> &PollReactor::wait(int timeoutMs) {
+    ready.clear();
+    if (pfds.empty()) {
+        usleep(timeoutMs * 1000);
+        return ready;
+    }
+
+    int n = poll(&pfds[0], pfds.size(), timeoutMs);
+    if (n < 0) {
+        if (errno != EINTR)
+            perror("poll");
+        return ready;
+    }
+
+    for (size_t i = 0; i < pfds.size() && n > 0; ++i) {
+        if (pfds[i].revents == 0)
+            continue;
+        ReactorEvent e;
+        fillEvent(e, pfds[i].fd, pfds[i].revents);
+        ready.push_back(e);
+        --n;
+    }
+    return ready;
+}
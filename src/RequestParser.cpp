@@ -1,202 +1,321 @@
 #include "../include/RequestParser.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <unistd.h>
 
-bool RequestParser::isRequestComplete(const std::string &buffer) {
-    if (buffer.empty())
-        return false;
-    
-    size_t headerEnd = buffer.find("\r\n\r\n");
-    
-     // --- 不正・非HTTPデータ対策 ---
-    if (headerEnd == std::string::npos) {
-        if (isClearlyInvalidRequest(buffer))
-            return true;
-        return false;
-    }
-
-    std::string headerPart = buffer.substr(0, headerEnd);
-    std::map<std::string, std::string> headers = parseHeaders(headerPart);
-
-    bool isChunked = false;
-    size_t contentLength = 0;
+// ヘッダ部の上限（DoS防止）
+static const size_t MAX_HEADER_SIZE = 8192;
+// chunk サイズ行の上限（拡張つきでも十分）
+static const size_t MAX_CHUNK_LINE = 1024;
+// 1 chunk の上限
+static const size_t MAX_CHUNK_SIZE = 50 * 1024 * 1024;
 
-    if (headers.find("transfer-encoding") != headers.end() &&
-        headers["transfer-encoding"].find("chunked") != std::string::npos)
-        isChunked = true;
-
-    if (headers.find("content-length") != headers.end())
-        contentLength = std::strtoul(headers["content-length"].c_str(), NULL, 10);
-
-    std::string bodyPart = buffer.substr(headerEnd + 4);
-
-    if (isChunked)
-        return bodyPart.find("0\r\n\r\n") != std::string::npos;
-    else
-        return bodyPart.size() >= contentLength;
+RequestParser::RequestParser()
+    : state(ST_HEAD), scanPos(0), contentLength(0), chunkRemaining(0),
+      parsedLength(0), req(), spoolFd(-1), sink(NULL), spooled(0), errorStatus(400) {}
+
+// 途中で捨てる場合、書きかけの一時ファイルも消す
+void RequestParser::reset() {
+    if (spoolFd >= 0)
+        close(spoolFd);
+    if (!req.bodyPath.empty())
+        unlink(req.bodyPath.c_str());
+    spoolFd = -1;
+    sink = NULL;
+    spooled = 0;
+    errorStatus = 400;
+    state = ST_HEAD;
+    scanPos = 0;
+    contentLength = 0;
+    chunkRemaining = 0;
+    parsedLength = 0;
+    req = Request();
 }
 
-// --- 非HTTP・不正データを早期判定する補助関数 ---
-bool RequestParser::isClearlyInvalidRequest(const std::string &buffer) {
-    // 改行があれば完了扱い（例: "BAD_REQUEST\n"）
-    if (buffer.find("\n") != std::string::npos)
-        return true;
-
-    // 明らかにHTTPでない1行メッセージ（例: "HELLO", "BAD_REQUEST"）
-    if (buffer.size() < 64 && buffer.find(' ') == std::string::npos)
-        return true;
-
-    // 異常に長い（DoS防止）
-    if (buffer.size() > 8192)
-        return true;
-
-    return false;
+// 一時ファイルは呼び出し側に渡る（後始末も呼び出し側）
+void RequestParser::takeRequest(Request &out) {
+    std::swap(out, req);
+    req = Request();
 }
 
-RequestParser::RequestParser()
-    : parsedLength(0){}
-
-std::string unchunkBody(const std::string &chunkedBody) {
-    std::string unchunked;
-    std::istringstream stream(chunkedBody);
-
-    while (true) {
-        std::string line;
-        if (!std::getline(stream, line))
-            break;
+bool RequestParser::spoolTo(int fd, const std::string &path) {
+    spoolFd = fd;
+    req.bodyPath = path;
+    spooled = 0;
+    // chunk でメモリに溜めていた分を先に書き出す
+    if (!req.body.empty()) {
+        if (!spoolWrite(req.body.data(), req.body.size()))
+            return false;
+        std::string().swap(req.body);
+    }
+    return true;
+}
 
-        // CR (\r) を削除
-        if (!line.empty() && line[line.size() - 1] == '\r')
-            line.erase(line.size() - 1, 1);
+bool RequestParser::streamTo(BodySink *s) {
+    sink = s;
+    spooled = 0;
+    if (!req.body.empty()) {
+        if (!spoolWrite(req.body.data(), req.body.size()))
+            return false;
+        std::string().swap(req.body);
+    }
+    return true;
+}
 
-        if (line.empty())
+bool RequestParser::spoolWrite(const char *data, size_t len) {
+    if (sink) {
+        if (!sink->write(data, len))
+            return false;
+        spooled += len;
+        return true;
+    }
+    while (len > 0) {
+        ssize_t n = write(spoolFd, data, len);
+        if (n < 0 && errno == EINTR)
             continue;
-
-        // chunk サイズを16進数で取得
-        unsigned long chunkSize = std::strtoul(line.c_str(), 0, 16);
-
-        if (chunkSize == 0)
-            break; // 最終 chunk
-
-        // サイズが大きすぎる場合は中止
-        if (chunkSize > 50 * 1024 * 1024)
-            return std::string();
-
-        // データ部分を読み込む
-        std::string data;
-        data.resize(chunkSize);
-        stream.read(&data[0], chunkSize);
-
-        // 読み込めなかった場合は中止
-        if (static_cast<size_t>(stream.gcount()) != chunkSize)
-            return std::string();
-
-        unchunked += data;
-
-        // データ後の CRLF を読み飛ばす
-        char cr, lf;
-        if (!stream.get(cr) || !stream.get(lf))
-            return std::string();
-
-        if (cr != '\r' || lf != '\n')
-            return std::string();
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+        spooled += n;
     }
-
-    return unchunked;
+    return true;
 }
 
-Request RequestParser::parse(const std::string &buffer) {
-    Request req;
-    parsedLength = 0;
-
-    size_t headerEnd = buffer.find("\r\n\r\n");
-    if (headerEnd == std::string::npos)
-        return req;
+void RequestParser::compact(std::string &buffer) {
+    if (!isSpooling() || scanPos == 0)
+        return;
+    buffer.erase(0, scanPos);
+    scanPos = 0;
+}
 
-    std::string headerPart = buffer.substr(0, headerEnd);
-    std::string bodyPart   = buffer.substr(headerEnd + 4);
+// 壊れたデータは区切りが分からないので、溜まっている分を全部捨てる
+RequestParser::Status RequestParser::fail(const std::string &buffer) {
+    state = ST_ERROR;
+    req.method.clear(); // 不正リクエストの印
+    parsedLength = buffer.size();
+    return PARSE_ERROR;
+}
 
-    // ✅ 同じ関数を利用してヘッダ解析（小文字化も共通化）
-    req.headers = parseHeaders(headerPart);
+// 1行目が "METHOD SP URI SP HTTP/x" の形か（非HTTPデータを早期に弾く）
+bool RequestParser::looksLikeHttp(const std::string &buffer, size_t lineEnd) const {
+    size_t sp1 = buffer.find(' ');
+    if (sp1 == std::string::npos || sp1 == 0 || sp1 >= lineEnd)
+        return false;
+    size_t sp2 = buffer.find(' ', sp1 + 1);
+    if (sp2 == std::string::npos || sp2 == sp1 + 1 || sp2 >= lineEnd)
+        return false;
+    return buffer.compare(sp2 + 1, 5, "HTTP/") == 0;
+}
 
-    std::istringstream lineStream(headerPart);
-    std::string requestLine;
-    if (!std::getline(lineStream, requestLine) || requestLine.empty()) {
-		req.method.clear(); // ← 明示的に不正を示す
-		return req;
-	}
+RequestParser::Status RequestParser::feed(const std::string &buffer) {
+    if (state == ST_DONE)
+        return PARSE_COMPLETE;
+    if (state == ST_ERROR)
+        return PARSE_ERROR;
+
+    if (state == ST_HEAD) {
+        if (buffer.empty())
+            return PARSE_INCOMPLETE;
+
+        // 1行目が揃った時点で形だけ確認する（"BAD_REQUEST\n" などを待たずに弾く）
+        size_t firstLf = buffer.find('\n');
+        if (firstLf != std::string::npos && !looksLikeHttp(buffer, firstLf))
+            return fail(buffer);
+        // 改行前でも、長いのに空白がなければ HTTP ではない
+        if (firstLf == std::string::npos && buffer.size() >= 16 &&
+            buffer.find(' ') == std::string::npos)
+            return fail(buffer);
+
+        // 前回見た末尾 3 バイトから再開（境界をまたぐ "\r\n\r\n" のため）
+        size_t from = scanPos > 3 ? scanPos - 3 : 0;
+        size_t headEnd = buffer.find("\r\n\r\n", from);
+        if (headEnd == std::string::npos) {
+            scanPos = buffer.size();
+            if (buffer.size() > MAX_HEADER_SIZE)
+                return fail(buffer);
+            return PARSE_INCOMPLETE;
+        }
+        if (headEnd > MAX_HEADER_SIZE || !parseHead(buffer, headEnd))
+            return fail(buffer);
+        scanPos = headEnd + 4;
+    }
+    return parseBody(buffer);
+}
 
-    std::istringstream requestLineStream(requestLine);
+// リクエスト行とヘッダを1回だけ解析し、ボディの読み方を決める
+bool RequestParser::parseHead(const std::string &buffer, size_t headEnd) {
+    size_t lineEnd = buffer.find("\r\n");
+    std::istringstream requestLineStream(buffer.substr(0, lineEnd));
     requestLineStream >> req.method >> req.uri >> req.version;
     // --- ✅ 妥当性チェック ---
-	if (req.method.empty() || req.uri.empty() || req.version.empty()) {
-		req.method.clear(); // 不正リクエストの印
-		return req;
-	}
+    if (req.method.empty() || req.uri.empty() || req.version.empty())
+        return false;
     // 例: "HTTP/" で始まらないなら不正
-	if (req.version.find("HTTP/") != 0) {
-		req.method.clear();
-		return req;
-	}
-
-    bool isChunked = false;
-    if (req.headers.find("transfer-encoding") != req.headers.end() &&
-        req.headers["transfer-encoding"].find("chunked") != std::string::npos)
-        isChunked = true;
-
-    if (isChunked) {
-        size_t chunkEnd = bodyPart.find("0\r\n\r\n");
-		if (chunkEnd == std::string::npos) {
-			req.method.clear(); // チャンク終端がない → 不正
-			return req;
-		}
-        req.body = unchunkBody(bodyPart);
-        parsedLength = headerEnd + 4 + bodyPart.find("0\r\n\r\n") + 5;
-    } else {
-        std::map<std::string, std::string>::iterator it = req.headers.find("content-length");
-        if (it != req.headers.end()) {
-            size_t len = std::strtoul(it->second.c_str(), NULL, 10);
-            if (bodyPart.size() < len) {
-				req.method.clear(); // 不正（ボディが足りない）
-				return req;
-			}
-            req.body = bodyPart.substr(0, len);
-            parsedLength = headerEnd + 4 + len;
-        } else {
-            parsedLength = headerEnd + 4;
+    if (req.version.find("HTTP/") != 0)
+        return false;
+
+    size_t pos = lineEnd + 2;
+    while (pos < headEnd) {
+        size_t eol = buffer.find("\r\n", pos);
+        if (eol == std::string::npos || eol > headEnd)
+            eol = headEnd;
+        size_t colon = buffer.find(':', pos);
+        if (colon != std::string::npos && colon < eol) {
+            std::string key = buffer.substr(pos, colon - pos);
+            std::string val = buffer.substr(colon + 1, eol - colon - 1);
+
+            // ここで小文字化
+            std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+            // トリム
+            key.erase(0, key.find_first_not_of(" \t"));
+            key.erase(key.find_last_not_of(" \t") + 1);
+            val.erase(0, val.find_first_not_of(" \t"));
+            val.erase(val.find_last_not_of(" \t") + 1);
+
+            req.headers[key] = val;
         }
+        pos = eol + 2;
     }
 
-    return req;
-}
+    std::map<std::string, std::string>::const_iterator te = req.headers.find("transfer-encoding");
+    if (te != req.headers.end() && te->second.find("chunked") != std::string::npos) {
+        state = ST_CHUNK_SIZE;
+        return true;
+    }
 
-std::map<std::string, std::string> RequestParser::parseHeaders(const std::string &headerPart) {
-    std::map<std::string, std::string> headers;
-    std::istringstream stream(headerPart);
-    std::string line;
+    std::map<std::string, std::string>::const_iterator cl = req.headers.find("content-length");
+    contentLength = 0;
+    if (cl != req.headers.end()) {
+        const std::string &v = cl->second;
+        if (v.empty() || v.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        contentLength = std::strtoul(v.c_str(), NULL, 10);
+    }
+    state = ST_BODY;
+    return true;
+}
 
-    while (std::getline(stream, line)) {
-        size_t pos = line.find(":");
-        if (pos == std::string::npos)
-            continue;
+RequestParser::Status RequestParser::parseBody(const std::string &buffer) {
+    while (true) {
+        switch (state) {
+        case ST_BODY:
+            if (isSpooling()) {
+                // 届いた分だけファイルへ
+                size_t n = static_cast<size_t>(std::min<unsigned long long>(
+                    buffer.size() - scanPos, contentLength - spooled));
+                if (n > 0 && !spoolWrite(buffer.data() + scanPos, n)) {
+                    errorStatus = 500;
+                    return fail(buffer);
+                }
+                scanPos += n;
+                if (spooled < contentLength)
+                    return PARSE_INCOMPLETE;
+                if (spoolFd >= 0)
+                    close(spoolFd);
+                spoolFd = -1;
+                req.bodySize = spooled;
+                parsedLength = scanPos;
+                state = ST_DONE;
+                return PARSE_COMPLETE;
+            }
+            if (buffer.size() - scanPos < contentLength)
+                return PARSE_INCOMPLETE; // 揃うまでコピーしない
+            req.body.assign(buffer, scanPos, contentLength);
+            req.bodySize = contentLength;
+            parsedLength = scanPos + contentLength;
+            state = ST_DONE;
+            return PARSE_COMPLETE;
+
+        case ST_CHUNK_SIZE: {
+            size_t eol = buffer.find("\r\n", scanPos);
+            if (eol == std::string::npos) {
+                if (buffer.size() - scanPos > MAX_CHUNK_LINE)
+                    return fail(buffer);
+                return PARSE_INCOMPLETE;
+            }
+            // chunk サイズを16進数で取得（";ext" は無視）
+            const char *p = buffer.c_str() + scanPos;
+            char *end = NULL;
+            unsigned long size = std::strtoul(p, &end, 16);
+            if (end == p)
+                return fail(buffer);
+            // サイズが大きすぎる場合は中止
+            if (size > MAX_CHUNK_SIZE)
+                return fail(buffer);
+            scanPos = eol + 2;
+            if (size == 0) {
+                state = ST_TRAILER;
+            } else {
+                chunkRemaining = size;
+                state = ST_CHUNK_DATA;
+            }
+            break;
+        }
 
-        std::string key = line.substr(0, pos);
-        std::string val = line.substr(pos + 1);
+        case ST_CHUNK_DATA: {
+            size_t avail = buffer.size() - scanPos;
+            if (avail == 0)
+                return PARSE_INCOMPLETE;
+            size_t n = std::min(avail, chunkRemaining);
+            if (!isSpooling()) {
+                req.body.append(buffer, scanPos, n);
+            } else if (!spoolWrite(buffer.data() + scanPos, n)) {
+                errorStatus = 500;
+                return fail(buffer);
+            }
+            scanPos += n;
+            chunkRemaining -= n;
+            if (chunkRemaining != 0)
+                return PARSE_INCOMPLETE;
+            state = ST_CHUNK_CRLF;
+            break;
+        }
 
-        // ここで小文字化
-        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        case ST_CHUNK_CRLF:
+            if (buffer.size() - scanPos < 2)
+                return PARSE_INCOMPLETE;
+            // データ後の CRLF
+            if (buffer.compare(scanPos, 2, "\r\n") != 0)
+                return fail(buffer);
+            scanPos += 2;
+            state = ST_CHUNK_SIZE;
+            break;
 
-        // トリム
-        key.erase(0, key.find_first_not_of(" \t"));
-        key.erase(key.find_last_not_of(" \t\r") + 1);
-        val.erase(0, val.find_first_not_of(" \t"));
-        val.erase(val.find_last_not_of(" \t\r") + 1);
+        case ST_TRAILER: {
+            size_t eol = buffer.find("\r\n", scanPos);
+            if (eol == std::string::npos) {
+                if (buffer.size() - scanPos > MAX_HEADER_SIZE)
+                    return fail(buffer);
+                return PARSE_INCOMPLETE;
+            }
+            bool blank = (eol == scanPos);
+            scanPos = eol + 2; // トレーラヘッダは読み捨て
+            if (blank) {
+                if (isSpooling()) {
+                    if (spoolFd >= 0)
+                        close(spoolFd);
+                    spoolFd = -1;
+                    req.bodySize = spooled;
+                } else {
+                    req.bodySize = req.body.size();
+                }
+                parsedLength = scanPos;
+                state = ST_DONE;
+                return PARSE_COMPLETE;
+            }
+            break;
+        }
 
-        headers[key] = val;
+        case ST_DONE:
+            return PARSE_COMPLETE;
+        default:
+            return PARSE_ERROR;
+        }
     }
-
-    return headers;
 }
 
-
 // void printRequest(const Request &req) {
 //   std::cout << "=== Request ===" << std::endl;
 //   std::cout << "Method: " << req.method << std::endl;
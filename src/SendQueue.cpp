@@ -0,0 +1,148 @@
+#include "SendQueue.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// 1回の sendmsg に載せるセグメント数の上限（IOV_MAX より十分小さく）
+static const int MAX_IOV = 64;
+// 末尾バッファに追記してまとめるサイズの上限
+static const size_t COALESCE_LIMIT = 16 * 1024;
+// 1回の sendfile で送る上限
+static const size_t FILE_CHUNK = 1024 * 1024;
+
+void SendQueue::append(const std::string &data) {
+    append(data.data(), data.size());
+}
+
+void SendQueue::append(const char *data, size_t len) {
+    if (len == 0)
+        return;
+    memBytes += len;
+    if (!segs.empty()) {
+        Segment &last = segs.back();
+        if (last.fileFd < 0 && last.data.size() + len <= COALESCE_LIMIT) {
+            last.data.append(data, len);
+            return;
+        }
+    }
+    segs.push_back(Segment());
+    segs.back().data.assign(data, len);
+}
+
+void SendQueue::appendFile(int fd, off_t offset, off_t length) {
+    if (length <= 0) {
+        close(fd);
+        return;
+    }
+    segs.push_back(Segment());
+    Segment &s = segs.back();
+    s.fileFd = fd;
+    s.fileOffset = offset;
+    s.fileRemaining = length;
+}
+
+void SendQueue::popFront() {
+    Segment &s = segs.front();
+    if (s.fileFd >= 0)
+        close(s.fileFd);
+    else
+        memBytes -= s.data.size() - s.offset;
+    segs.pop_front();
+}
+
+// 先頭から n バイト分のメモリセグメントを送信済みにする
+void SendQueue::consume(size_t n) {
+    while (n > 0 && !segs.empty()) {
+        Segment &s = segs.front();
+        size_t left = s.data.size() - s.offset;
+        if (n < left) {
+            s.offset += n;
+            memBytes -= n;
+            return;
+        }
+        n -= left;
+        popFront();
+    }
+}
+
+SendQueue::Result SendQueue::flush(int sock, size_t budget) {
+    size_t sent = 0;
+    while (!segs.empty() && sent < budget) {
+        Segment &front = segs.front();
+        ssize_t n;
+
+        if (front.fileFd < 0) {
+            // 連続するメモリセグメントを1回の sendmsg で
+            struct iovec iov[MAX_IOV];
+            int cnt = 0;
+            bool fileFollows = false;
+            for (std::deque<Segment>::iterator it = segs.begin();
+                 it != segs.end() && cnt < MAX_IOV; ++it) {
+                if (it->fileFd >= 0) {
+                    fileFollows = true;
+                    break;
+                }
+                iov[cnt].iov_base = const_cast<char *>(it->data.data()) + it->offset;
+                iov[cnt].iov_len = it->data.size() - it->offset;
+                ++cnt;
+            }
+            struct msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = cnt;
+            int flags = MSG_NOSIGNAL;
+#ifdef MSG_MORE
+            // 直後にファイル本文が続くなら、ヘッダだけの小さいパケットを出さない
+            if (fileFollows)
+                flags |= MSG_MORE;
+#else
+            (void)fileFollows;
+#endif
+            n = sendmsg(sock, &msg, flags);
+            if (n < 0)
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? SEND_AGAIN : SEND_ERROR;
+            consume(static_cast<size_t>(n));
+        } else {
+            size_t want = static_cast<size_t>(std::min(front.fileRemaining, static_cast<off_t>(FILE_CHUNK)));
+#ifdef __linux__
+            n = sendfile(sock, front.fileFd, &front.fileOffset, want);
+#else
+            char buf[65536];
+            n = pread(front.fileFd, buf, std::min(want, sizeof(buf)), front.fileOffset);
+            if (n > 0) {
+                n = write(sock, buf, n);
+                if (n > 0)
+                    front.fileOffset += n;
+            } else if (n == 0) {
+                return SEND_ERROR;
+            }
+#endif
+            if (n < 0)
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? SEND_AGAIN : SEND_ERROR;
+            if (n == 0)
+                return SEND_ERROR; // ファイルが途中で縮んだ → Content-Length を満たせない
+            front.fileRemaining -= n;
+            if (front.fileRemaining <= 0)
+                popFront();
+        }
+        sent += static_cast<size_t>(n);
+        totalSent += static_cast<unsigned long long>(n);
+    }
+    return segs.empty() ? SEND_DONE : SEND_AGAIN;
+}
+
+void SendQueue::clear() {
+    while (!segs.empty())
+        popFront();
+    memBytes = 0;
+}
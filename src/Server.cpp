@@ -1,7 +1,9 @@
 #include "Server.hpp"
 #include "RequestParser.hpp"
 #include "log.hpp"
+#include "Metrics.hpp"
 #include "resp/ResponseBuilder.hpp"
+#include "resp/HeaderWriter.hpp"
 #include <cstdlib>
 #include <ctime>
 #include <fstream>
@@ -10,10 +12,14 @@
 #include <sys/wait.h>
 #include <utility>
 #include <netdb.h>
+#include <signal.h>
+#include <spawn.h>
+#include <cerrno>
 #include <cstring>
 #include <vector>
 #include "CgiProcess.hpp"
 #include "UniqueName.hpp"
+#include "MultipartParser.hpp"
 #include "ServerManager.hpp"
 
 // #define TEST_MOCK_WRITE  // 通常ビルドではコメントアウト
@@ -43,6 +49,22 @@
 
 // #endif
 
+// リクエスト数を数えるメソッドの区分（WorkerStats.hpp の StatMethod）
+static int statMethodOf(const std::string &method)
+{
+	if (method == "GET")
+		return STAT_GET;
+	if (method == "HEAD")
+		return STAT_HEAD;
+	if (method == "POST")
+		return STAT_POST;
+	if (method == "DELETE")
+		return STAT_DELETE;
+	if (method == "PUT")
+		return STAT_PUT;
+	return STAT_OTHER;
+}
+
 // ----------------------------
 // コンストラクタ・デストラクタ
 // ----------------------------
@@ -51,16 +73,24 @@
 Server::Server(const ServerConfig &c)
 	: cfg(c),
 	  serverFd(-1),
+	  reactor(NULL),
+	  stats(NULL),
+	  pool(NULL),
+	  date(NULL),
 	  port(c.port),
 	  host(c.host),
 	  root(c.root),
-	  errorPages(c.errorPages)
+	  errorPages(c.errorPages),
+	  router(c)
 {
-	// fds[], nfds は完全廃止なので何も必要ない
+	errorResponses.load(cfg, router.locations());
+	serverStats.latency.resize(router.locations().size() + 1);
 }
 
 Server::~Server()
 {
+	unregisterServerStats(&serverStats);
+
 	// 接続中クライアントをすべて close
 	for (std::map<int, ClientInfo>::iterator it = clients.begin();
 		 it != clients.end(); ++it)
@@ -70,6 +100,23 @@ Server::~Server()
 	}
 	clients.clear();
 
+	for (std::map<int, FastCgiConn>::iterator it = fcgiConns.begin(); it != fcgiConns.end(); ++it)
+	{
+		close(it->first);
+		if (it->second.bodyFd >= 0)
+			close(it->second.bodyFd);
+	}
+	for (size_t i = 0; i < fcgiWaiting.size(); ++i)
+	{
+		if (fcgiWaiting[i].bodyFd >= 0)
+			close(fcgiWaiting[i].bodyFd);
+	}
+	for (size_t i = 0; i < cgiWaiting.size(); ++i)
+	{
+		if (cgiWaiting[i].bodyFd >= 0)
+			close(cgiWaiting[i].bodyFd);
+	}
+
 	if (serverFd >= 0)
 		close(serverFd);
 }
@@ -79,9 +126,16 @@ Server::~Server()
 // ----------------------------
 
 // サーバー全体の初期化（ソケット作成＋バインド＋リッスン）
-bool Server::init()
+bool Server::init(Reactor *r, WorkerStats *s, BufferPool *p, const DateCache *d, bool reusePort)
 {
-	if (!createSocket())
+	reactor = r;
+	stats = s;
+	pool = p;
+	date = d;
+	// ワーカーのスレッドを始める前に呼ばれるので、ここで登録する
+	registerServerStats(&cfg, &router.locations(), &serverStats);
+	fileCache.configure(cfg.openFileCacheMax, static_cast<long long>(cfg.openFileCacheValid) * 1000);
+	if (!createSocket(reusePort))
 		return false;
 
 	if (!bindAndListen())
@@ -96,17 +150,18 @@ bool Server::init()
 		return true; // プロセス自体は継続
 	}
 
-	fds[0].fd = serverFd;
-	fds[0].events = POLLIN;
+	if (!reactor->add(serverFd, POLLIN, FD_LISTENER, this, NULL))
+		return false;
 
 	std::cout << "Server listening on port " << port << std::endl;
 	return true;
 }
 
 // ソケット作成とオプション設定
-bool Server::createSocket()
+bool Server::createSocket(bool reusePort)
 {
-	serverFd = socket(AF_INET, SOCK_STREAM, 0);
+	// CLOEXEC: 別ワーカーが起動した CGI に listen ソケットを持たせない
+	serverFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (serverFd < 0)
 	{
 		logMessage(ERROR, "socket() failed");
@@ -119,6 +174,18 @@ bool Server::createSocket()
 		logMessage(ERROR, "setsockopt() failed");
 		return false;
 	}
+#ifdef SO_REUSEPORT
+	// マルチワーカー時は各ワーカーが同じポートに listen し、
+	// カーネルに接続を振り分けさせる
+	if (reusePort &&
+		setsockopt(serverFd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+	{
+		logMessage(ERROR, "setsockopt(SO_REUSEPORT) failed");
+		return false;
+	}
+#else
+	(void)reusePort;
+#endif
 	if (!setNonBlocking(serverFd))
 		return false;
 
@@ -223,144 +290,390 @@ void Server::handleNewConnection()
 		oss << "Max clients reached, rejecting fd=" << clientFd;
 		logMessage(WARNING, oss.str());
 		close(clientFd);
+		statAdd(stats->rejected);
+		statAdd(serverStats.rejected);
 		return;
 	}
+	statAdd(stats->accepted);
+	statAdd(serverStats.accepted);
 
-	clients[clientFd] = ClientInfo();
+	ClientInfo &client = clients[clientFd];
+	client = ClientInfo();
+	if (!reactor->add(clientFd, POLLIN, FD_CLIENT, this, &client))
+	{
+		clients.erase(clientFd);
+		close(clientFd);
+		return;
+	}
+	statAdd(serverStats.connections);
+	refreshClientTimer(clientFd);
 
 	printf("New client connected: fd=%d\n", clientFd);
 }
 
-// accept + ノンブロッキング設定をまとめた関数
+// accept + ノンブロッキング設定をまとめた関数。
+// CLOEXEC はここで付ける（後から fcntl すると、その間に別ワーカーの
+// posix_spawn が走って CGI の子に接続が残ることがある）
 int Server::acceptClient()
 {
-	int clientFd = accept(serverFd, NULL, NULL);
+	int clientFd = accept4(serverFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	// fd が尽きていたら open_file_cache の fd を返してもう一度だけ試す
+	if (clientFd < 0 && (errno == EMFILE || errno == ENFILE) && fileCache.shed() > 0)
+		clientFd = accept4(serverFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
 	if (clientFd < 0)
 	{
-		logMessage(ERROR, "accept() failed");
-		return -1;
-	}
-
-	if (!setNonBlocking(clientFd))
-	{
-		close(clientFd);
+		if (errno == EMFILE || errno == ENFILE)
+			pauseAccept();
+		else
+			logMessage(ERROR, "accept() failed");
 		return -1;
 	}
-
 	return clientFd;
 }
 
+// それでも fd が足りない。listen ソケットはレベルトリガーなので、待っている
+// 接続がある限りすぐまた起こされて空回りする。ACCEPT_RETRY_MS だけ監視を止める
+void Server::pauseAccept()
+{
+	logMessage(WARNING, "accept() failed: too many open files, pausing accept");
+	reactor->modify(serverFd, 0);
+	timers.schedule(serverFd, TIMER_ACCEPT, monotonicMs() + ACCEPT_RETRY_MS);
+}
+
 // ----------------------------
 // クライアント受信処理
 // ----------------------------
 
-bool Server::handleRedirect(int fd, const ServerConfig::Location *loc)
+bool Server::handleRedirect(int fd, const LocationRuntime *loc)
 {
-	if (!loc || loc->ret.empty())
+	if (!loc || !loc->hasRedirect)
 		return false; // 続行してOK
 
-	std::map<int, std::string>::const_iterator it = loc->ret.begin();
-	int code = it->first;
-	const std::string &target = it->second;
-
-	std::ostringstream res;
-	res << "HTTP/1.1 " << code << " Moved Permanently\r\n"
-		<< "Location: " << target << "\r\n"
-		<< "Content-Length: 0\r\n"
-		<< "Connection: close\r\n\r\n";
-
-	queueSend(fd, res.str()); // Server 内の関数を呼ぶ
+	// レスポンス全体を起動時に組み立て済み
+	queueSend(fd, clients[fd].shouldClose ? loc->redirectClose : loc->redirectKeepAlive);
 
 	return true;
 }
 
 void Server::handleClient(int fd)
 {
-	char buffer[1024];
-	int bytes = recv(fd, buffer, sizeof(buffer) - 1, 0);
+	ClientInfo &client = clients[fd];
+	pool->acquire(client.recvBuffer);
 
-	if (bytes <= 0)
+	// EAGAIN まで読む（1イベントで読む上限は他の接続を待たせないため）
+	const size_t maxPerEvent = 4 * BufferPool::RECV_CHUNK_MAX;
+	char *buffer = pool->recvScratch();
+	size_t total = 0;
+	bool peerClosed = false;
+	while (total < maxPerEvent)
 	{
-		handleDisconnect(fd, bytes);
-		return;
+		ssize_t bytes = recv(fd, buffer, client.recvChunk, 0);
+		if (bytes < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
+			handleDisconnect(fd, -1);
+			return;
+		}
+		if (bytes == 0)
+		{
+			peerClosed = true;
+			break;
+		}
+		// NUL を含むボディもそのまま（長さ指定で追記）
+		client.recvBuffer.append(buffer, bytes);
+		total += bytes;
+
+		// 読み切れたら次は大きく、少ししか来なければ小さく
+		if (static_cast<size_t>(bytes) == client.recvChunk)
+			client.recvChunk = std::min(client.recvChunk * 2, BufferPool::RECV_CHUNK_MAX);
+		else
+		{
+			if (static_cast<size_t>(bytes) < client.recvChunk / 4)
+				client.recvChunk = std::max(client.recvChunk / 2, BufferPool::RECV_CHUNK_MIN);
+			break; // 取り切った（次の recv はほぼ EAGAIN）
+		}
 	}
-	else if (bytes > 0)
+
+	statAdd(serverStats.bytesIn, total);
+	if (total == 0 && peerClosed)
 	{
-		clients[fd].timeoutCounter = 0;
-		buffer[bytes] = '\0';
-		clients[fd].recvBuffer.append(buffer);
+		handleDisconnect(fd, 0);
+		return;
+	}
 
-		// もしヘッダ解析済みなら max_body_size チェック
-		Request &req = clients[fd].currentRequest;
-		LocationMatch m = getLocationForUri(req.uri);
-		const ServerConfig::Location *loc = m.loc;
+	// バッファに溜まっているリクエストを順に処理（パイプライン対応）
+	processBufferedRequests(fd);
+	if (!clients.count(fd))
+		return;
 
-		if (loc && clients[fd].receivedBodySize + bytes >
-					   static_cast<size_t>(loc->max_body_size))
+	ClientInfo &c = clients[fd];
+	if (peerClosed)
+	{
+		// 相手は送信を終えている。残りのレスポンスを送り終えたら閉じる
+		c.shouldClose = true;
+		if (!c.hasPendingOutput() && !c.waitingCgi)
 		{
-			ResponseBuilder res_build;
-			std::string res = res_build.buildErrorResponse(cfg, loc, 413, true);
-			queueSend(fd, res);
+			handleDisconnect(fd, 0);
 			return;
 		}
+	}
+	// 受信が一段落したら容量をプールへ返す（アイドルな接続はバッファを持たない）
+	if (c.recvBuffer.empty())
+		pool->release(c.recvBuffer);
+
+	// 受信が進んだので期限を延長（状態に応じて read / write / idle）
+	refreshClientTimer(fd);
+}
 
-		// 累積ボディサイズを更新
-		clients[fd].receivedBodySize += req.body.size();
+// recvBuffer にある完全なリクエストを到着順に処理する。
+// CGI の応答待ちの間や、close するレスポンスを積んだ後は先に進まない
+// （レスポンスの順序をリクエストの順序と一致させるため）。
+void Server::processBufferedRequests(int fd)
+{
+	while (clients.count(fd))
+	{
+		ClientInfo &client = clients[fd];
+		if (client.waitingCgi || client.shouldClose)
+			break;
 
-		// 1リクエストずつ処理
-		while (true)
+		if (!extractNextRequest(fd, client.recvBuffer, client.currentRequest))
 		{
-			std::string requestStr =
-				extractNextRequest(fd, clients[fd].recvBuffer, clients[fd].currentRequest);
-			if (requestStr.empty())
+			// ヘッダが揃っていれば、ボディを待たずに 413 を判定する
+			if (!clients.count(fd) || !checkPendingBodySize(fd))
 				break;
+			// multipart のアップロードは受信しながら解析して保存先へ、
+			// それ以外の大きいボディは一時ファイルへ（溜まっている分もすぐ書き出す）
+			if (streamMultipartUpload(fd) || spoolBodyIfLarge(fd))
+				continue;
+			sendContinueIfExpected(fd);
+			client.parser.compact(client.recvBuffer);
+			break;
+		}
 
-			Request &req = clients[fd].currentRequest;
-			LocationMatch m = getLocationForUri(req.uri);
-			const ServerConfig::Location *loc = m.loc;
-			const std::string &locPath = m.path;
+		Request &req = client.currentRequest;
+		LocationMatch m = getLocationForUri(req.uri);
+		const LocationRuntime *loc = m.loc;
+		const std::string &locPath = *m.path;
+		beginRequestStats(client, req, loc);
 
-			// 1リクエスト分の body が max_body_size を超えていないかチェック
-			if (!checkMaxBodySize(fd, req.body.size(), cfg, loc))
-			{
-				// handleDisconnect(fd, index, 0);
-				break;
-			}
+		// このレスポンスの後も接続を維持するか（Connection ヘッダ / HTTP バージョン）
+		client.requestCount++;
+		client.continueSent = false;
+		client.shouldClose = !wantsKeepAlive(req, client);
 
-			printf("Request complete from fd=%d\n", fd);
+		// 1リクエスト分の body が max_body_size を超えていないかチェック
+		if (!checkMaxBodySize(fd, req.bodySize, cfg, loc))
+		{
+			discardBodyFile(req);
+			discardUpload(fd);
+			break;
+		}
 
-			// メソッド許可チェック
-			if (!handleMethodCheck(fd, req, loc, requestStr.size()))
-				continue;
+		printf("Request complete from fd=%d\n", fd);
+		statAdd(stats->requests);
 
-			// CGI / POST / GET 処理
+		// メソッド許可チェック
+		if (handleMethodCheck(fd, req, loc))
+		{
 			// --- リダイレクト処理 ---
-			if (handleRedirect(fd, loc))
+			if (!handleRedirect(fd, loc))
 			{
-				// redirect を queueSend したらこのリクエスト処理は完了
-				// ループを抜けて次の recv まで待つ
-				break;
+				// CGI / POST / GET 処理
+				processRequest(fd, req, loc, locPath);
 			}
-
-			// CGI / POST / GET 処理
-			processRequest(fd, req, loc, locPath, requestStr.size());
 		}
+		// 使い終わった一時ファイル（CGI には fork 前に開いて渡してある）
+		discardBodyFile(req);
+		discardUpload(fd);
+		if (clients.count(fd))
+			clients[fd].receivedBodySize = 0;
+	}
+}
+
+void Server::discardBodyFile(Request &req)
+{
+	if (req.bodyPath.empty())
+		return;
+	unlink(req.bodyPath.c_str());
+	req.bodyPath.clear();
+}
+
+// 確定していないアップロードのファイルは MultipartParser のデストラクタで消える
+void Server::discardUpload(int fd)
+{
+	std::map<int, ClientInfo>::iterator it = clients.find(fd);
+	if (it == clients.end() || !it->second.upload)
+		return;
+	delete it->second.upload;
+	it->second.upload = NULL;
+}
+
+// 受信途中のリクエストが max_body_size を超えると分かった時点で 413 を返す
+bool Server::checkPendingBodySize(int fd)
+{
+	ClientInfo &client = clients[fd];
+	if (!client.parser.headersDone())
+		return true;
+
+	const LocationRuntime *loc = getLocationForUri(client.parser.pending().uri).loc;
+	if (!loc || loc->maxBodySize == 0 ||
+		client.parser.knownBodySize() <= loc->maxBodySize)
+		return true;
+
+	rejectPendingBody(fd, 413, loc);
+	return false;
+}
+
+// 受信途中のリクエストを打ち切ってエラーを返す（残りのボディは読まずに閉じる）
+void Server::rejectPendingBody(int fd, int status, const LocationRuntime *loc)
+{
+	ClientInfo &client = clients[fd];
+	ResponseBuilder res_build(false, &fileCache, &errorResponses, date, &gzipCache, &dirListings);
+	std::string res = res_build.buildErrorResponse(cfg, loc, status, true);
+	client.statMethod = statMethodOf(client.parser.pending().method);
+	client.shouldClose = true;
+	client.recvBuffer.clear();
+	client.parser.reset();
+	discardUpload(fd);
+	queueSend(fd, res);
+}
+
+// client_body_buffer_size を超えるボディは、受信しながら一時ファイルへ書き出す。
+// アップロード先と同じディレクトリに作り、完了後は rename で置くだけにする。
+bool Server::spoolBodyIfLarge(int fd)
+{
+	ClientInfo &client = clients[fd];
+	RequestParser &parser = client.parser;
+	if (!parser.headersDone() || parser.isSpooling())
+		return false;
+
+	const LocationRuntime *loc = getLocationForUri(parser.pending().uri).loc;
+	unsigned long long limit = CLIENT_BODY_BUFFER_SIZE;
+	if (loc && loc->bodyBufferSize != 0)
+		limit = loc->bodyBufferSize;
+	if (parser.knownBodySize() <= limit)
+		return false;
+
+	static const std::string defaultSpool = "/tmp/.body_XXXXXX";
+	std::string path = loc ? loc->spoolPattern : defaultSpool;
+	std::vector<char> tmpl(path.begin(), path.end());
+	tmpl.push_back('\0');
+
+	int tfd = mkostemp(&tmpl[0], O_CLOEXEC);
+	if (tfd < 0)
+	{
+		logMessage(ERROR, "mkostemp() failed for request body: " + path);
+		rejectPendingBody(fd, 500, loc);
+		return false;
+	}
+	path.assign(&tmpl[0]);
+
+#ifdef __linux__
+	// 長さが分かっていれば先に領域を確保（断片化防止・容量不足を早めに検出）
+	if (!parser.isChunked() && fallocate(tfd, 0, 0, parser.knownBodySize()) != 0 &&
+		errno == ENOSPC)
+	{
+		close(tfd);
+		unlink(path.c_str());
+		rejectPendingBody(fd, 413, loc);
+		return false;
+	}
+#endif
+	if (!parser.spoolTo(tfd, path))
+	{
+		rejectPendingBody(fd, 500, loc);
+		return false;
+	}
+	return true;
+}
+
+// handleMultipartForm に進む POST（CGI・chunked・リダイレクト以外）は、ヘッダが
+// 揃った時点でパーサを付け、届いたボディをそのままパートごとのファイルへ書く
+bool Server::streamMultipartUpload(int fd)
+{
+	ClientInfo &client = clients[fd];
+	RequestParser &parser = client.parser;
+	if (!parser.headersDone() || parser.isSpooling() || parser.isChunked())
+		return false;
+
+	const Request &req = parser.pending();
+	std::map<std::string, std::string>::const_iterator ct = req.headers.find("content-type");
+	if (req.method != "POST" || ct == req.headers.end() ||
+		ct->second.find("multipart/form-data") == std::string::npos)
+		return false;
+	const LocationRuntime *loc = getLocationForUri(req.uri).loc;
+	if (!loc || loc->uploadPath.empty() || loc->hasRedirect ||
+		!isMethodAllowed("POST", loc) || isCgiRequest(req))
+		return false;
+	std::string boundary = MultipartParser::boundaryOf(ct->second);
+	if (boundary.empty())
+		return false; // handleMultipartForm で 400
+
+	client.upload = new MultipartParser(boundary, loc->uploadPath);
+	if (!parser.streamTo(client.upload))
+	{
+		rejectPendingBody(fd, 500, loc);
+		return false;
+	}
+	return true;
+}
+
+// "Expect: 100-continue" のクライアントはボディ送信前に応答を待つので、
+// ヘッダを受け取った時点で 100 Continue を返す（1リクエストにつき1回）
+void Server::sendContinueIfExpected(int fd)
+{
+	ClientInfo &client = clients[fd];
+	if (client.continueSent || !client.parser.headersDone())
+		return;
+	const Request &req = client.parser.pending();
+	std::map<std::string, std::string>::const_iterator it = req.headers.find("expect");
+	if (it == req.headers.end() || req.version != "HTTP/1.1")
+		return;
+	std::string v = it->second;
+	std::transform(v.begin(), v.end(), v.begin(), ::tolower);
+	if (v != "100-continue")
+		return;
+	client.continueSent = true;
+	queueSend(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+}
+
+// HTTP/1.1 は既定で keep-alive、HTTP/1.0 は "Connection: keep-alive" のときだけ。
+// keepalive_timeout 0 や keepalive_requests 到達時は閉じる。
+bool Server::wantsKeepAlive(const Request &req, const ClientInfo &client) const
+{
+	if (cfg.keepaliveTimeout <= 0)
+		return false;
+	if (cfg.keepaliveRequests > 0 && client.requestCount >= cfg.keepaliveRequests)
+		return false;
+
+	std::string conn;
+	std::map<std::string, std::string>::const_iterator it = req.headers.find("connection");
+	if (it != req.headers.end())
+	{
+		conn = it->second;
+		std::transform(conn.begin(), conn.end(), conn.begin(), ::tolower);
 	}
+	if (conn.find("close") != std::string::npos)
+		return false;
+	if (req.version == "HTTP/1.0")
+		return conn.find("keep-alive") != std::string::npos;
+	return true;
 }
 
 // Server.cpp に実装
-bool Server::checkMaxBodySize(int fd, int bytes, const ServerConfig &cfg, const ServerConfig::Location *loc)
+bool Server::checkMaxBodySize(int fd, unsigned long long bytes, const ServerConfig &cfg, const LocationRuntime *loc)
 {
 	if (!loc)
 		return true;
 
 	clients[fd].receivedBodySize += bytes;
-	if ((static_cast<size_t>(loc->max_body_size) != 0) &&
-		(clients[fd].receivedBodySize >
-		 static_cast<size_t>(loc->max_body_size)))
+	if (loc->maxBodySize != 0 &&
+		clients[fd].receivedBodySize > loc->maxBodySize)
 	{
-		ResponseBuilder res_build;
+		ResponseBuilder res_build(false, &fileCache, &errorResponses, date, &gzipCache, &dirListings);
 		std::string res = res_build.buildErrorResponse(cfg, loc, 413, true);
+		clients[fd].shouldClose = true;
 		queueSend(fd, res);
 		clients[fd].recvBuffer.clear();
 		return false; // 超過
@@ -368,35 +681,43 @@ bool Server::checkMaxBodySize(int fd, int bytes, const ServerConfig &cfg, const
 	return true;
 }
 
+// リクエストは extractNextRequest で recvBuffer から取り除き済み
 bool Server::handleMethodCheck(int fd, Request &req,
-							   const ServerConfig::Location *loc,
-							   size_t reqSize)
+							   const LocationRuntime *loc)
 {
+	bool close = clients[fd].shouldClose;
 	// 実装済みのMethodかチェック。PUTは未実装なので501で返す。
 	if (req.method != "GET" && req.method != "POST" && req.method != "DELETE" && req.method != "HEAD")
 	{
-		ResponseBuilder res_build;
-		std::string res = res_build.buildErrorResponse(cfg, loc, 501, true);
+		ResponseBuilder res_build(false, &fileCache, &errorResponses, date, &gzipCache, &dirListings);
+		std::string res = res_build.buildErrorResponse(cfg, loc, 501, close);
 		queueSend(fd, res);
-		clients[fd].recvBuffer.erase(0, reqSize);
 		return false;
 	}
 	if (!isMethodAllowed(req.method, loc))
 	{
-		ResponseBuilder res_build;
-		std::string res = res_build.buildErrorResponse(cfg, loc, 405, true);
+		// Allow は起動時に組み立てた値（location が無ければ空 = 使えるメソッドなし）
+		ResponseBuilder res_build(!close, &fileCache, &errorResponses, date, &gzipCache, &dirListings);
+		std::string res = res_build.buildMethodNotAllowed(loc ? loc->allow : std::string(), cfg);
 		queueSend(fd, res);
-		clients[fd].recvBuffer.erase(0, reqSize);
 		return false;
 	}
 	return true;
 }
 
 void Server::processRequest(int fd, Request &req,
-							const ServerConfig::Location *loc,
-							const std::string &locPath, size_t reqSize)
+							const LocationRuntime *loc,
+							const std::string &locPath)
 {
-	if (isCgiRequest(req))
+	if (loc && loc->stubStatus)
+	{
+		sendStubStatus(fd, req);
+	}
+	else if (isCgiRequest(req) && !loc->fastcgiPass.empty())
+	{
+		startFastCgi(fd, req, *loc);
+	}
+	else if (isCgiRequest(req))
 	{
 		startCgiProcess(fd, req, *loc);
 	}
@@ -406,10 +727,10 @@ void Server::processRequest(int fd, Request &req,
 	}
 	else
 	{
-		ResponseBuilder rb;
+		ResponseBuilder rb(!clients[fd].shouldClose, &fileCache, &errorResponses, date, &gzipCache,
+		                   &dirListings);
 		queueSend(fd, rb.generateResponse(req, cfg, loc, locPath));
 	}
-	clients[fd].recvBuffer.erase(0, reqSize);
 }
 
 std::string generateUniqueFilename()
@@ -417,27 +738,28 @@ std::string generateUniqueFilename()
 	return makeUniqueName("file", "txt");
 }
 
-std::string buildHttpResponse(int statusCode, const std::string &body,
+std::string buildHttpResponse(int statusCode, bool close, const std::string &body,
 							  const std::string &contentType = "text/plain")
 {
-	std::stringstream ss;
-	ss << "HTTP/1.1 " << statusCode << " "
-	   << (statusCode == 201   ? "Created"
-		   : statusCode == 403 ? "Forbidden"
-		   : statusCode == 500 ? "Internal Server Error"
-		   : statusCode == 415 ? "Unsupported Media Type"
-							   : "")
-	   << "\r\n";
-
-	ss << "Content-Length: " << body.size() << "\r\n";
-	ss << "Content-Type: " << contentType << "\r\n";
-	ss << "Connection: close\r\n"; // ← 追加
-	ss << "\r\n";				   // ヘッダーと本文の区切り
-	ss << body;
-	return ss.str();
+	std::string res;
+	HeaderWriter w(res, 256 + body.size());
+	w.status(statusCode, statusCode == 200   ? "OK"
+						 : statusCode == 201 ? "Created"
+						 : statusCode == 400 ? "Bad Request"
+						 : statusCode == 403 ? "Forbidden"
+						 : statusCode == 500 ? "Internal Server Error"
+						 : statusCode == 415 ? "Unsupported Media Type"
+											 : "");
+
+	w.contentLength(body.size());
+	w.header("Content-Type", contentType);
+	w.connection(close);
+	w.raw("\r\n"); // ヘッダーと本文の区切り
+	res += body;
+	return res;
 }
 
-void Server::handlePost(int fd, Request &req, const ServerConfig::Location *loc)
+void Server::handlePost(int fd, Request &req, const LocationRuntime *loc)
 {
 	std::string contentType;
 	if (req.headers.find("content-type") != req.headers.end())
@@ -471,11 +793,12 @@ void Server::handlePost(int fd, Request &req, const ServerConfig::Location *loc)
 	else
 	{
 		std::string body = "Unsupported Content-Type: " + contentType + "\n";
-		queueSend(fd, buildHttpResponse(415, body));
+		queueSend(fd, buildHttpResponse(415, clients[fd].shouldClose, body));
 	}
 }
 
-void saveBodyToFile(const std::string &body, const std::string &uploadDir)
+// 一時ファイルに落としたボディは rename で置くだけ（コピーしない）
+bool saveBodyToFile(Request &req, const std::string &uploadDir)
 {
 	// 1) ユニークなファイル名を作成（PID・rand・counter 不使用）
 	const std::string base = makeUniqueName("POST", "txt");
@@ -489,32 +812,47 @@ void saveBodyToFile(const std::string &body, const std::string &uploadDir)
 
 	const std::string filename = oss.str();
 
+	if (!req.bodyPath.empty())
+	{
+		if (rename(req.bodyPath.c_str(), filename.c_str()) != 0)
+		{
+			std::cerr << "Failed to move body into place: " << filename << std::endl;
+			return false;
+		}
+		req.bodyPath.clear();
+		std::cout << "[INFO] Saved POST body to: " << filename << std::endl;
+		return true;
+	}
+
 	// 3) 書き込み
 	std::ofstream ofs(filename.c_str(), std::ios::binary);
 	if (!ofs.is_open())
 	{
 		std::cerr << "Failed to open file for writing: " << filename << std::endl;
-		return;
+		return false;
 	}
 
-	ofs.write(body.c_str(), body.size());
+	ofs.write(req.body.c_str(), req.body.size());
 	ofs.close();
 
 	std::cout << "[INFO] Saved POST body to: " << filename << std::endl;
+	return true;
 }
 
-void Server::handleChunkedBody(int fd, Request &req, const ServerConfig::Location *loc)
+void Server::handleChunkedBody(int fd, Request &req, const LocationRuntime *loc)
 {
 	// すでに unchunk された req.body を使って処理
 	// 例: ファイル保存や CGI に渡すなど
-	if (loc->upload_path.empty())
+	if (loc->uploadPath.empty())
 	{
-		queueSend(fd, buildHttpResponse(200, "Chunked data received\n"));
+		queueSend(fd, buildHttpResponse(200, clients[fd].shouldClose, "Chunked data received\n"));
 	}
 	else
 	{
-		saveBodyToFile(req.body, loc->upload_path);
-		queueSend(fd, buildHttpResponse(201, "File saved\n"));
+		if (!saveBodyToFile(req, loc->uploadPath))
+			queueSend(fd, buildHttpResponse(500, clients[fd].shouldClose, "Internal Server Error\n"));
+		else
+			queueSend(fd, buildHttpResponse(201, clients[fd].shouldClose, "File saved\n"));
 	}
 }
 
@@ -576,29 +914,9 @@ bool urlDecode(const std::string &src, std::string &out)
 	return true;
 }
 
-void Server::handleUrlEncodedForm(int fd, Request &req,
-								  const ServerConfig::Location *loc)
+// "k=v&k=v..." を1行ずつ "key=value" で書き出す（URL デコード失敗なら false）
+static bool writeUrlEncodedPairs(std::ofstream &ofs, const std::string &body)
 {
-	if (!loc || loc->upload_path.empty())
-	{
-		queueSend(fd, buildHttpResponse(400, "No upload path configured\n"));
-		return;
-	}
-
-	// ファイル名生成（getpid不要）
-	std::string filename = loc->upload_path;
-	if (filename[filename.size() - 1] != '/')
-		filename += '/';
-	filename += makeUniqueName("form", "txt");
-
-	std::ofstream ofs(filename.c_str(), std::ios::out | std::ios::trunc);
-	if (!ofs.is_open())
-	{
-		queueSend(fd, buildHttpResponse(500, "Internal Server Error\n"));
-		return;
-	}
-
-	std::string &body = req.body;
 	size_t pos = 0;
 	while (pos < body.size())
 	{
@@ -614,12 +932,7 @@ void Server::handleUrlEncodedForm(int fd, Request &req,
 			// URL デコード（失敗なら400）
 			if (!urlDecode(body.substr(pos, eq - pos), key) ||
 				!urlDecode(body.substr(eq + 1, amp - eq - 1), value))
-			{
-				ofs.close();
-				std::remove(filename.c_str()); // 部分書き込みファイル削除
-				queueSend(fd, buildHttpResponse(400, "Bad Request\n"));
-				return;
-			}
+				return false;
 
 			ofs << key << "=" << value << "\n";
 		}
@@ -630,166 +943,130 @@ void Server::handleUrlEncodedForm(int fd, Request &req,
 
 		pos = amp + 1;
 	}
-
-	ofs.close();
-	queueSend(fd, buildHttpResponse(201, "Form received successfully\n"));
-}
-
-std::string extractBoundary(const std::string &contentType)
-{
-	std::string key = "boundary=";
-	size_t pos = contentType.find(key);
-	if (pos == std::string::npos)
-		return "";
-	return "--" + contentType.substr(pos + key.size());
+	return true;
 }
 
-std::vector<std::string> splitParts(const std::string &body,
-									const std::string &boundary)
+void Server::handleUrlEncodedForm(int fd, Request &req,
+								  const LocationRuntime *loc)
 {
-	std::vector<std::string> parts;
-	size_t start = 0, end;
-
-	while ((end = body.find(boundary, start)) != std::string::npos)
+	if (!loc || loc->uploadPath.empty())
 	{
-		std::string part = body.substr(start, end - start);
-
-		// 末尾の余分な改行を削除
-		if (part.size() >= 2 && part.substr(part.size() - 2) == "\r\n")
-			part.erase(part.size() - 2);
-
-		// 空文字や Content-Disposition を持たないパートは無視
-		if (!part.empty() &&
-			part.find("Content-Disposition") != std::string::npos)
-		{
-			parts.push_back(part);
-		}
-
-		start = end + boundary.size();
-		if (body.substr(start, 2) == "--")
-			break; // 終端ならループ終了
+		queueSend(fd, buildHttpResponse(400, clients[fd].shouldClose, "No upload path configured\n"));
+		return;
 	}
 
-	return parts;
-}
+	// ファイル名生成（getpid不要）
+	std::string filename = loc->uploadPath;
+	if (filename[filename.size() - 1] != '/')
+		filename += '/';
+	filename += makeUniqueName("form", "txt");
 
-void parsePart(const std::string &part, std::string &filename,
-			   std::string &content)
-{
-	size_t headerEnd = part.find("\r\n\r\n");
-	if (headerEnd == std::string::npos)
+	std::ofstream ofs(filename.c_str(), std::ios::out | std::ios::trunc);
+	if (!ofs.is_open())
+	{
+		queueSend(fd, buildHttpResponse(500, clients[fd].shouldClose, "Internal Server Error\n"));
 		return;
+	}
 
-	std::string header = part.substr(0, headerEnd);
-	content = part.substr(headerEnd + 4);
-
-	// filename 抽出
-	size_t pos = header.find("filename=\"");
-	if (pos != std::string::npos)
+	// 一時ファイルのボディは 64KB ずつ読み、'&' で区切れた所までを処理する
+	bool ok = true;
+	if (req.bodyPath.empty())
+		ok = writeUrlEncodedPairs(ofs, req.body);
+	else
 	{
-		pos += 10;
-		size_t end = header.find("\"", pos);
-		filename = header.substr(pos, end - pos);
+		std::ifstream in(req.bodyPath.c_str(), std::ios::binary);
+		std::string pending;
+		std::vector<char> block(64 * 1024);
+		while (ok && in)
+		{
+			in.read(&block[0], block.size());
+			pending.append(&block[0], in.gcount());
+			size_t amp = pending.rfind('&');
+			if (in && amp != std::string::npos)
+			{
+				std::string head = pending.substr(0, amp);
+				ok = writeUrlEncodedPairs(ofs, head);
+				pending.erase(0, amp + 1);
+			}
+		}
+		if (ok)
+			ok = writeUrlEncodedPairs(ofs, pending);
 	}
-	else
+	if (!ok)
 	{
-		filename = "upload.bin";
+		ofs.close();
+		std::remove(filename.c_str()); // 部分書き込みファイル削除
+		queueSend(fd, buildHttpResponse(400, clients[fd].shouldClose, "Bad Request\n"));
+		return;
 	}
+
+	ofs.close();
+	queueSend(fd, buildHttpResponse(201, clients[fd].shouldClose, "Form received successfully\n"));
 }
 
+// ボディは受信中に MultipartParser へ流してある（client.upload）。
+// ヘッダと同じ受信で揃った小さいボディや一時ファイルは、ここで同じパーサに通す。
 void Server::handleMultipartForm(int fd, Request &req,
-								 const ServerConfig::Location *loc)
+								 const LocationRuntime *loc)
 {
-	std::cerr << "=== Multipart Raw Body ===\n"
-			  << req.body << "\n=========================\n";
-
-	if (loc->upload_path.empty())
+	if (loc->uploadPath.empty())
 	{
-		queueSend(fd, buildHttpResponse(403, "Upload path not configured.\n"));
+		queueSend(fd, buildHttpResponse(403, clients[fd].shouldClose, "Upload path not configured.\n"));
 		return;
 	}
 
-	std::string boundary = extractBoundary(req.headers["content-type"]);
+	std::string boundary = MultipartParser::boundaryOf(req.headers["content-type"]);
 	if (boundary.empty())
 	{
 		queueSend(fd,
-				  buildHttpResponse(400, "Missing boundary in Content-Type.\n"));
-		return;
-	}
-
-	std::vector<std::string> parts = splitParts(req.body, boundary);
-	if (parts.empty())
-	{
-		queueSend(fd, buildHttpResponse(400, "No multipart data found.\n"));
+				  buildHttpResponse(400, clients[fd].shouldClose, "Missing boundary in Content-Type.\n"));
 		return;
 	}
 
-	for (size_t i = 0; i < parts.size(); ++i)
+	MultipartParser *mp = clients[fd].upload;
+	if (!mp)
 	{
-		std::string filename, content;
-		parsePart(parts[i], filename, content);
-		std::string fullpath = loc->upload_path + "/" + filename;
-
-		std::ofstream ofs(fullpath.c_str(), std::ios::binary);
-		if (!ofs)
+		mp = new MultipartParser(boundary, loc->uploadPath);
+		clients[fd].upload = mp;
+		bool ok = true;
+		if (req.bodyPath.empty())
+			ok = mp->write(req.body.data(), req.body.size());
+		else
 		{
-			queueSend(fd, buildHttpResponse(500, "Failed to open file.\n"));
-			return;
+			std::ifstream in(req.bodyPath.c_str(), std::ios::binary);
+			std::vector<char> block(64 * 1024);
+			while (ok && in)
+			{
+				in.read(&block[0], block.size());
+				ok = mp->write(&block[0], in.gcount());
+			}
 		}
-		ofs.write(content.data(), content.size());
-		ofs.close();
+		(void)ok; // 失敗は finish() が 500 で返す
 	}
 
-	queueSend(fd, buildHttpResponse(201, "File uploaded successfully.\n"));
+	int status = mp->finish();
+	if (status == 500)
+		queueSend(fd, buildHttpResponse(500, clients[fd].shouldClose, "Failed to open file.\n"));
+	else if (status == 400)
+		queueSend(fd, buildHttpResponse(400, clients[fd].shouldClose, "No multipart data found.\n"));
+	else
+		queueSend(fd, buildHttpResponse(201, clients[fd].shouldClose, "File uploaded successfully.\n"));
 }
 
 bool Server::isMethodAllowed(const std::string &method,
-							 const ServerConfig::Location *loc)
-{
-	if (!loc)
-		return false;
-	for (size_t i = 0; i < loc->method.size(); i++)
-	{
-		if (loc->method[i] == method)
-			return true;
-	}
-	return false;
-}
-
-std::string normalizePath(const std::string &path)
+							 const LocationRuntime *loc)
 {
-	if (path == "/")
-		return "/"; // ルートはそのまま
-	if (!path.empty() && path[path.size() - 1] == '/')
-		return path.substr(0, path.size() - 1);
-	return path;
+	return loc && loc->allows(methodBit(method));
 }
 
+// 最長一致の location（起動時に組み立てた router を URI で1回なぞるだけ）
 Server::LocationMatch Server::getLocationForUri(const std::string &uri) const
 {
-	LocationMatch bestMatch;
-	size_t bestLen = 0;
-
-	std::string normUri = normalizePath(uri);
-
-	for (std::map<std::string, ServerConfig::Location>::const_iterator it =
-			 cfg.location.begin();
-		 it != cfg.location.end(); ++it)
-	{
-		std::string normLoc = normalizePath(it->first);
-		if (normLoc.empty())
-			normLoc = "/";
-		if (normUri.compare(0, normLoc.size(), normLoc) == 0)
-		{
-			if (normLoc.size() > bestLen)
-			{
-				bestLen = normLoc.size();
-				bestMatch.loc = &it->second;
-				bestMatch.path = it->first; // 元のパスはそのまま
-			}
-		}
-	}
-	return bestMatch;
+	static const std::string noPath;
+	LocationMatch m;
+	m.loc = router.match(uri);
+	m.path = m.loc ? &m.loc->key : &noPath;
+	return m;
 }
 
 bool Server::isCgiRequest(const Request &req)
@@ -838,56 +1115,32 @@ std::pair<std::string, std::string> splitUri(const std::string &uri)
 	}
 }
 
-// 外部関数（Serverクラス外でも良い）
-std::pair<std::string, std::string> buildCgiScriptPath(
-	const std::string &uri,
-	const ServerConfig::Location &loc,
-	const std::map<std::string, ServerConfig::Location> &locations)
+// URI のパス部分から実行するスクリプトのパスを作る（location のキーを root に置き換える）
+static std::string buildCgiScriptPath(const std::string &pathOnly, const CgiTemplate &t)
 {
-	std::pair<std::string, std::string> parts = splitUri(uri);
-	std::string path_only = parts.first;
-	std::string query_str = parts.second;
-
-	std::string scriptPath = loc.root;
-	if (!scriptPath.empty() && scriptPath[scriptPath.size() - 1] == '/')
-		scriptPath.erase(scriptPath.size() - 1);
-
-	// location キーを探す
-	std::string locKey;
-	for (std::map<std::string, ServerConfig::Location>::const_iterator it = locations.begin();
-		 it != locations.end(); ++it)
-	{
-		if (&it->second == &loc)
-			locKey = it->first;
-	}
-
-	if (path_only.find(locKey) == 0)
+	std::string scriptPath = t.scriptRoot;
+	if (pathOnly.compare(0, t.locKey.size(), t.locKey) == 0)
 	{
-		std::string rest = path_only.substr(locKey.length());
-		if (!rest.empty() && rest[0] != '/')
+		if (pathOnly.size() > t.locKey.size() && pathOnly[t.locKey.size()] != '/')
 			scriptPath += '/';
-		scriptPath += rest;
+		scriptPath.append(pathOnly, t.locKey.size(), std::string::npos);
 	}
 	else
 	{
-		scriptPath += path_only;
+		scriptPath += pathOnly;
 	}
-
-	return std::make_pair(scriptPath, query_str);
+	return scriptPath;
 }
 
 // env 設定を作る関数
-std::map<std::string, std::string> buildCgiEnv(
-	const Request &req,
-	const ServerConfig::Location &loc,
-	const std::map<std::string, ServerConfig::Location> &locations)
+std::map<std::string, std::string> buildCgiEnv(const Request &req, const CgiTemplate &t)
 {
 	std::map<std::string, std::string> env;
 
 	env["REQUEST_METHOD"] = req.method;
 
 	std::ostringstream len;
-	len << req.body.size();
+	len << req.bodySize;
 	env["CONTENT_LENGTH"] = len.str();
 
 	std::map<std::string, std::string>::const_iterator it = req.headers.find("content-type");
@@ -896,65 +1149,54 @@ std::map<std::string, std::string> buildCgiEnv(
 	else
 		env["CONTENT_TYPE"] = "";
 
-	std::pair<std::string, std::string> envPaths =
-		buildCgiScriptPath(req.uri, loc, locations);
-
-	env["SCRIPT_FILENAME"] = envPaths.first;
-	env["QUERY_STRING"] = envPaths.second;
+	std::pair<std::string, std::string> parts = splitUri(req.uri);
+	env["SCRIPT_FILENAME"] = buildCgiScriptPath(parts.first, t);
+	env["QUERY_STRING"] = parts.second;
 	env["REDIRECT_STATUS"] = "200";
 
 	return env;
 }
 
-// 子プロセス側の設定・exec
-void executeCgiChild(int inFd, int outFd, const std::string &cgiPath,
-					 const std::map<std::string, std::string> &env)
+// posix_spawn（glibc では vfork 相当で、親のメモリをコピーしない）で CGI を起動する。
+// このプロセスの fd は全部 CLOEXEC で開いている（accept4 / pipe2 / F_DUPFD_CLOEXEC など）
+// ので、子に残るのは dup2 した stdin / stdout だけ。
+// 成功なら 0、失敗なら errno を返す（exec の失敗もここで分かる）
+static int spawnCgiChild(const CgiPending &p, int inFd, int outFd, pid_t &pid)
 {
-	// 標準入出力をパイプに差し替え
-	dup2(inFd, STDIN_FILENO);
-	dup2(outFd, STDOUT_FILENO);
-	close(inFd);
-	close(outFd);
+	std::vector<char *> envp;
+	envp.reserve(p.tmpl->fixedEnv.size() + p.env.size() + 1);
+	for (size_t i = 0; i < p.tmpl->fixedEnv.size(); ++i)
+		envp.push_back(const_cast<char *>(p.tmpl->fixedEnv[i].c_str()));
+	for (size_t i = 0; i < p.env.size(); ++i)
+		envp.push_back(const_cast<char *>(p.env[i].c_str()));
+	envp.push_back(NULL);
 
-	// 1) envマップから "KEY=VALUE" 形式の文字列を作る
-	std::vector<std::string> envStorage;
-	envStorage.reserve(env.size());
+	// Pythonや他のインタプリタ系は scriptPath を argv[1] に渡す必要がある
+	char *argv[3];
+	argv[0] = const_cast<char *>(p.tmpl->cgiPath.c_str());
+	argv[1] = const_cast<char *>(p.scriptPath.c_str());
+	argv[2] = NULL;
 
-	for (std::map<std::string, std::string>::const_iterator it = env.begin();
-		 it != env.end(); ++it)
-	{
-		envStorage.push_back(it->first + "=" + it->second);
-	}
-
-	// 2) execve に渡す char* 配列を構築
-	std::vector<char *> envp;
-	envp.reserve(envStorage.size() + 1);
-	for (size_t i = 0; i < envStorage.size(); ++i)
-	{
-		envp.push_back(const_cast<char *>(envStorage[i].c_str()));
-	}
-	envp.push_back(NULL); // envp の終端
-
-	// CGIスクリプトの実際のファイルパスを取得
-	std::string scriptPath;
-	std::map<std::string, std::string>::const_iterator it = env.find("SCRIPT_FILENAME");
-	if (it != env.end())
-		scriptPath = it->second;
-	else
-		scriptPath = "";
-
-	// Pythonや他のインタプリタ系は scriptPath を argv[1] に渡す必要がある
-	char *argv[3];
-	argv[0] = const_cast<char *>(cgiPath.c_str());
-	argv[1] = const_cast<char *>(scriptPath.c_str());
-	argv[2] = NULL;
-
-	// 3) envp を自前で渡して execve
-	execve(argv[0], argv, &envp[0]);
-
-	// ここに来るのは execve が失敗したときだけ
-	// （親プロセスの状態に影響させないため、exit(1)でもOKだが課題的にはここは一応残す）
-	exit(1);
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attr);
+	posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+
+	// ワーカースレッド用にブロックしたシグナルと、無視している SIGPIPE を元に戻す
+	sigset_t empty, defaults;
+	sigemptyset(&empty);
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGPIPE);
+	posix_spawnattr_setsigmask(&attr, &empty);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	int err = posix_spawn(&pid, argv[0], &actions, &attr, argv, &envp[0]);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	return err;
 }
 
 // 親プロセス側でのパイプ送信
@@ -962,89 +1204,292 @@ void Server::registerCgiProcess(int clientFd, pid_t pid,
 								int inFd, int outFd, const std::string &body,
 								std::map<int, CgiProcess> &cgiMap)
 {
-	// 1. 非ブロッキング設定
+	// 1. 非ブロッキング設定（inFd が -1 ならボディはファイルから直接渡し済み）
 	fcntl(outFd, F_SETFL, O_NONBLOCK);
-	fcntl(inFd, F_SETFL, O_NONBLOCK);
+	if (inFd >= 0)
+		fcntl(inFd, F_SETFL, O_NONBLOCK);
 
-	// 2. CGIプロセス情報作成
-	CgiProcess proc;
+	// 2. CGIプロセス情報作成（管理マップには outFd キーで保存。
+	//    Reactor の配送表がこの要素を指すので、登録より先に作る）
+	CgiProcess &proc = cgiMap[outFd];
+	proc = CgiProcess();
 	proc.clientFd = clientFd;
 	proc.pid = pid;
 	proc.inFd = inFd;
 	proc.outFd = outFd;
 	proc.inputBuffer = body;
-	proc.remainingMs = 50000; // タイムアウト
-
-	// 3. 管理マップにはoutFdキーで保存
-	cgiMap[outFd] = proc;
+	proc.events = POLLIN;
+	proc.deadline = monotonicMs() + CGI_TIMEOUT_MS;
+	proc.headersSent = false;
+	proc.chunked = false;
+	proc.bodyLeft = -1;
+	proc.paused = false;
+	proc.outputDone = false;
+	proc.exited = false;
+	proc.status = 0;
+	timers.schedule(outFd, TIMER_CGI, proc.deadline);
+
+	// 3. 監視登録（登録はここで一度だけ）
+	reactor->add(outFd, POLLIN, FD_CGI_OUT, this, &proc);
+	if (proc.inputBuffer.empty())
+	{
+		// 渡すボディが無ければすぐ EOF を送る
+		if (inFd >= 0)
+			close(inFd);
+		proc.inFd = -1;
+	}
+	else
+	{
+		reactor->add(inFd, POLLOUT, FD_CGI_IN, this, &proc);
+		proc.events |= POLLOUT;
+	}
+	refreshCgiGauge();
 }
 
-void Server::startCgiProcess(int clientFd, const Request &req, const ServerConfig::Location &loc)
+// 起動に必要な文字列を組み立てる。cgi_max_procs に達していれば空くまで待たせる
+void Server::startCgiProcess(int clientFd, const Request &req, const LocationRuntime &loc)
 {
-	int inPipe[2], outPipe[2];
-	if (pipe(inPipe) < 0 || pipe(outPipe) < 0)
-		return;
+	CgiPending p;
+	p.clientFd = clientFd;
+	p.tmpl = &loc.cgi;
+	p.bodyFd = -1;
 
-	pid_t pid = fork();
-	if (pid == 0)
-	{
-		// 子プロセス
-		std::map<std::string, std::string> env = buildCgiEnv(req, loc, cfg.location);
-		executeCgiChild(inPipe[0], outPipe[1], loc.cgi_path, env);
+	std::pair<std::string, std::string> parts = splitUri(req.uri);
+	p.scriptPath = buildCgiScriptPath(parts.first, *p.tmpl);
+
+	std::ostringstream len;
+	len << req.bodySize;
+	std::map<std::string, std::string>::const_iterator ct = req.headers.find("content-type");
+	p.env.reserve(5);
+	p.env.push_back("REQUEST_METHOD=" + req.method);
+	p.env.push_back("CONTENT_LENGTH=" + len.str());
+	p.env.push_back("CONTENT_TYPE=" + (ct != req.headers.end() ? ct->second : std::string()));
+	p.env.push_back("SCRIPT_FILENAME=" + p.scriptPath);
+	p.env.push_back("QUERY_STRING=" + parts.second);
+
+	if (!req.bodyPath.empty())
+	{
+		// 一時ファイルに落としたボディはそのまま stdin にする（パイプで流さない）。
+		// 呼び出し元がすぐ unlink するので、起動を待つ間もこの fd で持っておく
+		p.bodyFd = open(req.bodyPath.c_str(), O_RDONLY | O_CLOEXEC);
+		if (p.bodyFd < 0)
+		{
+			queueCgiError(clientFd, 500, "Internal Server Error");
+			return;
+		}
+	}
+	else
+		p.body = req.body;
+	p.req.method = req.method;
+	p.req.uri = req.uri;
+	p.req.version = req.version;
+	std::cout << "[DEBUG] Passing to CGI, body size: " << req.bodySize << std::endl;
+
+	// CGI が終わるまでクライアント側の期限とパイプラインは止める
+	clients[clientFd].waitingCgi = true;
+	refreshClientTimer(clientFd);
+
+	if (cgiWaiting.empty() && (cfg.cgiMaxProcs == 0 || cgiMap.size() < static_cast<size_t>(cfg.cgiMaxProcs)))
+		launchCgi(p);
+	else
+		cgiWaiting.push_back(p);
+}
+
+// パイプを作って子を起動し、cgiMap に登録する。
+// どこで失敗しても作った fd は全部閉じて 500 を積む。processRequest の中からも
+// 呼ばれるので、次のリクエストへは進めない（呼び出し元のループか dispatchWaitingCgi が進める）
+bool Server::launchCgi(CgiPending &p)
+{
+	int inPipe[2] = {p.bodyFd, -1};
+	int outPipe[2] = {-1, -1};
+	p.bodyFd = -1; // ここから先は inPipe[0] として閉じる
+	pid_t pid = -1;
+	int err = 0;
+
+	if (inPipe[0] < 0 && pipe2(inPipe, O_CLOEXEC) < 0)
+		err = errno;
+	else if (pipe2(outPipe, O_CLOEXEC) < 0)
+		err = errno;
+	else
+		err = spawnCgiChild(p, inPipe[0], outPipe[1], pid);
+
+	// 子側の端は親では使わない（閉じないと stdin に EOF が届かない）
+	if (inPipe[0] >= 0)
+		close(inPipe[0]);
+	if (outPipe[1] >= 0)
+		close(outPipe[1]);
+	if (err != 0)
+	{
+		if (inPipe[1] >= 0)
+			close(inPipe[1]);
+		if (outPipe[0] >= 0)
+			close(outPipe[0]);
+		std::cerr << "[ERROR] CGI launch failed: " << strerror(err) << std::endl;
+		endCgiWait(p.clientFd);
+		queueCgiError(p.clientFd, 500, "Internal Server Error");
+		return false;
 	}
 
-	// 親プロセス
-	close(inPipe[0]);
-	close(outPipe[1]);
-	std::cout << "[DEBUG] Passing to CGI, body size: " << req.body.size() << std::endl;
+	registerCgiProcess(p.clientFd, pid, inPipe[1], outPipe[0], p.body, cgiMap);
 
-	registerCgiProcess(clientFd, pid, inPipe[1], outPipe[0], req.body, cgiMap);
+	// 応答の組み立て（chunked にできるか）に使う
+	Request &info = cgiMap[outPipe[0]].req;
+	info.method = p.req.method;
+	info.uri = p.req.uri;
+	info.version = p.req.version;
+	return true;
 }
 
-void Server::handleCgiOutput(int fd)
+// CGI が1つ終わるたびに、待たせていたものを上限まで起動する
+void Server::dispatchWaitingCgi()
 {
-	char buf[4096];
-	ssize_t n = read(fd, buf, sizeof(buf));
+	while (!cgiWaiting.empty() &&
+		   (cfg.cgiMaxProcs == 0 || cgiMap.size() < static_cast<size_t>(cfg.cgiMaxProcs)))
+	{
+		// 起動失敗時の後始末で cgiWaiting が変わることがあるので先に外す
+		CgiPending p = cgiWaiting.front();
+		cgiWaiting.pop_front();
+		if (launchCgi(p))
+			continue;
+		// 待っていたクライアントのパイプラインはここで再開する
+		if (clients.count(p.clientFd))
+			processBufferedRequests(p.clientFd);
+		closeIfDone(p.clientFd);
+	}
+}
 
-	if (n > 0)
+// CGI 出力のヘッダ部の終わり（"\r\n\r\n" か "\n\n" の早い方）。bodyStart は本文の先頭
+static size_t findCgiHeaderEnd(const std::string &out, size_t &bodyStart)
+{
+	size_t crlf = out.find("\r\n\r\n");
+	size_t lf = out.find("\n\n");
+	if (lf != std::string::npos && (crlf == std::string::npos || lf < crlf))
 	{
-		// バッファ上限チェック（例: 1MB）
-		if (cgiMap[fd].buffer.size() + n > 1024 * 1024)
-		{
-			std::cerr << "CGI buffer overflow on fd=" << fd << std::endl;
-			handleCgiError(fd);
-			return;
-		}
-		cgiMap[fd].buffer.append(buf, n);
+		bodyStart = lf + 2;
+		return lf;
 	}
-	else if (n == 0)
+	if (crlf != std::string::npos)
+		bodyStart = crlf + 4;
+	return crlf;
+}
+
+// ヘッダが揃った時点でステータス行を送り、以降の本文は読んだ分ずつ転送する
+// （出力全体を溜めないので大きさの上限は無い）
+void Server::handleCgiOutput(CgiProcess &proc)
+{
+	int fd = proc.outFd;
+	char *buf = pool->recvScratch();
+	ssize_t n = read(fd, buf, BufferPool::RECV_CHUNK_MAX);
+
+	if (n == 0)
 	{
 		// EOF → 正常終了
 		handleCgiClose(fd);
+		return;
 	}
-	else // n < 0
+	if (n < 0)
 	{
+		if (errno == EAGAIN || errno == EINTR)
+			return;
 		// 読み取りエラー
 		handleCgiError(fd);
+		return;
+	}
+	proc.deadline = monotonicMs() + CGI_TIMEOUT_MS; // 出力が続いている間は延長
+	consumeCgiOutput(proc, buf, n);
+}
+
+// CGI / FastCGI の出力を、ヘッダが揃うまでは溜め、以降は本文として転送する
+void Server::consumeCgiOutput(CgiProcess &proc, const char *buf, size_t n)
+{
+	if (proc.headersSent)
+	{
+		forwardCgiBody(proc, buf, n);
+		return;
+	}
+
+	proc.buffer.append(buf, n);
+	size_t bodyStart = 0;
+	size_t headerEnd = findCgiHeaderEnd(proc.buffer, bodyStart);
+	if (headerEnd == std::string::npos)
+	{
+		if (proc.buffer.size() <= CGI_MAX_HEADER)
+			return; // ヘッダの続きを待つ
+		headerEnd = 0; // ヘッダが無い → 全部本文
+		bodyStart = 0;
+	}
+	std::string out;
+	out.swap(proc.buffer);
+	queueSend(proc.clientFd, buildCgiResponseHead(out.substr(0, headerEnd), proc, -1));
+	forwardCgiBody(proc, out.data() + bodyStart, out.size() - bodyStart);
+}
+
+// 本文をクライアントの送信キューへ（chunked ならサイズ行を付ける）。
+// 送信待ちが溜まったら、クライアントが受け取るまで CGI の読み取りを止める。
+void Server::forwardCgiBody(CgiProcess &proc, const char *data, size_t len)
+{
+	std::map<int, ClientInfo>::iterator it = clients.find(proc.clientFd);
+	if (it == clients.end())
+		return;
+	if (proc.bodyLeft >= 0)
+	{
+		// Content-Length を超えた分は次のレスポンスに混ざらないよう捨てる
+		len = std::min(len, static_cast<size_t>(proc.bodyLeft));
+		proc.bodyLeft -= len;
+	}
+	if (len == 0)
+		return;
+
+	SendQueue &q = it->second.sendQueue;
+	if (proc.chunked)
+	{
+		char line[32];
+		int l = snprintf(line, sizeof(line), "%lx\r\n", static_cast<unsigned long>(len));
+		q.append(line, l);
+		q.append(data, len);
+		q.append("\r\n", 2);
+	}
+	else
+		q.append(data, len);
+	updateClientEvents(proc.clientFd);
+
+	// 応答を読み終えた後（endCgiWait 済み）は止めても再開する相手がいない
+	if (!proc.paused && it->second.waitingCgi && q.bufferedBytes() >= CGI_PAUSE_BYTES)
+	{
+		reactor->remove(proc.outFd);
+		proc.paused = true;
+		it->second.pausedUpstream = &proc;
 	}
 }
 
-void Server::handleCgiInput(int fd)
+// 送信待ちが減ったら、止めていた CGI の読み取りを再開する
+// （止めた相手は ClientInfo::pausedUpstream に覚えてあるので、cgiMap / fcgiConns は走査しない）
+void Server::resumeCgiOutput(int clientFd)
 {
-	// fd は CGI の inFd
-	CgiProcess *proc = getCgiProcessByInFd(fd);
+	ClientInfo &client = clients[clientFd];
+	CgiProcess *proc = client.pausedUpstream;
 	if (!proc)
 		return;
+	client.pausedUpstream = NULL;
+	proc->paused = false;
+	std::map<int, FastCgiConn>::iterator fc = fcgiConns.find(proc->outFd);
+	if (fc != fcgiConns.end() && &fc->second.stream == proc)
+	{
+		reactor->add(fc->first, POLLIN, FD_FASTCGI, this, &fc->second);
+		updateFastCgiEvents(fc->first);
+	}
+	else
+		reactor->add(proc->outFd, POLLIN, FD_CGI_OUT, this, proc);
+}
 
+void Server::handleCgiInput(CgiProcess *proc)
+{
+	int fd = proc->inFd;
 	if (proc->inputBuffer.empty())
 	{
 		// 書くものがない → POLLOUT解除 + inFdクローズ
 		proc->events &= ~POLLOUT;
-		if (proc->inFd > 0)
-		{
-			close(proc->inFd);
-			proc->inFd = -1;
-		}
+		closeCgiFd(proc->inFd);
 		return;
 	}
 
@@ -1057,11 +1502,7 @@ void Server::handleCgiInput(int fd)
 		// 致命的エラーとして終了
 		perror("write to CGI stdin failed");
 		proc->events &= ~POLLOUT;
-		if (proc->inFd > 0)
-		{
-			close(proc->inFd);
-			proc->inFd = -1;
-		}
+		closeCgiFd(proc->inFd);
 		proc->inputBuffer.clear(); // 念のためバッファクリア
 		return;
 	}
@@ -1078,23 +1519,18 @@ void Server::handleCgiInput(int fd)
 	if (proc->inputBuffer.empty())
 	{
 		proc->events &= ~POLLOUT;
-		if (proc->inFd > 0)
-		{
-			close(proc->inFd);
-			proc->inFd = -1;
-		}
+		closeCgiFd(proc->inFd);
 	}
 }
 
-CgiProcess *Server::getCgiProcessByInFd(int inFd)
+// 監視解除してから close する（子プロセスが同じパイプを持っている場合に備えて）
+void Server::closeCgiFd(int &fd)
 {
-	for (std::map<int, CgiProcess>::iterator it = cgiMap.begin();
-		 it != cgiMap.end(); ++it)
-	{
-		if (it->second.inFd == inFd)
-			return &it->second;
-	}
-	return NULL;
+	if (fd < 0)
+		return;
+	reactor->remove(fd);
+	close(fd);
+	fd = -1;
 }
 
 std::string Server::buildHttpErrorPage(int code, const std::string &message)
@@ -1113,117 +1549,230 @@ void Server::handleCgiError(int fd)
 
 	int clientFd = cgiMap[fd].clientFd;
 	std::cerr << "[ERROR] CGI read failed on fd=" << fd << std::endl;
+	endCgiWait(clientFd);
 
-	std::string body = buildHttpErrorPage(500, "Internal Server Error");
-	std::ostringstream oss;
-	oss << "HTTP/1.1 500 Internal Server Error\r\n";
-	oss << "Content-Type: text/html\r\n";
-	oss << "Content-Length: " << body.size() << "\r\n";
-	oss << "Connection: close\r\n\r\n"; // ← 追加
-	oss << body;
+	if (cgiMap[fd].headersSent)
+	{
+		// ステータスは送信済み → 途中で切れたことが分かるよう接続を閉じる
+		if (clients.count(clientFd))
+			clients[clientFd].shouldClose = true;
+	}
+	else
+		queueCgiError(clientFd, 500, "Internal Server Error");
+	discardCgi(cgiMap.find(fd));
+	dispatchWaitingCgi();
+
+	// CGI 待ちで止めていたパイプライン済みリクエストを再開
+	if (clients.count(clientFd))
+		processBufferedRequests(clientFd);
+	closeIfDone(clientFd);
+}
 
-	queueSend(clientFd, oss.str());
-	close(fd);
-	waitpid(cgiMap[fd].pid, NULL, 0);
-	cgiMap.erase(fd);
+// close するレスポンスを送り終えている（積むものが無かった）なら今閉じる
+void Server::closeIfDone(int clientFd)
+{
+	std::map<int, ClientInfo>::iterator it = clients.find(clientFd);
+	if (it == clients.end())
+		return;
+	if (!it->second.waitingCgi && !it->second.hasPendingOutput())
+		endRequestStats(it->second); // CGI の終わりに送るものが残っていなかった
+	if (it->second.shouldClose && !it->second.waitingCgi && !it->second.hasPendingOutput())
+		handleConnectionClose(clientFd);
 }
 
+// クライアントが既に居なければ close 扱い
+bool Server::clientShouldClose(int clientFd) const
+{
+	std::map<int, ClientInfo>::const_iterator it = clients.find(clientFd);
+	return it == clients.end() || it->second.shouldClose;
+}
+
+// stdout の EOF。子がまだ終わっていなければ SIGCHLD（reapChildren）を待つ。
+// outFd は閉じずに監視だけ外す（cgiMap のキーとタイマーの fd を再利用させない）
 void Server::handleCgiClose(int fd)
 {
-	// --- 1️⃣ 登録確認 ---
-	if (cgiMap.count(fd) == 0)
+	std::map<int, CgiProcess>::iterator it = cgiMap.find(fd);
+	if (it == cgiMap.end())
 		return;
 
+	CgiProcess &proc = it->second;
+	proc.outputDone = true;
+	reactor->remove(fd);
+	if (!proc.exited && waitpid(proc.pid, &proc.status, WNOHANG) != 0)
+		proc.exited = true;
+	if (proc.exited)
+		completeCgi(fd);
+}
+
+// 出力を読み切り、子も回収できた CGI の応答を仕上げて片付ける
+void Server::completeCgi(int fd)
+{
 	CgiProcess &proc = cgiMap[fd];
 	int clientFd = proc.clientFd;
+	int pid = proc.pid;
 
-	// --- 2️⃣ 子プロセス終了確認 (非ブロッキング) ---
-	int status = 0;
-	pid_t result = waitpid(proc.pid, &status, WNOHANG);
-	if (result == 0)
-	{
-		// まだ終了していない（再びpollで呼ばれる）
-		std::cout << "[DEBUG] CGI still running pid=" << proc.pid << std::endl;
-		return;
-	}
-	else if (result < 0)
+	endCgiWait(clientFd);
+	finishCgiResponse(proc, !WIFEXITED(proc.status) || WEXITSTATUS(proc.status) != 0);
+
+	closeCgiFd(proc.inFd);
+	closeCgiFd(proc.outFd);
+	cgiMap.erase(fd);
+	dispatchWaitingCgi();
+
+	std::cout << "[CGI] process pid=" << pid << " cleaned up fd=" << fd << std::endl;
+
+	if (clients.count(clientFd))
+		processBufferedRequests(clientFd);
+	closeIfDone(clientFd);
+}
+
+// 応答に使わなくなった CGI を片付ける。まだ動いていれば SIGTERM して回収を待つ
+void Server::discardCgi(std::map<int, CgiProcess>::iterator it)
+{
+	CgiProcess &proc = it->second;
+	closeCgiFd(proc.inFd);
+	closeCgiFd(proc.outFd);
+	if (!proc.exited)
+		terminateCgi(proc.pid);
+	cgiMap.erase(it);
+	refreshCgiGauge();
+}
+
+// SIGTERM → CGI_KILL_GRACE_MS 後も残っていれば SIGKILL（expireCgiKill）
+void Server::terminateCgi(pid_t pid)
+{
+	if (waitpid(pid, NULL, WNOHANG) != 0)
+		return; // 既に終わっていた
+	kill(pid, SIGTERM);
+	long long deadline = monotonicMs() + CGI_KILL_GRACE_MS;
+	dyingCgi[pid] = deadline;
+	timers.schedule(pid, TIMER_CGI_KILL, deadline);
+}
+
+// error_page のファイルを読み直す（設定そのものは読み直さない）
+void Server::reloadErrorPages()
+{
+	errorResponses.load(cfg, router.locations());
+	logMessage(INFO, "Reloaded error pages");
+}
+
+// 終了した子を WNOHANG でまとめて回収する。SIGCHLD はワーカー全部を起こすので、
+// 自分が起動した pid だけを見る（別ワーカーの子は横取りしない）
+void Server::reapChildren()
+{
+	for (std::map<pid_t, long long>::iterator it = dyingCgi.begin(); it != dyingCgi.end();)
 	{
-		perror("waitpid");
+		std::map<pid_t, long long>::iterator cur = it++;
+		if (waitpid(cur->first, NULL, WNOHANG) != 0)
+			dyingCgi.erase(cur);
 	}
 
-	// --- 子プロセス異常終了チェック ---
-	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	std::vector<int> done;
+	for (std::map<int, CgiProcess>::iterator it = cgiMap.begin(); it != cgiMap.end(); ++it)
 	{
-		// 🚨 CGIが異常終了 → HTTP500を返す
-		std::string body = buildHttpErrorPage(500, "Internal Server Error");
-		std::ostringstream oss;
-		oss << "HTTP/1.1 500 Internal Server Error\r\n";
-		oss << "Content-Type: text/html\r\n";
-		oss << "Content-Length: " << body.size() << "\r\n";
-		oss << "Connection: close\r\n\r\n"; // ← 追加
-		oss << body;
-		queueSend(clientFd, oss.str());
+		CgiProcess &proc = it->second;
+		if (proc.exited || waitpid(proc.pid, &proc.status, WNOHANG) == 0)
+			continue;
+		proc.exited = true;
+		if (proc.outputDone)
+			done.push_back(it->first);
 	}
-	else
+	refreshCgiGauge();
+	// 残りの出力がある子は EOF を読んだとき（handleCgiClose）に仕上げる
+	for (size_t i = 0; i < done.size(); ++i)
 	{
-		// ✅ 正常終了 → 通常のレスポンス処理
-		std::string response = buildHttpResponseFromCgi(proc.buffer);
-		queueSend(clientFd, response);
+		if (cgiMap.count(done[i]))
+			completeCgi(done[i]);
 	}
+}
 
-	int pid = proc.pid; // ← ここでコピーしておく
-
-	// --- 4️⃣ パイプを確実に閉じる ---
-	if (proc.inFd > 0)
+// CGI / FastCGI の出力が終わったときの後始末（chunked の終端・エラー応答など）
+void Server::finishCgiResponse(CgiProcess &proc, bool failed)
+{
+	int clientFd = proc.clientFd;
+	if (proc.headersSent)
 	{
-		close(proc.inFd);
-		proc.inFd = -1;
+		// 異常終了や Content-Length に足りない本文は、接続を閉じて途中で切れたことを伝える
+		if (failed || proc.bodyLeft > 0)
+		{
+			if (clients.count(clientFd))
+				clients[clientFd].shouldClose = true;
+		}
+		else if (proc.chunked && clients.count(clientFd))
+		{
+			clients[clientFd].sendQueue.append("0\r\n\r\n", 5);
+			updateClientEvents(clientFd);
+		}
 	}
-	if (proc.outFd > 0)
+	// --- 子プロセス異常終了チェック ---
+	else if (failed)
 	{
-		close(proc.outFd);
-		proc.outFd = -1;
+		// 🚨 CGIが異常終了 → HTTP500を返す
+		queueCgiError(clientFd, 500, "Internal Server Error");
 	}
+	else
+	{
+		// ✅ 正常終了 → ヘッダが終わらないまま EOF（短い出力）。長さが分かるので一度に送る
+		size_t bodyStart = 0;
+		size_t headerEnd = findCgiHeaderEnd(proc.buffer, bodyStart);
+		if (headerEnd == std::string::npos)
+		{
+			headerEnd = 0; // ヘッダがない → 全部本文として扱う
+			bodyStart = 0;
+		}
+		queueSend(clientFd, buildCgiResponseHead(proc.buffer.substr(0, headerEnd), proc,
+												 proc.buffer.size() - bodyStart));
+		forwardCgiBody(proc, proc.buffer.data() + bodyStart, proc.buffer.size() - bodyStart);
+		if (proc.bodyLeft > 0 && clients.count(clientFd))
+			clients[clientFd].shouldClose = true; // CGI の Content-Length に足りない
+	}
+}
 
-	// --- 5️⃣ poll監視解除（次ループで再構築される） ---
-	proc.events = 0;
-
-	// --- 6️⃣ CGIプロセス削除 ---
-	cgiMap.erase(fd);
+void Server::queueCgiError(int clientFd, int code, const std::string &message)
+{
+	std::string body = buildHttpErrorPage(code, message);
+	std::string res;
+	HeaderWriter w(res, 256 + body.size());
+	w.status(code, message);
+	w.raw("Content-Type: text/html\r\n");
+	w.contentLength(body.size());
+	w.connection(clientShouldClose(clientFd));
+	w.date(date->str());
+	w.end();
+	res += body;
+	queueSend(clientFd, res);
+}
 
-	std::cout << "[CGI] process pid=" << pid << " cleaned up fd=" << fd << std::endl;
+// CGI / FastCGI が時間内に応答しなかった。error_page 504 か既定ページを
+// 組み立て済みのものから返す（クライアントが既に切断済みなら queueSend 側で捨てられる）
+void Server::sendGatewayTimeout(int clientFd)
+{
+	std::string res;
+	errorResponses.append(res, NULL, 504, clientShouldClose(clientFd), date->str());
+	queueSend(clientFd, res);
 }
 
-std::string Server::buildHttpResponseFromCgi(const std::string &cgiOutput)
+// CGI のヘッダ部からステータス行とヘッダを作る。
+// 本文の長さ（CGI の Content-Length か knownLength）が分からなければ
+// HTTP/1.1 は chunked、HTTP/1.0 は接続を閉じて終わりを伝える。
+std::string Server::buildCgiResponseHead(const std::string &cgiHeaders, CgiProcess &proc,
+										 long long knownLength)
 {
-	std::string headers;
-	std::string content;
 	std::string statusLine = "HTTP/1.1 200 OK"; // デフォルト
+	long long contentLength = -1;
 
-	// --- 1️⃣ ヘッダと本文を分離 ---
-	size_t headerEnd = cgiOutput.find("\r\n\r\n");
-	if (headerEnd == std::string::npos)
-		headerEnd = cgiOutput.find("\n\n");
-	if (headerEnd != std::string::npos)
-	{
-		headers = cgiOutput.substr(0, headerEnd);
-		content = cgiOutput.substr(headerEnd + (cgiOutput[headerEnd] == '\r' ? 4 : 2));
-	}
-	else
-	{
-		// ヘッダがない → 全部本文として扱う
-		content = cgiOutput;
-	}
-
-	// --- 2️⃣ ヘッダ行を個別に処理 ---
-	std::istringstream headerStream(headers);
-	std::string line;
-	std::ostringstream filteredHeaders;
-
+	// --- 1️⃣ ヘッダ行を個別に処理 ---
+	std::string filteredHeaders;
 	bool hasContentType = false;
-
-	while (std::getline(headerStream, line))
+	size_t pos = 0;
+	while (pos < cgiHeaders.size())
 	{
+		size_t eol = cgiHeaders.find('\n', pos);
+		if (eol == std::string::npos)
+			eol = cgiHeaders.size();
+		std::string line = cgiHeaders.substr(pos, eol - pos);
+		pos = eol + 1;
+
 		// 行末の \r を削除
 		if (!line.empty() && line[line.size() - 1] == '\r')
 			line.erase(line.size() - 1);
@@ -1248,28 +1797,434 @@ std::string Server::buildHttpResponseFromCgi(const std::string &cgiOutput)
 			continue; // StatusヘッダはHTTPヘッダには入れない
 		}
 
+		// --- 長さと接続はこちらで決める ---
+		if (lower.find("content-length:") == 0)
+		{
+			contentLength = std::strtoll(line.c_str() + 15, NULL, 10);
+			continue;
+		}
+		if (lower.find("connection:") == 0 || lower.find("transfer-encoding:") == 0)
+			continue;
+
 		// --- Content-Type ヘッダ確認 ---
 		if (lower.find("content-type:") == 0)
 			hasContentType = true;
 
 		// その他ヘッダはそのままコピー
-		filteredHeaders << line << "\r\n";
+		filteredHeaders += line;
+		filteredHeaders += "\r\n";
 	}
 
-	// --- 3️⃣ Content-Type補完 ---
+	// --- 2️⃣ Content-Type補完 ---
 	if (!hasContentType)
-		filteredHeaders << "Content-Type: text/html\r\n";
+		filteredHeaders += "Content-Type: text/html\r\n";
+
+	if (contentLength < 0)
+		contentLength = knownLength;
+	proc.headersSent = true;
+	proc.bodyLeft = contentLength;
+	proc.chunked = contentLength < 0 && proc.req.version == "HTTP/1.1";
+	if (contentLength < 0 && !proc.chunked && clients.count(proc.clientFd))
+		clients[proc.clientFd].shouldClose = true;
+
+	// --- 3️⃣ HTTPレスポンスヘッダ組み立て ---
+	std::string head;
+	HeaderWriter w(head, 128 + statusLine.size() + filteredHeaders.size());
+	head += statusLine;
+	w.raw("\r\n");
+	if (contentLength >= 0)
+		w.contentLength(static_cast<unsigned long long>(contentLength));
+	else if (proc.chunked)
+		w.raw("Transfer-Encoding: chunked\r\n");
+	w.connection(clientShouldClose(proc.clientFd));
+	if (date)
+		w.date(date->str());
+	head += filteredHeaders;
+	w.raw("\r\n");
+	return head;
+}
 
-	// --- 4️⃣ HTTPレスポンス組み立て ---
-	std::ostringstream oss;
-	oss << statusLine << "\r\n";
-	oss << "Content-Length: " << content.size() << "\r\n";
-	oss << "Connection: close\r\n"; // ← ここで明示的に追加
-	oss << filteredHeaders.str();
-	oss << "\r\n"
-		<< content;
+// ----------------------------
+// FastCGI（fastcgi_pass）
+// ----------------------------
 
-	return oss.str();
+// CGI と同じ環境変数を PARAMS にして、空いている常設接続へ送る。
+// 宛先ごとの接続が上限まで使用中なら、空くまで fcgiWaiting で待たせる。
+void Server::startFastCgi(int clientFd, const Request &req, const LocationRuntime &loc)
+{
+	std::map<std::string, std::string> env = buildCgiEnv(req, loc.cgi);
+	env["GATEWAY_INTERFACE"] = "CGI/1.1";
+	env["SERVER_PROTOCOL"] = req.version;
+	env["REQUEST_URI"] = req.uri;
+	env["SCRIPT_NAME"] = req.uri.substr(0, req.uri.find('?'));
+
+	FastCgiPending p;
+	p.clientFd = clientFd;
+	p.addr = loc.fastcgiPass;
+	p.target = &loc.fastcgiAddr;
+	p.version = req.version;
+	p.bodyFd = -1;
+	fcgiAppendBeginRequest(p.records, FCGI_REQUEST_ID, true);
+	fcgiAppendParams(p.records, FCGI_REQUEST_ID, env);
+	if (!req.bodyPath.empty())
+	{
+		// 一時ファイルのボディは、送信しながら少しずつ STDIN レコードにする
+		p.bodyFd = open(req.bodyPath.c_str(), O_RDONLY | O_CLOEXEC);
+		if (p.bodyFd < 0)
+		{
+			queueCgiError(clientFd, 500, "Internal Server Error");
+			return;
+		}
+	}
+	else
+	{
+		fcgiAppendStream(p.records, FCGI_STDIN, FCGI_REQUEST_ID, req.body.data(), req.body.size());
+		fcgiAppendStream(p.records, FCGI_STDIN, FCGI_REQUEST_ID, NULL, 0);
+	}
+
+	// 応答が終わるまでクライアント側の期限とパイプラインは止める
+	clients[clientFd].waitingCgi = true;
+	refreshClientTimer(clientFd);
+
+	if (!dispatchFastCgi(p))
+		fcgiWaiting.push_back(p);
+}
+
+// 空いている接続（無ければ新しい接続）に p を割り当てる。
+// 接続が上限まで使用中なら false（p はそのまま）。接続に失敗したら 502 を返して true
+bool Server::dispatchFastCgi(FastCgiPending &p)
+{
+	int fd = -1;
+	int count = 0;
+	for (std::map<int, FastCgiConn>::iterator it = fcgiConns.begin(); it != fcgiConns.end(); ++it)
+	{
+		if (it->second.addr != p.addr)
+			continue;
+		++count;
+		if (!it->second.busy)
+			fd = it->first;
+	}
+
+	if (fd < 0)
+	{
+		if (count >= FASTCGI_MAX_CONNS)
+			return false;
+		bool inProgress = false;
+		fd = fcgiConnect(*p.target, inProgress);
+		if (fd < 0)
+		{
+			logMessage(ERROR, "FastCGI connect failed: " + p.addr + ": " + strerror(errno));
+			failFastCgiRequest(p, 502);
+			return true;
+		}
+		FastCgiConn &c = fcgiConns[fd];
+		c.fd = fd;
+		c.addr = p.addr;
+		c.connecting = inProgress;
+		reactor->add(fd, POLLIN | POLLOUT, FD_FASTCGI, this, &c);
+	}
+
+	FastCgiConn &c = fcgiConns[fd];
+	c.busy = true;
+	c.out.swap(p.records);
+	c.outOff = 0;
+	c.bodyFd = p.bodyFd;
+	c.in.clear();
+	c.stream = CgiProcess();
+	c.stream.pid = -1;
+	c.stream.inFd = -1;
+	c.stream.outFd = fd;
+	c.stream.clientFd = p.clientFd;
+	c.stream.req.version = p.version;
+	c.stream.bodyLeft = -1;
+	c.stream.deadline = monotonicMs() + CGI_TIMEOUT_MS;
+	if (c.queuedDeadline == 0 || c.stream.deadline < c.queuedDeadline)
+	{
+		timers.schedule(fd, TIMER_FASTCGI, c.stream.deadline);
+		c.queuedDeadline = c.stream.deadline;
+	}
+	updateFastCgiEvents(fd);
+	return true;
+}
+
+// 接続が空いたので、同じ宛先の待ちリクエストを到着順に割り当てる
+void Server::dispatchWaitingFastCgi(const std::string &addr)
+{
+	while (true)
+	{
+		size_t i = 0;
+		while (i < fcgiWaiting.size() && fcgiWaiting[i].addr != addr)
+			++i;
+		if (i == fcgiWaiting.size())
+			return;
+		// 割り当て中のエラー処理で fcgiWaiting が変わることがあるので先に外す
+		FastCgiPending p = fcgiWaiting[i];
+		fcgiWaiting.erase(fcgiWaiting.begin() + i);
+		if (!dispatchFastCgi(p))
+		{
+			fcgiWaiting.insert(fcgiWaiting.begin() + i, p);
+			return;
+		}
+		// 接続に失敗して 502 で終わったなら、待っていたパイプラインをここで再開する
+		std::map<int, ClientInfo>::iterator cl = clients.find(p.clientFd);
+		if (cl != clients.end() && !cl->second.waitingCgi)
+		{
+			processBufferedRequests(p.clientFd);
+			closeIfDone(p.clientFd);
+		}
+	}
+}
+
+// まだ接続に載っていないリクエストをエラーで終える。processRequest の中からも
+// 呼ばれるので、次のリクエストへは進めない（呼び出し元のループか
+// dispatchWaitingFastCgi が進める）
+void Server::failFastCgiRequest(FastCgiPending &p, int status)
+{
+	if (p.bodyFd >= 0)
+		close(p.bodyFd);
+	p.bodyFd = -1;
+	endCgiWait(p.clientFd);
+	queueCgiError(p.clientFd, status, status == 502 ? "Bad Gateway" : "Internal Server Error");
+}
+
+void Server::handleFastCgiEvent(FastCgiConn &c, short revents)
+{
+	int fd = c.fd;
+	if (c.connecting)
+	{
+		if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+			return;
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+		{
+			logMessage(ERROR, "FastCGI connect failed: " + c.addr + ": " + strerror(err));
+			dropFastCgiConn(fd, 502);
+			return;
+		}
+		c.connecting = false;
+	}
+
+	// 読み残しがある間は POLLHUP でも読み切ってから閉じる
+	if (revents & POLLIN)
+	{
+		readFastCgi(fd);
+		if (!fcgiConns.count(fd))
+			return;
+	}
+	else if (revents & (POLLHUP | POLLERR))
+	{
+		dropFastCgiConn(fd, 502);
+		return;
+	}
+	if (revents & POLLOUT)
+		flushFastCgi(fd);
+}
+
+void Server::readFastCgi(int fd)
+{
+	FastCgiConn &c = fcgiConns[fd];
+	char *buf = pool->recvScratch();
+	ssize_t n = read(fd, buf, BufferPool::RECV_CHUNK_MAX);
+	if (n == 0)
+	{
+		// アプリケーション側が接続を閉じた
+		dropFastCgiConn(fd, 502);
+		return;
+	}
+	if (n < 0)
+	{
+		if (errno != EAGAIN && errno != EINTR)
+			dropFastCgiConn(fd, 502);
+		return;
+	}
+
+	c.in.append(buf, n);
+	unsigned char type;
+	unsigned short id;
+	const char *content;
+	size_t len;
+	while (c.in.next(type, id, content, len))
+	{
+		if (!c.busy || id != FCGI_REQUEST_ID)
+			continue;
+		if (type == FCGI_STDOUT && len > 0)
+		{
+			c.stream.deadline = monotonicMs() + CGI_TIMEOUT_MS; // 出力が続いている間は延長
+			consumeCgiOutput(c.stream, content, len);
+		}
+		else if (type == FCGI_STDERR && len > 0)
+			std::cerr << "[FastCGI] " << std::string(content, len);
+		else if (type == FCGI_END_REQUEST && len >= 8)
+		{
+			// appStatus（4バイト）と protocolStatus（0 = REQUEST_COMPLETE）
+			const unsigned char *b = reinterpret_cast<const unsigned char *>(content);
+			unsigned long appStatus = (static_cast<unsigned long>(b[0]) << 24) |
+									  (b[1] << 16) | (b[2] << 8) | b[3];
+			finishFastCgi(fd, appStatus != 0 || b[4] != 0);
+			return;
+		}
+	}
+	c.in.compact();
+}
+
+// 組み立て済みのレコードを送る。一時ファイルのボディは送れた分だけ読み足す
+void Server::flushFastCgi(int fd)
+{
+	FastCgiConn &c = fcgiConns[fd];
+	if (c.connecting)
+		return;
+	while (true)
+	{
+		if (c.outOff >= c.out.size())
+		{
+			c.out.clear();
+			c.outOff = 0;
+			if (c.bodyFd < 0)
+				break;
+			char *buf = pool->recvScratch();
+			ssize_t r = read(c.bodyFd, buf, BufferPool::RECV_CHUNK_MAX);
+			if (r > 0)
+				fcgiAppendStream(c.out, FCGI_STDIN, FCGI_REQUEST_ID, buf, r);
+			else
+			{
+				close(c.bodyFd);
+				c.bodyFd = -1;
+				fcgiAppendStream(c.out, FCGI_STDIN, FCGI_REQUEST_ID, NULL, 0);
+			}
+			continue;
+		}
+		ssize_t n = send(fd, c.out.data() + c.outOff, c.out.size() - c.outOff, MSG_NOSIGNAL);
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
+			dropFastCgiConn(fd, 502);
+			return;
+		}
+		c.outOff += n;
+	}
+	updateFastCgiEvents(fd);
+}
+
+// 送るものがある間だけ POLLOUT を見る（送信待ちで読み取りを止めている間は触らない）
+void Server::updateFastCgiEvents(int fd)
+{
+	FastCgiConn &c = fcgiConns[fd];
+	if (c.stream.paused)
+		return;
+	short events = POLLIN;
+	if (c.connecting || c.outOff < c.out.size() || c.bodyFd >= 0)
+		events |= POLLOUT;
+	reactor->modify(fd, events);
+}
+
+// END_REQUEST を受け取った。接続は空きに戻し、待ちがあれば次を載せる
+void Server::finishFastCgi(int fd, bool failed)
+{
+	FastCgiConn &c = fcgiConns[fd];
+	int clientFd = c.stream.clientFd;
+	endCgiWait(clientFd);
+	finishCgiResponse(c.stream, failed);
+
+	if (c.stream.paused)
+		reactor->add(fd, POLLIN, FD_FASTCGI, this, &c);
+	if (c.bodyFd >= 0)
+		close(c.bodyFd);
+	c.bodyFd = -1;
+	c.busy = false;
+	c.out.clear();
+	c.outOff = 0;
+	c.in.clear();
+	c.stream = CgiProcess();
+	c.stream.clientFd = -1;
+	updateFastCgiEvents(fd);
+
+	std::string addr = c.addr;
+	dispatchWaitingFastCgi(addr);
+	if (clients.count(clientFd))
+		processBufferedRequests(clientFd);
+	closeIfDone(clientFd);
+}
+
+// 接続を捨てる。処理中のリクエストは status（502 / 504）で終える
+void Server::dropFastCgiConn(int fd, int status)
+{
+	FastCgiConn &c = fcgiConns[fd];
+	int clientFd = c.busy ? c.stream.clientFd : -1;
+	bool headersSent = c.stream.headersSent;
+	std::string addr = c.addr;
+	if (c.bodyFd >= 0)
+		close(c.bodyFd);
+	reactor->remove(fd);
+	close(fd);
+	fcgiConns.erase(fd);
+
+	if (clientFd >= 0 && clients.count(clientFd))
+	{
+		endCgiWait(clientFd);
+		if (headersSent)
+			clients[clientFd].shouldClose = true; // 途中で切れたことを伝える
+		else if (status == 504)
+		{
+			clients[clientFd].shouldClose = true;
+			sendGatewayTimeout(clientFd);
+		}
+		else
+			queueCgiError(clientFd, status, "Bad Gateway");
+		processBufferedRequests(clientFd);
+		closeIfDone(clientFd);
+	}
+	dispatchWaitingFastCgi(addr);
+}
+
+// クライアントが切断した。処理中の接続は閉じてアプリケーションに中断を伝え
+// （fd が再利用されても応答が混ざらない）、待ち行列からも外す
+void Server::detachFastCgiClient(int clientFd)
+{
+	std::vector<int> drop;
+	for (std::map<int, FastCgiConn>::iterator it = fcgiConns.begin(); it != fcgiConns.end(); ++it)
+	{
+		if (it->second.busy && it->second.stream.clientFd == clientFd)
+		{
+			it->second.stream.clientFd = -1;
+			drop.push_back(it->first);
+		}
+	}
+	for (std::deque<FastCgiPending>::iterator it = fcgiWaiting.begin(); it != fcgiWaiting.end();)
+	{
+		if (it->clientFd != clientFd)
+		{
+			++it;
+			continue;
+		}
+		if (it->bodyFd >= 0)
+			close(it->bodyFd);
+		it = fcgiWaiting.erase(it);
+	}
+	for (size_t i = 0; i < drop.size(); ++i)
+		dropFastCgiConn(drop[i], 502);
+}
+
+void Server::expireFastCgi(const TimerEntry &t, long long now)
+{
+	std::map<int, FastCgiConn>::iterator it = fcgiConns.find(t.fd);
+	if (it == fcgiConns.end() || it->second.queuedDeadline != t.deadline)
+		return; // 閉じた接続 or 古いエントリ
+
+	FastCgiConn &c = it->second;
+	c.queuedDeadline = 0;
+	if (!c.busy)
+		return;
+	if (c.stream.deadline > now)
+	{
+		// 出力が続いて延長されていた → 本当の期限で積み直す
+		timers.schedule(t.fd, TIMER_FASTCGI, c.stream.deadline);
+		c.queuedDeadline = c.stream.deadline;
+		return;
+	}
+	std::cerr << "[FastCGI Timeout] " << c.addr << " fd=" << t.fd << std::endl;
+	dropFastCgiConn(t.fd, 504);
 }
 
 // ----------------------------
@@ -1284,34 +2239,87 @@ void Server::handleClientSend(int fd)
 
 	ClientInfo &client = clients[fd];
 
-	if (client.sendBuffer.empty())
+	if (!client.hasPendingOutput())
 		return; // 送るデータがないなら何もしない
 
-	size_t sendSize = std::min(client.sendBuffer.size(), static_cast<size_t>(4096));
-	ssize_t n = write(fd, client.sendBuffer.data(), sendSize);
-
-	if (n > 0)
+	// 1イベントで送る上限（大きいダウンロードが他の接続を待たせないように）
+	unsigned long long sentBefore = client.sendQueue.sentBytes();
+	SendQueue::Result r = client.sendQueue.flush(fd, 4 * 1024 * 1024);
+	statAdd(serverStats.bytesOut, static_cast<unsigned long>(client.sendQueue.sentBytes() - sentBefore));
+	if (r == SendQueue::SEND_ERROR)
 	{
-		client.sendBuffer.erase(0, n);
-	}
-	else if (n == 0)
-	{
-		// ソケットが閉じられた
-		std::cerr << "[INFO] write() returned 0, closing fd=" << fd << std::endl;
+		std::cerr << "[ERROR] send failed, closing fd=" << fd << std::endl;
 		handleConnectionClose(fd);
 		return;
 	}
-	else
+	refreshClientTimer(fd); // 送信が進んでいる間は切らない
+	if (client.waitingCgi && client.sendQueue.bufferedBytes() < CGI_RESUME_BYTES)
+		resumeCgiOutput(fd);
+
+	// 🔹キューが空になったら、この時点で送信完了
+	if (r != SendQueue::SEND_DONE)
+		return;
+	if (!client.waitingCgi)
+		endRequestStats(client);
+	if (client.shouldClose && !client.waitingCgi)
 	{
-		// n < 0: エラー発生
-		std::cerr << "[ERROR] write() failed, closing fd=" << fd << std::endl;
 		handleConnectionClose(fd);
 		return;
 	}
+	// keep-alive: 書き込み監視を外して次のリクエストを待つ
+	updateClientEvents(fd);
+	refreshClientTimer(fd);
+}
 
-	// 🔹バッファが空になったら、この時点で送信完了
-	if (client.sendBuffer.empty())
-		handleConnectionClose(fd);
+// ヘッダ（+本文）を積み、ファイル本文があればその後ろに sendfile で送る
+void Server::queueSend(int fd, const HttpResponse &res)
+{
+	std::map<int, ClientInfo>::iterator it = clients.find(fd);
+	if (it == clients.end())
+	{
+		if (res.fileFd >= 0)
+			close(res.fileFd);
+		return;
+	}
+	countResponse(it->second, res.data);
+	SendQueue &q = it->second.sendQueue;
+	if (res.fileFd >= 0 && !res.parts.empty())
+	{
+		// multipart/byteranges: SendQueue が範囲ごとに close するので fd を複製する
+		// （最後の範囲は元の fd）。足りなければ何も積まずに 500
+		std::vector<int> partFds;
+		for (size_t i = 0; i + 1 < res.parts.size(); ++i)
+		{
+			int d = fcntl(res.fileFd, F_DUPFD_CLOEXEC, 0);
+			if (d < 0)
+				break;
+			partFds.push_back(d);
+		}
+		if (partFds.size() + 1 != res.parts.size())
+		{
+			for (size_t i = 0; i < partFds.size(); ++i)
+				close(partFds[i]);
+			close(res.fileFd);
+			queueSend(fd, buildHttpResponse(500, it->second.shouldClose, "Internal Server Error\n"));
+			return;
+		}
+		partFds.push_back(res.fileFd);
+		q.append(res.data);
+		for (size_t i = 0; i < res.parts.size(); ++i)
+		{
+			q.append(res.parts[i].head);
+			q.appendFile(partFds[i], res.parts[i].offset, res.parts[i].length);
+		}
+		q.append(res.trailer);
+		updateClientEvents(fd);
+		refreshClientTimer(fd);
+		return;
+	}
+	q.append(res.data);
+	if (res.fileFd >= 0)
+		q.appendFile(res.fileFd, res.fileOffset, res.fileLength);
+	updateClientEvents(fd);
+	refreshClientTimer(fd);
 }
 
 // 送信キューにデータを追加する関数
@@ -1321,10 +2329,106 @@ void Server::queueSend(int fd, const std::string &data)
 	if (it != clients.end())
 	{
 		// 送信バッファにデータを追加
-		it->second.sendBuffer += data;
+		countResponse(it->second, data);
+		it->second.sendQueue.append(data);
+		updateClientEvents(fd);
+		refreshClientTimer(fd);
 	}
 }
 
+// ----------------------------
+// 統計（stub_status）
+// ----------------------------
+
+// リクエストを受け取った。レスポンスの先頭を積んだら countResponse で数え、
+// 最後のバイトを送ったら endRequestStats でレイテンシを記録する。
+// パイプラインで続けて来たものは先頭のリクエストと一緒に測る
+void Server::beginRequestStats(ClientInfo &client, const Request &req, const LocationRuntime *loc)
+{
+	client.statMethod = statMethodOf(req.method);
+	if (client.requestStartUs)
+		return;
+	const std::vector<LocationRuntime> &locs = router.locations();
+	client.requestStartUs = monotonicUs();
+	client.statLocation = loc ? static_cast<size_t>(loc - &locs[0]) : locs.size();
+	statAdd(serverStats.active);
+}
+
+// 積むデータがレスポンスの先頭ならステータスを数える（100 Continue などの 1xx は除く）
+void Server::countResponse(ClientInfo &client, const std::string &data)
+{
+	if (client.statMethod < 0 || data.size() < 12 || data.compare(0, 7, "HTTP/1.") != 0)
+		return;
+	int code = 0;
+	for (size_t i = 9; i < 12; ++i)
+	{
+		if (data[i] < '0' || data[i] > '9')
+			return;
+		code = code * 10 + (data[i] - '0');
+	}
+	if (code < 200 || code >= STAT_STATUS_MIN + STAT_STATUS_COUNT)
+		return;
+	statAdd(serverStats.responses[client.statMethod][code - STAT_STATUS_MIN]);
+	client.statMethod = -1;
+}
+
+void Server::endRequestStats(ClientInfo &client)
+{
+	if (!client.requestStartUs)
+		return;
+	long long us = monotonicUs() - client.requestStartUs;
+	LatencyHistogram &h = serverStats.latency[client.statLocation];
+	statAdd(h.buckets[latencyBucket(us)]);
+	statAdd(h.count);
+	statAdd(h.sumUs, static_cast<unsigned long>(us));
+	statSub(serverStats.active);
+	client.requestStartUs = 0;
+}
+
+// 回収していない CGI（動いているもの + SIGTERM して回収待ちのもの）
+void Server::refreshCgiGauge()
+{
+	unsigned long live = dyingCgi.size();
+	for (std::map<int, CgiProcess>::const_iterator it = cgiMap.begin(); it != cgiMap.end(); ++it)
+	{
+		if (!it->second.exited)
+			++live;
+	}
+	statSet(serverStats.cgiProcesses, live);
+}
+
+// stub_status: 全ワーカーのカウンタを Prometheus のテキスト形式で返す
+void Server::sendStubStatus(int fd, const Request &req)
+{
+	std::string body;
+	renderPrometheusMetrics(body);
+	std::string res;
+	HeaderWriter w(res, 256 + body.size());
+	w.status(200, "OK");
+	w.raw("Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n");
+	w.raw("Cache-Control: no-store\r\n");
+	w.contentLength(body.size());
+	w.connection(clients[fd].shouldClose);
+	w.date(date->str());
+	w.end();
+	if (req.method != "HEAD")
+		res += body;
+	queueSend(fd, res);
+}
+
+// 送信データの有無に合わせて POLLOUT 監視を切り替える
+// （変化が無ければ Reactor 側で何もしない）
+void Server::updateClientEvents(int fd)
+{
+	std::map<int, ClientInfo>::iterator it = clients.find(fd);
+	if (it == clients.end())
+		return;
+	short events = POLLIN;
+	if (it->second.hasPendingOutput())
+		events |= POLLOUT;
+	reactor->modify(fd, events);
+}
+
 // ----------------------------
 // クライアント接続終了処理
 // ----------------------------
@@ -1361,88 +2465,116 @@ void Server::handleDisconnect(int fd, int bytes)
 void Server::removeClient(int fd)
 {
 	if (fd >= 0)
+	{
+		reactor->remove(fd);
 		close(fd);
+	}
+
+	// このクライアントの CGI がまだ動いていれば打ち切る
+	// （fd が再利用されて別の接続にレスポンスが届かないように）
+	bool killedCgi = false;
+	for (std::map<int, CgiProcess>::iterator c = cgiMap.begin(); c != cgiMap.end();)
+	{
+		std::map<int, CgiProcess>::iterator cur = c++;
+		if (cur->second.clientFd != fd)
+			continue;
+		discardCgi(cur);
+		killedCgi = true;
+	}
+	for (std::deque<CgiPending>::iterator c = cgiWaiting.begin(); c != cgiWaiting.end();)
+	{
+		if (c->clientFd != fd)
+		{
+			++c;
+			continue;
+		}
+		if (c->bodyFd >= 0)
+			close(c->bodyFd);
+		c = cgiWaiting.erase(c);
+	}
+	detachFastCgiClient(fd);
 
 	std::map<int, ClientInfo>::iterator it = clients.find(fd);
 	if (it != clients.end())
 	{
-		it->second.sendBuffer.clear();
+		// 送り終えていないリクエストは計測しない（接続数だけ戻す）
+		if (it->second.requestStartUs)
+			statSub(serverStats.active);
+		statSub(serverStats.connections);
+		it->second.sendQueue.clear();
 		it->second.recvBuffer.clear();
+		it->second.parser.reset(); // 受信途中の一時ファイルを消す
+		discardUpload(fd);
+		pool->release(it->second.recvBuffer);
 		clients.erase(it);
 	}
+	if (killedCgi)
+		dispatchWaitingCgi();
 }
 
 // ----------------------------
 // ヘッダ解析・リクエスト処理
 // ----------------------------
 
-std::string Server::extractNextRequest(int clientFd, std::string &recvBuffer,
-									   Request &currentRequest)
+// recvBuffer の先頭から1リクエスト分を取り出す。
+// パーサは ClientInfo に残るので、続きの受信では前回の位置から再開する。
+bool Server::extractNextRequest(int clientFd, std::string &recvBuffer,
+								Request &currentRequest)
 {
-	RequestParser parser;
-	if (!parser.isRequestComplete(recvBuffer))
-		return "";
-
-	currentRequest = parser.parse(recvBuffer);
-
-	// --- Content-Length 超過チェック ---
-	if (isContentLengthExceeded(currentRequest, recvBuffer))
-	{
-		sendHttpError(clientFd, 400, "Bad Request", parser.getParsedLength(), recvBuffer);
-		return "";
-	}
+	RequestParser &parser = clients[clientFd].parser;
+	RequestParser::Status st = parser.feed(recvBuffer);
+	if (st == RequestParser::PARSE_INCOMPLETE)
+		return false;
 
 	// --- 不正リクエストかどうかをチェック ---
-	if (currentRequest.method.empty())
+	if (st == RequestParser::PARSE_ERROR)
 	{
-		sendHttpError(clientFd, 400, "Bad Request", parser.getParsedLength(), recvBuffer);
-		return "";
+		clients[clientFd].statMethod = STAT_OTHER; // メソッドまで読めたとは限らない
+		if (parser.getErrorStatus() == 500)
+			sendHttpError(clientFd, 500, "Internal Server Error", parser.getParsedLength(), recvBuffer);
+		else
+			sendHttpError(clientFd, 400, "Bad Request", parser.getParsedLength(), recvBuffer);
+		parser.reset();
+		discardUpload(clientFd);
+		return false;
 	}
 
+	size_t parsedLength = parser.getParsedLength();
+	parser.takeRequest(currentRequest);
+	parser.reset();
+
 	// --- POST の長さチェック ---
 	if (currentRequest.method == "POST" &&
 		currentRequest.headers.find("content-length") == currentRequest.headers.end() &&
 		currentRequest.headers.find("transfer-encoding") == currentRequest.headers.end())
 	{
-		sendHttpError(clientFd, 411, "Length Required", parser.getParsedLength(), recvBuffer);
-		return "";
+		clients[clientFd].statMethod = STAT_POST;
+		sendHttpError(clientFd, 411, "Length Required", parsedLength, recvBuffer);
+		return false;
 	}
 
 	// --- 正常リクエスト ---
-	std::string completeRequest = recvBuffer.substr(0, parser.getParsedLength());
-	recvBuffer.erase(0, parser.getParsedLength());
-	return completeRequest;
-}
-
-bool Server::isContentLengthExceeded(const Request &req,
-									 const std::string &recvBuffer)
-{
-	std::map<std::string, std::string>::const_iterator it =
-		req.headers.find("content-length");
-	if (it == req.headers.end())
-		return false; // Content-Lengthがない
-
-	size_t declaredLength = std::strtoul(it->second.c_str(), NULL, 10);
-
-	size_t headerEnd = recvBuffer.find("\r\n\r\n");
-	if (headerEnd == std::string::npos)
-		return false;
-
-	size_t bodySize = recvBuffer.size() - (headerEnd + 4);
-	return bodySize > declaredLength;
+	recvBuffer.erase(0, parsedLength);
+	return true;
 }
 
 // ヘルパー関数: HTTPエラー送信 + バッファ調整
 void Server::sendHttpError(int clientFd, int status, const std::string &msg,
 						   size_t parsedLength, std::string &recvBuffer)
 {
-	std::ostringstream res;
-	res << "HTTP/1.1 " << status << " " << msg << "\r\n"
-		<< "Content-Length: " << msg.size() << "\r\n"
-		<< "Content-Type: text/plain\r\n"
-		<< "Connection: close\r\n\r\n"
-		<< msg;
-	queueSend(clientFd, res.str());
+	std::string res;
+	HeaderWriter w(res, 256 + msg.size());
+	w.status(status, msg);
+	w.contentLength(msg.size());
+	w.raw("Content-Type: text/plain\r\n");
+	w.connection(true);
+	w.date(date->str());
+	w.end();
+	res += msg;
+	// 壊れたリクエストの後ろは区切りが信用できないので閉じる
+	if (clients.count(clientFd))
+		clients[clientFd].shouldClose = true;
+	queueSend(clientFd, res);
 	recvBuffer.erase(0, parsedLength);
 }
 
@@ -1461,75 +2593,78 @@ int Server::findFdByRecvBuffer(const std::string &buffer) const
 
 int Server::getServerFd() const { return serverFd; }
 
-std::vector<int> Server::getClientFds() const
+// Reactor の配送表に登録した種類と状態オブジェクトで振り分ける（map は引かない）
+void Server::onPollEvent(const ReactorEvent &ev)
 {
-	std::vector<int> fds;
-	for (std::map<int, ClientInfo>::const_iterator it = clients.begin();
-		 it != clients.end(); ++it)
-	{
-		fds.push_back(it->first);
-	}
-	return fds;
-}
+	int fd = ev.fd;
+	short revents = ev.revents;
 
-void Server::onPollEvent(int fd, short revents)
-{
+	switch (ev.kind)
+	{
 	// --------------------------
 	// 1. サーバーFD（新しい接続受付）
 	// --------------------------
-	if (fd == serverFd)
-	{
+	case FD_LISTENER:
 		if (revents & POLLIN)
 			handleNewConnection(); // 新しい接続受け入れ
 		if (revents & (POLLERR | POLLHUP))
 			handleServerError(fd); // listen socketにエラー
 		return;
-	}
 
 	// --------------------------
-	// 2. CGI FD（出力 or 入力 監視）
+	// FastCGI の接続FD
+	// --------------------------
+	case FD_FASTCGI:
+		handleFastCgiEvent(*static_cast<FastCgiConn *>(ev.state), revents);
+		return;
+
+	// --------------------------
+	// 2. CGI 出力FD（子→親）
 	// --------------------------
-	CgiProcess *proc = getCgiProcessByFd(fd); // inFd / outFd 両方に対応
-	if (proc)
+	case FD_CGI_OUT:
 	{
+		CgiProcess &proc = *static_cast<CgiProcess *>(ev.state);
+		// 読み残しがある間は POLLHUP でも読み切ってから閉じる
 		if (revents & POLLIN)
-			handleCgiOutput(proc->outFd);
-		if (revents & POLLOUT)
-			handleCgiInput(proc->inFd);
-		if (revents & (POLLHUP | POLLERR))
-			handleCgiClose(proc->outFd);
+			handleCgiOutput(proc);
+		else if (revents & (POLLHUP | POLLERR))
+			handleCgiClose(fd);
 		return;
 	}
 
 	// --------------------------
-	// 3. 通常クライアントFD
+	// 3. CGI 入力FD（親→子）
 	// --------------------------
-	if (clients.count(fd))
+	case FD_CGI_IN:
 	{
-		// 🔹 通常クライアント
+		CgiProcess *proc = static_cast<CgiProcess *>(ev.state);
+		if (revents & (POLLERR | POLLHUP))
+		{
+			// 子が stdin を閉じた → 残りは捨てて入力側を閉じる
+			proc->inputBuffer.clear();
+			handleCgiInput(proc);
+		}
+		else if (revents & POLLOUT)
+			handleCgiInput(proc);
+		return;
+	}
+
+	// --------------------------
+	// 4. 通常クライアントFD
+	// （ハンドラの中で閉じられることがあるので、続きは登録が残っているときだけ）
+	// --------------------------
+	case FD_CLIENT:
 		if (revents & POLLIN)
 			handleClient(fd); // クライアントからのリクエスト受信
-		if (revents & POLLOUT)
+		if (clients.count(fd) && (revents & POLLOUT))
 			handleClientSend(fd); // クライアントへのレスポンス送信
-		if (revents & (POLLERR | POLLHUP))
+		if (clients.count(fd) && (revents & (POLLERR | POLLHUP)))
 			handleConnectionClose(fd); // エラーや切断時の後処理
-	}
-}
-
-CgiProcess *Server::getCgiProcessByFd(int fd)
-{
-	std::map<int, CgiProcess>::iterator it;
+		return;
 
-	// cgiMap は outFd をキーにしている前提
-	for (it = cgiMap.begin(); it != cgiMap.end(); ++it)
-	{
-		if (it->second.outFd == fd || it->second.inFd == fd)
-		{
-			return &(it->second);
-		}
+	default:
+		return;
 	}
-
-	return NULL; // 見つからなかった
 }
 
 // listenソケット（サーバーFD）でエラーが発生したときの処理
@@ -1545,35 +2680,144 @@ void Server::handleServerError(int fd)
 	// Webservでは通常そのまま運用
 }
 
-CgiProcess *Server::getCgiProcess(int fd)
+// ----------------------------
+// タイムアウト管理
+// ----------------------------
+
+// クライアントの状態に合わせて期限を設定し直す。
+// - 送信データあり → WRITE_TIMEOUT_MS
+// - 受信途中       → READ_TIMEOUT_MS
+// - それ以外       → IDLE_TIMEOUT_MS
+// すでに積んであるエントリより遅い期限なら値を書き換えるだけ（ヒープは触らない）。
+void Server::refreshClientTimer(int fd)
 {
-	std::map<int, CgiProcess>::iterator it = cgiMap.find(fd);
-	if (it == cgiMap.end())
+	std::map<int, ClientInfo>::iterator it = clients.find(fd);
+	if (it == clients.end())
+		return;
+
+	ClientInfo &client = it->second;
+	if (client.waitingCgi)
+	{
+		client.deadline = 0; // CGI 側のタイマーに任せる
+		return;
+	}
+
+	// 2本目以降を待つ間は keepalive_timeout
+	long long timeout = IDLE_TIMEOUT_MS;
+	if (client.requestCount > 0)
+		timeout = static_cast<long long>(cfg.keepaliveTimeout) * 1000;
+	if (client.hasPendingOutput())
+		timeout = WRITE_TIMEOUT_MS;
+	else if (!client.recvBuffer.empty())
+		timeout = READ_TIMEOUT_MS;
+	client.deadline = monotonicMs() + timeout;
+
+	if (client.queuedDeadline == 0 || client.deadline < client.queuedDeadline)
 	{
-		throw std::runtime_error("getCgiProcess: fd not found in cgiMap");
+		timers.schedule(fd, TIMER_CLIENT, client.deadline);
+		client.queuedDeadline = client.deadline;
 	}
-	return &(it->second); // ✅ オブジェクトのアドレスを返す
 }
 
-// Server.cpp
-void Server::checkClientTimeouts(const int POLL_SLICE_MS, const int READ_TIMEOUT_MS)
+// CGI 完了時にクライアント側の期限を再開する
+void Server::endCgiWait(int clientFd)
+{
+	std::map<int, ClientInfo>::iterator it = clients.find(clientFd);
+	if (it == clients.end())
+		return;
+	it->second.waitingCgi = false;
+	it->second.pausedUpstream = NULL; // 応答元はこの後片付けられる
+	refreshClientTimer(clientFd);
+}
+
+void Server::expireClient(const TimerEntry &t, long long now)
 {
-	std::map<int, ClientInfo>::iterator it = clients.begin();
-	while (it != clients.end())
+	std::map<int, ClientInfo>::iterator it = clients.find(t.fd);
+	if (it == clients.end() || it->second.queuedDeadline != t.deadline)
+		return; // 切断済み or 古いエントリ
+
+	ClientInfo &client = it->second;
+	client.queuedDeadline = 0;
+	if (client.deadline == 0)
+		return; // 無期限（CGI 待ち）
+
+	if (client.deadline > now)
 	{
-		ClientInfo &client = it->second;
-		client.timeoutCounter += POLL_SLICE_MS; // pollスライス単位で加算
+		// 途中で延長されていた → 本当の期限で積み直す
+		timers.schedule(t.fd, TIMER_CLIENT, client.deadline);
+		client.queuedDeadline = client.deadline;
+		return;
+	}
 
-		if (client.timeoutCounter >= READ_TIMEOUT_MS)
-		{
-			int fd = it->first;
-			std::cerr << "[TIMEOUT] Closing client fd=" << fd << std::endl;
-			handleConnectionClose(fd); // private メソッドはクラス内ならOK
-			it = clients.begin();	   // erase後はイテレータ再取得
-		}
+	const char *phase = client.hasPendingOutput()    ? "write"
+						: !client.recvBuffer.empty() ? "read"
+													 : "idle";
+	std::cerr << "[TIMEOUT] Closing client fd=" << t.fd << " (" << phase << ")" << std::endl;
+	handleConnectionClose(t.fd);
+}
+
+void Server::expireCgi(const TimerEntry &t, long long now)
+{
+	std::map<int, CgiProcess>::iterator it = cgiMap.find(t.fd);
+	if (it == cgiMap.end())
+		return; // 終了済み
+
+	CgiProcess &proc = it->second;
+	if (proc.deadline > now)
+	{
+		// 出力が続いて延長されていた → 本当の期限で積み直す
+		if (proc.deadline != t.deadline)
+			timers.schedule(t.fd, TIMER_CGI, proc.deadline);
+		return;
+	}
+	std::cerr << "[CGI Timeout] pid=" << proc.pid
+			  << " fd=" << t.fd << std::endl;
+	statAdd(serverStats.cgiTimeouts);
+
+	int clientFd = proc.clientFd;
+	if (clients.count(clientFd))
+		clients[clientFd].shouldClose = true;
+	endCgiWait(clientFd);
+	if (!proc.headersSent)
+		sendGatewayTimeout(clientFd);
+
+	discardCgi(it);
+	dispatchWaitingCgi();
+	closeIfDone(clientFd);
+}
+
+// 猶予が過ぎても終わらない子は SIGKILL（回収は reapChildren）
+void Server::expireCgiKill(const TimerEntry &t, long long now)
+{
+	std::map<pid_t, long long>::iterator it = dyingCgi.find(t.fd);
+	if (it == dyingCgi.end() || it->second > now)
+		return; // 回収済み
+	std::cerr << "[CGI] pid=" << t.fd << " ignored SIGTERM, sending SIGKILL" << std::endl;
+	kill(it->first, SIGKILL);
+	it->second = now + CGI_KILL_GRACE_MS;
+	timers.schedule(it->first, TIMER_CGI_KILL, it->second);
+}
+
+long long Server::nextTimerDeadline() const
+{
+	return timers.nextDeadline();
+}
+
+// 期限が来たタイマーだけを処理する（全クライアントの走査はしない）
+void Server::processTimers(long long now)
+{
+	TimerEntry t;
+	while (timers.popExpired(now, t))
+	{
+		if (t.kind == TIMER_CGI)
+			expireCgi(t, now);
+		else if (t.kind == TIMER_FASTCGI)
+			expireFastCgi(t, now);
+		else if (t.kind == TIMER_CGI_KILL)
+			expireCgiKill(t, now);
+		else if (t.kind == TIMER_ACCEPT)
+			reactor->modify(serverFd, POLLIN);
 		else
-		{
-			++it;
-		}
+			expireClient(t, now);
 	}
 }
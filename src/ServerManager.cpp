@@ -1,228 +1,204 @@
 #include "ServerManager.hpp"
+#include "log.hpp"
+#include <algorithm>
 #include <iostream>
+#include <sstream>
+#include <cstring>
 #include <poll.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include "CgiProcess.hpp"
+#include <cerrno>
+
+// SIGCHLD / SIGHUP で起こすワーカーの起床用パイプ（ハンドラから読むので固定長の配列）
+static const int MAX_CHILD_WAKE = 256;
+static int childWakeFds[MAX_CHILD_WAKE];
+static int childWakeCount = 0;
+
+// どのワーカーの子か分からないので全員を起こす（write だけ: async-signal-safe）。
+// 実際の回収は各ワーカーが自分の pid だけを WNOHANG で行う
+extern "C" void onSigchld(int) {
+    int saved = errno;
+    char c = 'c';
+    for (int i = 0; i < childWakeCount; ++i) {
+        if (write(childWakeFds[i], &c, 1) < 0) {
+            // パイプが満杯なら既に起床待ちのデータがある
+        }
+    }
+    errno = saved;
+}
+
+// エラーページの読み直し。'h' を受け取ったワーカーが自分の Server で load し直す
+extern "C" void onSighup(int) {
+    int saved = errno;
+    char c = WAKE_RELOAD;
+    for (int i = 0; i < childWakeCount; ++i) {
+        if (write(childWakeFds[i], &c, 1) < 0) {
+            // 満杯でも読み切られるまでに 'h' が残っていればよい
+        }
+    }
+    errno = saved;
+}
 
-ServerManager::ServerManager() {}
+ServerManager::ServerManager() {
+    global.workerThreads = 1;
+    global.workerCpuAffinity = false;
+}
 
 ServerManager::~ServerManager() {
-    for (size_t i = 0; i < servers.size(); i++) {
-        delete servers[i];
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    childWakeCount = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        delete workers[i];
     }
 }
 
 bool ServerManager::loadConfig(const std::string &path) {
     ConfigParser parser;
     configs = parser.getServerConfigs(path);
+    global = parser.getGlobalConfig();
     return true;
 }
 
-bool ServerManager::initAllServers() {
-    for (size_t i = 0; i < configs.size(); ++i) {
-        const ServerConfig &cfg = configs[i];
-        Server* srv = new Server(cfg);
-        if (!srv->init()) {
-            delete srv;
-            return false;
-        }
-        servers.push_back(srv);
-        std::cout << "Initialized server on " 
-                  << cfg.host << ":" << cfg.port 
-                  << " (root=" << cfg.root << ")" << std::endl;
-    }
-    return true;
+// worker_threads auto → オンラインCPU数
+int ServerManager::resolveWorkerCount() const {
+    if (global.workerThreads > 0)
+        return global.workerThreads;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? static_cast<int>(n) : 1;
 }
 
-// ----------------------------
-// 全ServerのFDを1つのpoll配列で管理する
-// ----------------------------
-void ServerManager::runAllServers() {
-    const int POLL_SLICE_MS = 100;     // pollごとのスライス
-    const int READ_TIMEOUT_MS = 5000;  // タイムアウト5秒
-
-    while (true) {
-        std::vector<PollEntry> entries = buildPollEntries();
-
-        std::vector<pollfd> fds(entries.size());
-        for (size_t i = 0; i < entries.size(); ++i) {
-            fds[i].fd = entries[i].fd;
-            fds[i].events = entries[i].events;
-            fds[i].revents = 0;
-        }
-        
-        int ret = poll(&fds[0], fds.size(), POLL_SLICE_MS);
-        if (ret < 0) {
-            perror("poll");
-            continue;
-        }
+// open_file_cache はエントリごとに fd を開いたまま持ち、キャッシュは
+// ワーカー × server ブロックの数だけある。RLIMIT_NOFILE をその数で割った分の
+// 1/4 までに抑え、残りはクライアントのソケット・レスポンス用の dup・CGI の
+// パイプに回す。指定が無ければ OPEN_FILE_CACHE_DEFAULT_MAX も超えない
+void ServerManager::budgetOpenFileCache(int workerCount) {
+    struct rlimit rl;
+    long long limit = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+        limit = rl.rlim_cur == RLIM_INFINITY ? (1 << 20) : static_cast<long long>(rl.rlim_cur);
+    long long caches = static_cast<long long>(workerCount) * static_cast<long long>(configs.size());
+    if (caches < 1)
+        caches = 1;
+    long long budget = limit / caches / 4;
 
-        handlePollEvents(&fds[0], fds.size(), entries);
-
-        // --- CGI タイムアウト処理 ---
-        for (size_t i = 0; i < servers.size(); ++i) {
-            servers[i]->checkCgiTimeouts(POLL_SLICE_MS);
-        }
-
-        // --- クライアント read タイムアウトチェック ---
-        for (size_t i = 0; i < servers.size(); ++i) {
-            servers[i]->checkClientTimeouts(POLL_SLICE_MS, READ_TIMEOUT_MS); // pollTimeoutMs単位に換算
+    for (size_t i = 0; i < configs.size(); ++i) {
+        ServerConfig &c = configs[i];
+        if (c.openFileCacheMax < 0) {
+            c.openFileCacheMax = static_cast<int>(std::min<long long>(budget, OPEN_FILE_CACHE_DEFAULT_MAX));
+        } else if (c.openFileCacheMax > budget) {
+            std::ostringstream oss;
+            oss << "open_file_cache " << c.openFileCacheMax << " exceeds the fd budget (RLIMIT_NOFILE "
+                << limit << " / " << caches << " caches / 4); using " << budget;
+            logMessage(WARNING, oss.str());
+            c.openFileCacheMax = static_cast<int>(budget);
         }
-
     }
 }
 
-
-// 送信待ちデータがあるか確認
-bool Server::hasPendingSend(int fd) const {
-    std::map<int, ClientInfo>::const_iterator it = clients.find(fd);
-    if (it == clients.end()) return false;  // fd が存在しない場合は false
-    return !it->second.sendBuffer.empty();  // sendBuffer が空でなければ true
-}
-
-void Server::checkCgiTimeouts(int elapsedMs) {
-    for (std::map<int, CgiProcess>::iterator it = cgiMap.begin();
-         it != cgiMap.end();) {
-        CgiProcess &proc = it->second;
-
-        // 残り時間を減算
-        proc.remainingMs -= elapsedMs;
-
-        // タイムアウト発生
-        if (proc.remainingMs <= 0) {
-            std::cerr << "[CGI Timeout] pid=" << proc.pid
-                      << " fd=" << it->first << std::endl;
-
-            kill(proc.pid, SIGKILL);
-            sendGatewayTimeout(proc.clientFd);
-
-            if (proc.inFd > 0) close(proc.inFd);
-            if (proc.outFd > 0) close(proc.outFd);
-
-            waitpid(proc.pid, NULL, 0);
-
-            std::map<int, CgiProcess>::iterator tmp = it++;
-            cgiMap.erase(tmp);
-        } else {
-            ++it;
-        }
+// ワーカーごとに Reactor と Server 一式を作る。
+// 2つ以上なら各ワーカーが SO_REUSEPORT で自分の listen ソケットを持ち、
+// カーネルが新規接続をワーカー間で振り分ける。
+bool ServerManager::initAllServers() {
+    int count = resolveWorkerCount();
+    budgetOpenFileCache(count);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+        ncpu = 1;
+
+    for (int i = 0; i < count; ++i) {
+        int cpu = global.workerCpuAffinity ? static_cast<int>(i % ncpu) : -1;
+        Worker *w = new Worker(i, cpu);
+        workers.push_back(w);
+        if (!w->init(configs, count > 1))
+            return false;
     }
-}
-
-void Server::sendGatewayTimeout(int clientFd) {
-    // 504 レスポンスの本文を作成
-    std::string body = "<html><body><h1>504 Gateway Timeout</h1>"
-                       "<p>The CGI script did not respond in time.</p></body></html>";
-
-    // Content-Length を本文のサイズに合わせる
-    std::stringstream ss;
-    ss << "HTTP/1.1 504 Gateway Timeout\r\n"
-       << "Content-Length: " << body.size() << "\r\n"
-       << "Content-Type: text/html\r\n"
-       << "Connection: close\r\n\r\n"
-       << body;
-
-    std::string response = ss.str();
-
-    // クライアント情報が存在しない場合は作成
-    std::map<int, ClientInfo>::iterator it = clients.find(clientFd);
-    if (it == clients.end()) {
-        ClientInfo ci;
-        clients[clientFd] = ci;
-        it = clients.find(clientFd);
+    if (count > 1) {
+        std::ostringstream oss;
+        oss << "Started with " << count << " worker threads";
+        logMessage(INFO, oss.str());
     }
-
-    ClientInfo &client = it->second;
-    client.sendBuffer += response;
+    return true;
 }
 
 // ----------------------------
-// poll対象FDの作成
+// イベントループ開始
 // ----------------------------
-std::vector<PollEntry> ServerManager::buildPollEntries() {
-    std::vector<PollEntry> pollEntries;
-
-    for (size_t i = 0; i < servers.size(); ++i) {
-        Server* srv = servers[i];
-
-        // --- listen socket ---
-        PollEntry listenEntry;
-        listenEntry.fd = srv->getServerFd();
-        listenEntry.events = POLLIN;
-        listenEntry.server = srv;
-        listenEntry.clientFd = 0;
-        listenEntry.isCgiFd = false;
-        pollEntries.push_back(listenEntry);
-
-        // --- client sockets ---
-        std::vector<int> clientFds = srv->getClientFds();
-        for (size_t j = 0; j < clientFds.size(); ++j) {
-            PollEntry entry;
-            entry.fd = clientFds[j];
-            entry.events = POLLIN;
-            if (srv->hasPendingSend(clientFds[j]))
-                entry.events |= POLLOUT;
-            entry.server = srv;
-            entry.clientFd = clientFds[j];
-            entry.isCgiFd = false;
-            pollEntries.push_back(entry);
-        }
-
-        // --- CGI FDs ---
-        std::vector<int> cgiFds = srv->getCgiFds();
-        for (size_t j = 0; j < cgiFds.size(); ++j) {
-            int outFd = cgiFds[j];
-            CgiProcess *proc = srv->getCgiProcess(outFd); // CGI状態を取得
-            if (!proc)
-                continue;
-
-            // --- 出力側（子→親） ---
-            PollEntry outEntry;
-            outEntry.fd = proc->outFd;
-            outEntry.events = POLLIN; // 常に子出力監視
-            outEntry.server = srv;
-            outEntry.clientFd = proc->clientFd;
-            outEntry.isCgiFd = true;
-            pollEntries.push_back(outEntry);
-
-            // --- 入力側（親→子） ---
-            if (proc->inFd >= 0) {
-                PollEntry inEntry;
-                inEntry.fd = proc->inFd;
-                inEntry.events = 0;
-                if (!proc->inputBuffer.empty())
-                    inEntry.events |= POLLOUT; // 書き込み残があればPOLLOUT
-                inEntry.server = srv;
-                inEntry.clientFd = proc->clientFd;
-                inEntry.isCgiFd = true;
-                pollEntries.push_back(inEntry);
-            }
-        }
+void ServerManager::runAllServers() {
+    // keep-alive 中に相手が先に切断しても write() でプロセスが落ちないように
+    signal(SIGPIPE, SIG_IGN);
+    installChildHandler();
+
+    if (workers.size() == 1) {
+        // 1ワーカーなら従来どおりメインスレッドで回す
+        workers[0]->run();
+        return;
     }
-
-    return pollEntries;
+    runWorkerThreads();
 }
 
+// CGI の子が終わったらワーカーのループを起こす（waitpid でブロックしないため）。
+// SIGHUP も同じパイプでワーカーに伝える
+void ServerManager::installChildHandler() {
+    childWakeCount = 0;
+    for (size_t i = 0; i < workers.size() && i < static_cast<size_t>(MAX_CHILD_WAKE); ++i)
+        childWakeFds[childWakeCount++] = workers[i]->wakeupFd();
+
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // SIGHUP: error_page などのファイルを読み直す（プロセスは止めない）
+    sa.sa_handler = onSighup;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, NULL);
+}
 
-std::vector<int> Server::getCgiFds() const {
-    std::vector<int> fds;
-    for (std::map<int, CgiProcess>::const_iterator it = cgiMap.begin();
-        it != cgiMap.end(); ++it) {
-        fds.push_back(it->first);
+// 各ワーカーをスレッドで起動し、メインスレッドは SIGINT/SIGTERM を待つ。
+// 受け取ったら全ワーカーを止めて、スレッドごとのカウンタを集計して出力する。
+void ServerManager::runWorkerThreads() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    // ワーカースレッドはこのマスクを引き継ぐので、シグナルはメインだけが受ける
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        if (!workers[i]->start())
+            break;
     }
-    return fds;
+
+    int sig = 0;
+    sigwait(&set, &sig);
+
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i]->stop();
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i]->join();
+
+    WorkerStats total = aggregateStats();
+    std::ostringstream oss;
+    oss << "Shutting down: accepted=" << total.accepted
+        << " rejected=" << total.rejected
+        << " requests=" << total.requests;
+    logMessage(INFO, oss.str());
 }
 
-// ----------------------------
-// pollイベント処理
-// ----------------------------
-void ServerManager::handlePollEvents(struct pollfd* fds, size_t nfds, const std::vector<PollEntry>& entries) {
-    for (size_t i = 0; i < nfds; i++) {
-        if (fds[i].revents != 0) {
-            entries[i].server->onPollEvent(fds[i].fd, fds[i].revents);
-        }
+// 全ワーカーのカウンタを合算する（実行中に呼んでもよい）
+WorkerStats ServerManager::aggregateStats() const {
+    WorkerStats total;
+    for (size_t i = 0; i < workers.size(); ++i) {
+        const WorkerStats &s = workers[i]->getStats();
+        total.accepted += statLoad(s.accepted);
+        total.rejected += statLoad(s.rejected);
+        total.requests += statLoad(s.requests);
     }
+    return total;
 }
-
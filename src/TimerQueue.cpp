@@ -0,0 +1,44 @@
+#include "TimerQueue.hpp"
+#include <algorithm>
+#include <time.h>
+
+long long monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long monotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// std::*_heap は最大ヒープなので「期限が遅いほど小さい」と比較する
+static bool laterThan(const TimerEntry &a, const TimerEntry &b) {
+    return a.deadline > b.deadline;
+}
+
+void TimerQueue::schedule(int fd, TimerKind kind, long long deadline) {
+    TimerEntry e;
+    e.deadline = deadline;
+    e.fd = fd;
+    e.kind = kind;
+    heap.push_back(e);
+    std::push_heap(heap.begin(), heap.end(), laterThan);
+}
+
+long long TimerQueue::nextDeadline() const {
+    if (heap.empty())
+        return -1;
+    return heap.front().deadline;
+}
+
+bool TimerQueue::popExpired(long long now, TimerEntry &out) {
+    if (heap.empty() || heap.front().deadline > now)
+        return false;
+    std::pop_heap(heap.begin(), heap.end(), laterThan);
+    out = heap.back();
+    heap.pop_back();
+    return true;
+}
@@ -0,0 +1,163 @@
+#include "Worker.hpp"
+#include "TimerQueue.hpp"
+#include "log.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+
+Worker::Worker(int id, int cpu)
+    : id(id), cpu(cpu), reactor(NULL), stopRequested(0), started(false) {
+    wakeFds[0] = -1;
+    wakeFds[1] = -1;
+}
+
+Worker::~Worker() {
+    for (size_t i = 0; i < servers.size(); i++) {
+        delete servers[i];
+    }
+    if (wakeFds[0] >= 0)
+        close(wakeFds[0]);
+    if (wakeFds[1] >= 0)
+        close(wakeFds[1]);
+    delete reactor;
+}
+
+bool Worker::init(const std::vector<ServerConfig> &configs, bool reusePort) {
+    reactor = Reactor::create();
+
+    // 起床用パイプ（所有 Server なしで登録し、Worker 自身が処理する）
+    if (pipe2(wakeFds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        logMessage(ERROR, "pipe2() failed for worker wakeup");
+        return false;
+    }
+    reactor->add(wakeFds[0], POLLIN, FD_WAKEUP, NULL, NULL);
+
+    for (size_t i = 0; i < configs.size(); ++i) {
+        const ServerConfig &cfg = configs[i];
+        Server* srv = new Server(cfg);
+        if (!srv->init(reactor, &stats, &pool, &date, reusePort)) {
+            delete srv;
+            return false;
+        }
+        servers.push_back(srv);
+        if (id == 0) {
+            std::cout << "Initialized server on "
+                      << cfg.host << ":" << cfg.port
+                      << " (root=" << cfg.root << ")" << std::endl;
+        }
+    }
+    return true;
+}
+
+// ----------------------------
+// イベントループ本体
+// ----------------------------
+void Worker::run() {
+    pinToCpu();
+    while (!__atomic_load_n(&stopRequested, __ATOMIC_ACQUIRE)) {
+        const std::vector<ReactorEvent> &events = reactor->wait(nextWaitMs());
+        date.update(); // 秒が変わったときだけ文字列を作り直す
+        handleEvents(events);
+
+        // --- 期限が来たタイマーだけ処理（client read/write/idle, CGI） ---
+        long long now = monotonicMs();
+        for (size_t i = 0; i < servers.size(); ++i) {
+            servers[i]->processTimers(now);
+        }
+    }
+}
+
+void *Worker::threadMain(void *arg) {
+    static_cast<Worker *>(arg)->run();
+    return NULL;
+}
+
+bool Worker::start() {
+    if (pthread_create(&thread, NULL, &Worker::threadMain, this) != 0) {
+        logMessage(ERROR, "pthread_create() failed");
+        return false;
+    }
+    started = true;
+    return true;
+}
+
+void Worker::stop() {
+    __atomic_store_n(&stopRequested, 1, __ATOMIC_RELEASE);
+    char c = 0;
+    if (write(wakeFds[1], &c, 1) < 0) {
+        // パイプが満杯なら既に起床待ちのデータがある
+    }
+}
+
+void Worker::join() {
+    if (started) {
+        pthread_join(thread, NULL);
+        started = false;
+    }
+}
+
+bool Worker::drainWakeup() {
+    char buf[64];
+    bool reload = false;
+    ssize_t n;
+    while ((n = read(wakeFds[0], buf, sizeof(buf))) > 0) {
+        if (std::memchr(buf, WAKE_RELOAD, static_cast<size_t>(n)))
+            reload = true;
+    }
+    return reload;
+}
+
+// ----------------------------
+// イベント処理
+// ----------------------------
+void Worker::handleEvents(const std::vector<ReactorEvent> &events) {
+    // 処理中に remove() された FD は Reactor 側で revents = 0 になる
+    for (size_t i = 0; i < events.size(); i++) {
+        if (events[i].revents == 0)
+            continue;
+        if (events[i].kind == FD_WAKEUP) {
+            // 停止要求か SIGCHLD（どちらか分からないので毎回子を回収してみる）
+            bool reload = drainWakeup();
+            for (size_t j = 0; j < servers.size(); ++j) {
+                if (reload)
+                    servers[j]->reloadErrorPages();
+                servers[j]->reapChildren();
+            }
+        } else
+            events[i].server->onPollEvent(events[i]);
+    }
+}
+
+// 一番近いタイマー期限までの待ち時間（タイマーが無ければ -1 = 無期限）
+int Worker::nextWaitMs() const {
+    long long nearest = -1;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        long long d = servers[i]->nextTimerDeadline();
+        if (d >= 0 && (nearest < 0 || d < nearest))
+            nearest = d;
+    }
+    if (nearest < 0)
+        return -1;
+
+    long long wait = nearest - monotonicMs();
+    if (wait < 0)
+        wait = 0;
+    return static_cast<int>(wait);
+}
+
+void Worker::pinToCpu() {
+    if (cpu < 0)
+        return;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        std::ostringstream oss;
+        oss << "worker " << id << ": failed to pin to cpu " << cpu;
+        logMessage(WARNING, oss.str());
+    }
+#endif
+}
@@ -0,0 +1,229 @@
+#include "resp/DirListing.hpp"
+#include "resp/HeaderWriter.hpp"
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// ディレクトリが先、その中は名前順（バイト順）
+static bool entryLess(const DirEntry &a, const DirEntry &b) {
+  if (a.isDir != b.isDir)
+    return a.isDir;
+  return a.name < b.name;
+}
+
+bool DirListingCache::scan(const std::string &dirPath, DirListing &out) {
+  DIR *dir = opendir(dirPath.c_str());
+  if (!dir)
+    return false;
+  int dfd = dirfd(dir);
+  out.entries.clear();
+
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    const char *name = ent->d_name;
+    // 「.」と「..」は表示しない
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+      continue;
+    // 受信途中のアップロード / ボディの一時ファイルは出さない
+    if (std::strncmp(name, ".upload_", 8) == 0 || std::strncmp(name, ".body_", 6) == 0)
+      continue;
+
+    DirEntry e;
+    e.name = name;
+    if (ent->d_type == DT_DIR) {
+      e.isDir = true;
+    } else if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) {
+      // 種類が分からないもの / リンク先だけ stat する（壊れたリンクは出さない）
+      struct stat st;
+      if (fstatat(dfd, name, &st, 0) != 0)
+        continue;
+      e.isDir = S_ISDIR(st.st_mode);
+    } else {
+      e.isDir = false;
+    }
+    out.entries.push_back(e);
+  }
+  closedir(dir);
+  std::sort(out.entries.begin(), out.entries.end(), entryLess);
+  return true;
+}
+
+DirListingCache::DirListingCache(size_t maxDirs) : lru(), index(), maxDirs(maxDirs) {}
+
+const DirListing *DirListingCache::lookup(const std::string &dirPath) {
+  struct stat st;
+  if (stat(dirPath.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+    return NULL;
+
+  std::map<std::string, EntryList::iterator>::iterator hit = index.find(dirPath);
+  if (hit != index.end()) {
+    EntryList::iterator e = hit->second;
+    if (e->ino == st.st_ino && e->mtime == st.st_mtim.tv_sec &&
+        e->mtimeNsec == st.st_mtim.tv_nsec) {
+      lru.splice(lru.begin(), lru, e);
+      return &*e;
+    }
+    lru.erase(e);
+    index.erase(hit);
+  }
+
+  // 大きい一覧をコピーしないよう、リストの中に直接読む
+  lru.push_front(DirListing());
+  DirListing &fresh = lru.front();
+  if (!scan(dirPath, fresh)) {
+    lru.pop_front();
+    return NULL;
+  }
+  fresh.path = dirPath;
+  fresh.ino = st.st_ino;
+  fresh.mtime = st.st_mtim.tv_sec;
+  fresh.mtimeNsec = st.st_mtim.tv_nsec;
+  index[dirPath] = lru.begin();
+  while (lru.size() > maxDirs && lru.size() > 1) {
+    index.erase(lru.back().path);
+    lru.pop_back();
+  }
+  return &lru.front();
+}
+
+// ====== 出力 ======
+
+static void appendHtmlEscaped(std::string &out, const std::string &s) {
+  for (size_t i = 0; i < s.size(); ++i) {
+    switch (s[i]) {
+    case '&': out += "&amp;"; break;
+    case '<': out += "&lt;"; break;
+    case '>': out += "&gt;"; break;
+    case '"': out += "&quot;"; break;
+    case '\'': out += "&#39;"; break;
+    default: out += s[i];
+    }
+  }
+}
+
+// href 用に名前をパーセントエンコードする（英数字と -._~ 以外）
+static void appendUrlEncoded(std::string &out, const std::string &s) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (size_t i = 0; i < s.size(); ++i) {
+    unsigned char c = static_cast<unsigned char>(s[i]);
+    if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') ||
+        c == '-' || c == '.' || c == '_' || c == '~') {
+      out += static_cast<char>(c);
+    } else {
+      out += '%';
+      out += hex[c >> 4];
+      out += hex[c & 0xF];
+    }
+  }
+}
+
+static void appendJsonString(std::string &out, const std::string &s) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  for (size_t i = 0; i < s.size(); ++i) {
+    unsigned char c = static_cast<unsigned char>(s[i]);
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += static_cast<char>(c);
+    } else if (c < 0x20) {
+      out += "\\u00";
+      out += hex[c >> 4];
+      out += hex[c & 0xF];
+    } else {
+      out += static_cast<char>(c);
+    }
+  }
+  out += '"';
+}
+
+// [first, last) をページの範囲にする
+static void pageRange(const DirListing &dir, size_t page, size_t limit, size_t &first,
+                      size_t &last) {
+  size_t total = dir.entries.size();
+  first = total; // 範囲外のページは空（掛け算で溢れないよう先に比べる）
+  if (page >= 1 && page - 1 <= total / limit)
+    first = std::min(total, (page - 1) * limit);
+  last = std::min(total, first + limit);
+}
+
+static void appendPageLink(std::string &out, size_t page, size_t limit, const char *label) {
+  out += "<a href=\"?page=";
+  appendDecimal(out, page);
+  out += "&amp;limit=";
+  appendDecimal(out, limit);
+  out += "\">";
+  out += label;
+  out += "</a> ";
+}
+
+void renderDirListingHtml(std::string &out, const DirListing &dir, const std::string &uriPath,
+                          size_t page, size_t limit) {
+  size_t first, last;
+  pageRange(dir, page, limit, first, last);
+  bool slash = !uriPath.empty() && uriPath[uriPath.size() - 1] == '/';
+  out.reserve(out.size() + 256 + (last - first) * (64 + uriPath.size()));
+
+  out += "<html><head><title>Index of ";
+  appendHtmlEscaped(out, uriPath);
+  out += "</title></head><body><h1>Index of ";
+  appendHtmlEscaped(out, uriPath);
+  out += "</h1><ul>";
+  for (size_t i = first; i < last; ++i) {
+    const DirEntry &e = dir.entries[i];
+    out += "<li><a href=\"";
+    appendHtmlEscaped(out, uriPath);
+    if (!slash)
+      out += '/';
+    appendUrlEncoded(out, e.name);
+    if (e.isDir)
+      out += '/';
+    out += "\">";
+    appendHtmlEscaped(out, e.name);
+    if (e.isDir)
+      out += '/';
+    out += "</a></li>";
+  }
+  out += "</ul>";
+  // 1ページに収まらないときだけページ送りを出す
+  if (dir.entries.size() > limit) {
+    out += "<p>";
+    if (page > 1 && first > 0)
+      appendPageLink(out, page - 1, limit, "&laquo; prev");
+    out += "page ";
+    appendDecimal(out, page);
+    out += " / ";
+    appendDecimal(out, (dir.entries.size() + limit - 1) / limit);
+    out += ' ';
+    if (last < dir.entries.size())
+      appendPageLink(out, page + 1, limit, "next &raquo;");
+    out += "</p>";
+  }
+  out += "<hr><address>Webserv/1.0</address></body></html>";
+}
+
+void renderDirListingJson(std::string &out, const DirListing &dir, const std::string &uriPath,
+                          size_t page, size_t limit) {
+  size_t first, last;
+  pageRange(dir, page, limit, first, last);
+  out.reserve(out.size() + 128 + (last - first) * 48);
+
+  out += "{\"path\":";
+  appendJsonString(out, uriPath);
+  out += ",\"page\":";
+  appendDecimal(out, page);
+  out += ",\"limit\":";
+  appendDecimal(out, limit);
+  out += ",\"total\":";
+  appendDecimal(out, dir.entries.size());
+  out += ",\"entries\":[";
+  for (size_t i = first; i < last; ++i) {
+    if (i != first)
+      out += ',';
+    out += "{\"name\":";
+    appendJsonString(out, dir.entries[i].name);
+    out += dir.entries[i].isDir ? ",\"type\":\"directory\"}" : ",\"type\":\"file\"}";
+  }
+  out += "]}\n";
+}
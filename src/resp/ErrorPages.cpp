@@ -0,0 +1,91 @@
+#include "resp/ErrorPages.hpp"
+#include "resp/HeaderWriter.hpp"
+#include "resp/ResponseBuilder.hpp"
+#include <fstream>
+#include <sstream>
+
+// 設定に無くても返すことのあるステータス（既定ページで先に作っておく）
+static const int kCommonStatus[] = {400, 403, 404, 405, 413, 415, 500, 501, 502, 504};
+
+static bool readWholeFile(const std::string &path, std::string &out) {
+  std::ifstream ifs(path.c_str(), std::ios::binary);
+  if (!ifs.is_open())
+    return false;
+  std::ostringstream oss;
+  oss << ifs.rdbuf();
+  out = oss.str();
+  return true;
+}
+
+ErrorPages::ErrorPages() : server_(), located_(), defaultBody_(), hasDefault_(false) {}
+
+// body が NULL なら本文なし（既定ページも読めなかったとき）
+ErrorPages::Rendered ErrorPages::render(int status, const std::string *body) {
+  Rendered r;
+  HeaderWriter head(r.headKeepAlive);
+  head.status(status, reasonPhrase(status));
+  if (body)
+    head.raw("Content-Type: text/html\r\n");
+  head.contentLength(body ? body->size() : 0);
+  r.headClose = r.headKeepAlive;
+  HeaderWriter(r.headKeepAlive).connection(false);
+  HeaderWriter(r.headClose).connection(true);
+  HeaderWriter(r.tail).end();
+  if (body)
+    r.tail += *body;
+  return r;
+}
+
+void ErrorPages::load(const ServerConfig &cfg, const std::vector<LocationRuntime> &locations) {
+  server_.clear();
+  located_.clear();
+  hasDefault_ = readWholeFile(DEFAULT_ERROR_PAGE, defaultBody_);
+  const std::string *fallback = hasDefault_ ? &defaultBody_ : NULL;
+
+  for (size_t i = 0; i < sizeof(kCommonStatus) / sizeof(kCommonStatus[0]); ++i)
+    server_[kCommonStatus[i]] = render(kCommonStatus[i], fallback);
+
+  std::string body;
+  for (std::map<int, std::string>::const_iterator it = cfg.errorPages.begin();
+       it != cfg.errorPages.end(); ++it) {
+    if (readWholeFile(it->second, body))
+      server_[it->first] = render(it->first, &body);
+    else
+      server_[it->first] = render(it->first, fallback);
+  }
+
+  // return のコードと同じステータスのエラーには、その値をファイルとして返す（従来どおり）
+  for (size_t i = 0; i < locations.size(); ++i) {
+    const LocationRuntime &rt = locations[i];
+    if (!rt.conf)
+      continue;
+    for (std::map<int, std::string>::const_iterator it = rt.conf->ret.begin();
+         it != rt.conf->ret.end(); ++it) {
+      if (readWholeFile(it->second, body))
+        located_[std::make_pair(&rt, it->first)] = render(it->first, &body);
+    }
+  }
+}
+
+void ErrorPages::append(std::string &out, const LocationRuntime *loc, int status, bool close,
+                        const std::string &date) {
+  const Rendered *r = NULL;
+  if (loc && !located_.empty()) {
+    std::map<std::pair<const LocationRuntime *, int>, Rendered>::const_iterator it =
+        located_.find(std::make_pair(loc, status));
+    if (it != located_.end())
+      r = &it->second;
+  }
+  if (!r) {
+    std::map<int, Rendered>::iterator it = server_.find(status);
+    if (it == server_.end()) // 珍しいステータスは初回だけメモリ上の既定ページから作る
+      it = server_.insert(std::make_pair(status, render(status, hasDefault_ ? &defaultBody_ : NULL))).first;
+    r = &it->second;
+  }
+
+  const std::string &head = close ? r->headClose : r->headKeepAlive;
+  HeaderWriter w(out, head.size() + date.size() + 8 + r->tail.size());
+  out += head;
+  w.date(date);
+  out += r->tail;
+}
@@ -0,0 +1,80 @@
+#include "resp/GzipCache.hpp"
+#include <cstring>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+bool gzipCompress(const char *data, size_t len, std::string &out) {
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+  // windowBits + 16 で zlib ではなく gzip のヘッダ / トレーラを付ける
+  if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+  out.resize(deflateBound(&zs, static_cast<uLong>(len)) + 32);
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+  zs.avail_in = static_cast<uInt>(len);
+  zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+  zs.avail_out = static_cast<uInt>(out.size());
+  int rc = deflate(&zs, Z_FINISH);
+  size_t produced = zs.total_out;
+  deflateEnd(&zs);
+  if (rc != Z_STREAM_END)
+    return false;
+  out.resize(produced);
+  return true;
+}
+
+GzipCache::GzipCache(size_t maxBytes) : lru(), index(), bytes(0), maxBytes(maxBytes) {}
+
+void GzipCache::evictOverflow() {
+  // 先頭（今入れたもの）は残す
+  while (bytes > maxBytes && lru.size() > 1) {
+    Entry &old = lru.back();
+    bytes -= entryBytes(old);
+    index.erase(old.path);
+    lru.pop_back();
+  }
+}
+
+const std::string *GzipCache::lookup(const FileInfo &file) {
+  if (file.isDir || file.fd < 0 || file.size <= 0 || file.size > GZIP_MAX_FILE_SIZE)
+    return NULL;
+
+  std::map<std::string, EntryList::iterator>::iterator hit = index.find(file.path);
+  if (hit != index.end()) {
+    EntryList::iterator e = hit->second;
+    if (e->mtime == file.mtime && e->size == file.size && e->ino == file.ino) {
+      lru.splice(lru.begin(), lru, e);
+      return e->data.empty() ? NULL : &e->data;
+    }
+    bytes -= entryBytes(*e);
+    lru.erase(e);
+    index.erase(hit);
+  }
+
+  // キャッシュの fd から読む（オフセットを動かさないよう pread）
+  std::vector<char> raw(static_cast<size_t>(file.size));
+  size_t got = 0;
+  while (got < raw.size()) {
+    ssize_t n = pread(file.fd, &raw[got], raw.size() - got, static_cast<off_t>(got));
+    if (n <= 0)
+      return NULL;
+    got += static_cast<size_t>(n);
+  }
+
+  Entry ent;
+  ent.path = file.path;
+  ent.mtime = file.mtime;
+  ent.size = file.size;
+  ent.ino = file.ino;
+  if (!gzipCompress(&raw[0], raw.size(), ent.data) || ent.data.size() >= raw.size())
+    ent.data.clear();
+  if (entryBytes(ent) > maxBytes)
+    ent.data.clear();
+
+  lru.push_front(ent);
+  index[file.path] = lru.begin();
+  bytes += entryBytes(lru.front());
+  evictOverflow();
+  return lru.front().data.empty() ? NULL : &lru.front().data;
+}
@@ -0,0 +1,32 @@
+#include "resp/HeaderWriter.hpp"
+
+void appendDecimal(std::string &out, unsigned long long n) {
+  char buf[20];
+  size_t i = sizeof(buf);
+  do {
+    buf[--i] = static_cast<char>('0' + n % 10);
+    n /= 10;
+  } while (n != 0);
+  out.append(buf + i, sizeof(buf) - i);
+}
+
+void HeaderWriter::status(int code, const std::string &reason) {
+  raw("HTTP/1.1 ");
+  appendDecimal(out_, static_cast<unsigned long long>(code));
+  out_ += ' ';
+  out_ += reason;
+  raw("\r\n");
+}
+
+void HeaderWriter::header(const char *name, const std::string &value) {
+  out_.append(name, std::strlen(name));
+  raw(": ");
+  out_ += value;
+  raw("\r\n");
+}
+
+void HeaderWriter::contentLength(unsigned long long n) {
+  raw("Content-Length: ");
+  appendDecimal(out_, n);
+  raw("\r\n");
+}
@@ -0,0 +1,127 @@
+#include "resp/OpenFileCache.hpp"
+#include "TimerQueue.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+OpenFileCache::OpenFileCache(size_t maxEntries, long long validMs)
+    : lru(), index(), maxEntries(maxEntries), validMs(validMs) {}
+
+OpenFileCache::~OpenFileCache() {
+  for (EntryList::iterator it = lru.begin(); it != lru.end(); ++it)
+    release(*it);
+}
+
+void OpenFileCache::configure(size_t max, long long valid) {
+  maxEntries = max;
+  validMs = valid;
+  evictOverflow();
+}
+
+void OpenFileCache::release(FileInfo &e) const {
+  if (e.fd >= 0)
+    close(e.fd);
+  e.fd = -1;
+}
+
+// path を開いて（ディレクトリは stat だけ）情報を埋める
+bool OpenFileCache::load(const std::string &path, FileInfo &out) const {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return false;
+
+  out.path = path;
+  out.isDir = S_ISDIR(st.st_mode);
+  out.fd = -1;
+  if (!out.isDir) {
+    out.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (out.fd < 0)
+      return false;
+    // stat と open の間に差し替えられていても、開いた実体の値を使う
+    fstat(out.fd, &st);
+  }
+  out.size = st.st_size;
+  out.mtime = st.st_mtime;
+  out.ino = st.st_ino;
+  out.dev = st.st_dev;
+  out.mime.clear();
+  out.etag.clear();
+  out.lastModified.clear();
+  out.validatedAt = monotonicMs();
+  return true;
+}
+
+FileInfo *OpenFileCache::lookup(const std::string &path) {
+  long long now = monotonicMs();
+  std::map<std::string, EntryList::iterator>::iterator hit = index.find(path);
+  if (hit != index.end()) {
+    EntryList::iterator e = hit->second;
+    // off（maxEntries 0）のときは期限内でも毎回 stat で確かめる
+    if (maxEntries > 0 && now - e->validatedAt < validMs) {
+      lru.splice(lru.begin(), lru, e);
+      return &*e;
+    }
+    // 期限切れ: 同じ実体のままなら fd を使い回す
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && st.st_ino == e->ino &&
+        st.st_dev == e->dev && st.st_mtime == e->mtime &&
+        st.st_size == e->size && S_ISDIR(st.st_mode) == e->isDir) {
+      e->validatedAt = now;
+      lru.splice(lru.begin(), lru, e);
+      return &*e;
+    }
+    release(*e);
+    lru.erase(e);
+    index.erase(hit);
+  }
+
+  FileInfo fresh;
+  if (!load(path, fresh)) {
+    // fd が尽きていたら、キャッシュの fd を返してもう一度だけ開く
+    if (errno != EMFILE && errno != ENFILE)
+      return NULL;
+    int saved = errno;
+    if (shed() == 0) {
+      errno = saved;
+      return NULL;
+    }
+    if (!load(path, fresh))
+      return NULL;
+  }
+  lru.push_front(fresh);
+  index[path] = lru.begin();
+  evictOverflow();
+  return &lru.front();
+}
+
+void OpenFileCache::invalidate(const std::string &path) {
+  std::map<std::string, EntryList::iterator>::iterator hit = index.find(path);
+  if (hit == index.end())
+    return;
+  release(*hit->second);
+  lru.erase(hit->second);
+  index.erase(hit);
+}
+
+size_t OpenFileCache::shed() {
+  size_t n = (lru.size() + 1) / 2;
+  for (size_t i = 0; i < n; ++i) {
+    FileInfo &victim = lru.back();
+    index.erase(victim.path);
+    release(victim);
+    lru.pop_back();
+  }
+  return n;
+}
+
+// 古いものから捨てる。maxEntries 0 でも直前に返した1件は残す
+void OpenFileCache::evictOverflow() {
+  size_t limit = maxEntries ? maxEntries : 1;
+  while (lru.size() > limit) {
+    FileInfo &victim = lru.back();
+    index.erase(victim.path);
+    release(victim);
+    lru.pop_back();
+  }
+}
@@ -1,41 +1,31 @@
 #include "resp/ResponseBuilder.hpp"
+#include "resp/ErrorPages.hpp"
+#include "resp/GzipCache.hpp"
+#include "resp/HeaderWriter.hpp"
 #include "resp/Mime.hpp"
+#include <algorithm>
 #include <cerrno>
-#include <dirent.h>
+#include <cstring>
 #include <fstream>
 #include <map>
 #include <sstream>
 #include <sys/stat.h>
 #include <cstdio>     // std::remove
+#include <fcntl.h>
+#include <unistd.h>
 
 // ====== 便利関数======
 static bool isMethodAllowed(const std::string &m,
-                            const ServerConfig::Location *loc) {
-  if (!loc)
-    return true; // Locationが無いなら全許可とみなす
-  if (loc->method.empty())
-    return true; // 空なら全許可
-
-  for (size_t i = 0; i < loc->method.size(); ++i) {
-    if (loc->method[i] == m)
-      return true;
-  }
-  return false;
+                            const LocationRuntime *loc) {
+  if (!loc || !loc->methodsListed)
+    return true; // Location が無い / 指定が空なら全許可とみなす
+  return loc->allows(methodBit(m));
 }
 
-static std::string buildAllowHeader(const ServerConfig::Location *loc) {
-  if (!loc || loc->method.empty()) {
-    // デフォルトは3メソッド全部
-    return "GET, HEAD, DELETE";
-  }
-  // loc->method を ", " で結合
-  std::ostringstream oss;
-  for (size_t i = 0; i < loc->method.size(); ++i) {
-    if (i)
-      oss << ", ";
-    oss << loc->method[i];
-  }
-  return oss.str();
+// 値は起動時に組み立て済み（指定が無ければ3メソッド全部）
+static const std::string &buildAllowHeader(const LocationRuntime *loc) {
+  static const std::string defaultAllow = "GET, HEAD, DELETE";
+  return loc ? loc->allow : defaultAllow;
 }
 
 static std::string joinPath(const std::string &a, const std::string &b) {
@@ -48,13 +38,6 @@ static std::string joinPath(const std::string &a, const std::string &b) {
   return a + b;
 }
 
-static std::string slurpFile(const std::string &p) {
-  std::ifstream ifs(p.c_str(), std::ios::in | std::ios::binary);
-  std::ostringstream oss;
-  oss << ifs.rdbuf();
-  return oss.str();
-}
-
 // tolower copy
 static std::string lowerCopy(const std::string &s) {
   std::string r = s;
@@ -67,12 +50,16 @@ static std::string lowerCopy(const std::string &s) {
 }
 
 // 簡易 reason phrase
-static std::string reasonPhrase(int code) {
+std::string reasonPhrase(int code) {
   switch (code) {
   case 200:
     return "OK";
   case 204:
     return "No Content";
+  case 206:
+    return "Partial Content";
+  case 304:
+    return "Not Modified";
   case 400:
     return "Bad Request";
   case 403:
@@ -85,44 +72,25 @@ static std::string reasonPhrase(int code) {
     return "Payload Too Large";
   case 415:
     return "Unsupported Media Type";
+  case 416:
+    return "Range Not Satisfiable";
   case 500:
     return "Internal Server Error";
   case 501:
     return "Not Implemented";
+  case 502:
+    return "Bad Gateway";
+  case 504:
+    return "Gateway Timeout";
   }
   return "Unknown";
 }
 
-// cfg.root と loc->root
-// をマージして「最終的に使うルートディレクトリ」を決める。 ルール:
-//  - loc が無い→ cfg.root を返す
-//  - loc->root が空→ cfg.root を返す
-//  - loc->root が '/' で始まる → プロセスカレント直下扱い (ex: "/upload/" →
-//  "./upload/")
-//  - それ以外 → cfg.root と連結 (ex: cfg.root="./docs/", loc->root="img/" →
-//  "./docs/img/")
+// 実際に使うルートディレクトリ（cfg.root との結合は LocationRuntime の構築時に済ませてある）
 std::string
 ResponseBuilder::mergeRoots(const ServerConfig &cfg,
-                            const ServerConfig::Location *loc) const {
-  if (!loc || loc->root.empty()) {
-    return cfg.root;
-  }
-
-  const std::string &lr = loc->root;
-
-  // --- case1: 絶対パス ---
-  if (!lr.empty() && lr[0] == '/') {
-    return lr;
-  }
-
-  // --- case2: ./ で始まる相対パス（カレントディレクトリ基準） ---
-  if (lr.size() >= 2 && lr[0] == '.' && lr[1] == '/') {
-    return lr; // サーバルートとは結合しない
-  }
-
-  // --- case3: 通常の相対パス（サーバルートに結合）---
-  std::string merged = joinPath(cfg.root, lr);
-  return merged;
+                            const LocationRuntime *loc) const {
+  return loc ? loc->root : cfg.root;
 }
 
 // URIからlocationのマウントパスを剥がして、ローカルでの相対パスにする.
@@ -150,8 +118,9 @@ ResponseBuilder::stripLocationPrefix(const std::string &uri,
 // ====== ResponseBuilder メンバ ======
 
 // Dateヘッダ向け日付
-std::string ResponseBuilder::httpDate_() const {
-    return "Sun, 09 Nov 2025 10:00:00 GMT";
+// ワーカーの DateCache（無ければ構築時に取った時刻）
+const std::string &ResponseBuilder::httpDate_() const {
+  return date_->str();
 }
 
 bool ResponseBuilder::isTraversal(const std::string &uri) const {
@@ -192,9 +161,9 @@ std::string ResponseBuilder::resolvePathForGet(
     else
         path = docRoot + relativeUri;
 
-    // ディレクトリ判定
-    struct stat st;
-    if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+    // ディレクトリ判定（open_file_cache に載っていれば syscall なし）
+    const FileInfo *fi = files_->lookup(path);
+    if (fi && fi->isDir) {
         isDirOut = true;
         if (!path.empty() && path[path.size() - 1] != '/')
             path += "/";
@@ -244,25 +213,493 @@ std::string ResponseBuilder::guessContentType(const std::string &path) const {
   return "application/octet-stream";
 }
 
-// 200 OK (GET/HEAD用). headOnlyならボディ付けない
-std::string ResponseBuilder::buildOkResponseFromFile(const std::string &absPath,
-                                                     bool headOnly,
-                                                     bool close) {
-  std::string body = slurpFile(absPath);
-  std::string ct = guessContentType(absPath);
+// ETag / Last-Modified は FileInfo に1回だけ作って持つ（ファイルが変われば作り直される）。
+// 強い ETag は "mtime-size-inode"（16進）
+static void ensureValidators(FileInfo &file) {
+  if (!file.lastModified.empty())
+    return;
+  file.lastModified = formatHttpDate(file.mtime);
+  std::ostringstream oss;
+  oss << '"' << std::hex << static_cast<unsigned long long>(file.mtime) << '-'
+      << static_cast<unsigned long long>(file.size) << '-'
+      << static_cast<unsigned long long>(file.ino) << '"';
+  file.etag = oss.str();
+}
+
+// 圧縮した表現の ETag は元の ETag に符号化名を足したもの（"...-gzip"）
+static std::string encodedEtag(const std::string &etag, const char *encoding) {
+  if (!encoding || etag.size() < 2)
+    return etag;
+  return etag.substr(0, etag.size() - 1) + "-" + encoding + "\"";
+}
 
-  std::ostringstream res;
-  res << "HTTP/1.1 200 OK\r\n"
-      << "Content-Type: " << ct << "\r\n"
-      << "Content-Length: " << body.size() << "\r\n"
-      << "Connection: " << (close ? "close" : "keep-alive") << "\r\n"
-      << "Date: " << httpDate_() << "\r\n"
-      << "Server: webserv/0.1\r\n\r\n";
+// Last-Modified / ETag / Cache-Control（location の設定どおり）と Vary。
+// encoding は圧縮した表現のとき（NULL = そのまま）
+static void writeValidators(HeaderWriter &w, FileInfo &file, const LocationRuntime *loc,
+                            const char *encoding, bool vary) {
+  ensureValidators(file);
+  w.header("Last-Modified", file.lastModified);
+  EtagMode mode = loc ? loc->etag : ETAG_STRONG;
+  if (mode == ETAG_STRONG) {
+    w.header("ETag", encodedEtag(file.etag, encoding));
+  } else if (mode == ETAG_WEAK) {
+    w.raw("ETag: W/");
+    w.raw(encodedEtag(file.etag, encoding).c_str());
+    w.raw("\r\n");
+  }
+  if (loc && !loc->cacheControl.empty())
+    w.raw(loc->cacheControl.c_str());
+  if (vary)
+    w.raw("Vary: Accept-Encoding\r\n");
+}
 
-  if (!headOnly) {
-    res << body;
+// 200 OK (GET/HEAD用). 本文は読み込まず、キャッシュの fd を dup して
+// sendfile に任せる。HEAD は fd を持たない。
+HttpResponse ResponseBuilder::buildOkResponseFromFile(FileInfo &file,
+                                                      const LocationRuntime *loc,
+                                                      bool headOnly,
+                                                      bool close) {
+  HttpResponse out;
+  if (!headOnly && file.size > 0) {
+    out.fileFd = fcntl(file.fd, F_DUPFD_CLOEXEC, 0); // dup と CLOEXEC を1回で（CGI の子に残さない）
+    if (out.fileFd < 0)
+      return buildSimpleResponse(500, reasonPhrase(500), close);
+    out.fileOffset = 0;
+    out.fileLength = file.size;
   }
-  return res.str();
+  if (file.mime.empty())
+    file.mime = guessContentType(file.path);
+
+  HeaderWriter w(out.data);
+  w.raw("HTTP/1.1 200 OK\r\n");
+  w.header("Content-Type", file.mime);
+  w.contentLength(static_cast<unsigned long long>(file.size));
+  w.raw("Accept-Ranges: bytes\r\n");
+  writeValidators(w, file, loc, NULL, varyEncoding_);
+  w.connection(close);
+  w.date(httpDate_());
+  w.end();
+  return out;
+}
+
+// 304。本文も Content-Length も付けず、検証子とキャッシュの指示だけ返す
+std::string ResponseBuilder::buildNotModified(FileInfo &file, const LocationRuntime *loc,
+                                              const char *encoding, bool close) const {
+  std::string res;
+  HeaderWriter w(res);
+  w.raw("HTTP/1.1 304 Not Modified\r\n");
+  writeValidators(w, file, loc, encoding, varyEncoding_);
+  w.connection(close);
+  w.date(httpDate_());
+  w.end();
+  return res;
+}
+
+// If-None-Match の一覧に etag があるか（弱い比較: W/ の有無は見ない）。"*" は常に一致
+static bool etagListMatches(const std::string &list, const std::string &etag) {
+  size_t pos = 0;
+  while (pos <= list.size()) {
+    size_t comma = list.find(',', pos);
+    if (comma == std::string::npos)
+      comma = list.size();
+    std::string tag = list.substr(pos, comma - pos);
+    pos = comma + 1;
+    size_t b = tag.find_first_not_of(" \t");
+    if (b == std::string::npos)
+      continue;
+    size_t e = tag.find_last_not_of(" \t");
+    tag = tag.substr(b, e - b + 1);
+    if (tag == "*")
+      return true;
+    if (tag.compare(0, 2, "W/") == 0)
+      tag.erase(0, 2);
+    if (!etag.empty() && tag == etag)
+      return true;
+  }
+  return false;
+}
+
+// RFC 7232 の順: If-None-Match があればそれだけで決め、無ければ If-Modified-Since
+static bool notModified(const Request &req, FileInfo &file, const LocationRuntime *loc,
+                        const char *encoding) {
+  ensureValidators(file);
+  std::map<std::string, std::string>::const_iterator it = req.headers.find("if-none-match");
+  if (it != req.headers.end()) {
+    bool useEtag = !loc || loc->etag != ETAG_OFF;
+    return etagListMatches(it->second, useEtag ? encodedEtag(file.etag, encoding) : std::string());
+  }
+  it = req.headers.find("if-modified-since");
+  if (it == req.headers.end())
+    return false;
+  if (it->second == file.lastModified)
+    return true;
+  time_t since;
+  return parseHttpDate(it->second, since) && file.mtime <= since;
+}
+
+// ====== Range（RFC 7233） ======
+enum RangeResult { RANGE_IGNORE, RANGE_OK, RANGE_UNSATISFIABLE };
+
+// 1リクエストで受け付ける範囲の数（これを超える Range は無視して 200 で返す）
+static const size_t kMaxRanges = 16;
+
+static std::string trimCopy(const std::string &s) {
+  size_t b = s.find_first_not_of(" \t");
+  if (b == std::string::npos)
+    return "";
+  size_t e = s.find_last_not_of(" \t");
+  return s.substr(b, e - b + 1);
+}
+
+static bool parseOffset(const std::string &s, off_t &out) {
+  if (s.empty() || s.size() > 18)
+    return false;
+  off_t v = 0;
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] < '0' || s[i] > '9')
+      return false;
+    v = v * 10 + (s[i] - '0');
+  }
+  out = v;
+  return true;
+}
+
+static bool byFirst(const ByteRange &a, const ByteRange &b) {
+  return a.first < b.first;
+}
+
+// "bytes=0-99, -500, 1000-" を size に合わせて絶対位置にする。
+// 書式が壊れていれば RANGE_IGNORE（Range が無いものとして 200）。
+// 重なる / 隣り合う範囲は1つにまとめる（同じ部分を何度も送らない）
+static RangeResult parseRange(const std::string &value, off_t size,
+                              std::vector<ByteRange> &out) {
+  if (value.size() < 6 || lowerCopy(value.substr(0, 6)) != "bytes=")
+    return RANGE_IGNORE;
+
+  size_t specs = 0;
+  size_t pos = 6;
+  while (pos <= value.size()) {
+    size_t comma = value.find(',', pos);
+    if (comma == std::string::npos)
+      comma = value.size();
+    std::string spec = trimCopy(value.substr(pos, comma - pos));
+    pos = comma + 1;
+    if (spec.empty())
+      continue;
+    if (++specs > kMaxRanges)
+      return RANGE_IGNORE;
+
+    size_t dash = spec.find('-');
+    if (dash == std::string::npos)
+      return RANGE_IGNORE;
+    std::string a = trimCopy(spec.substr(0, dash));
+    std::string b = trimCopy(spec.substr(dash + 1));
+    ByteRange r;
+    if (a.empty()) {
+      // 末尾から n バイト
+      off_t n;
+      if (!parseOffset(b, n))
+        return RANGE_IGNORE;
+      if (n == 0)
+        continue;
+      r.first = n >= size ? 0 : size - n;
+      r.last = size - 1;
+    } else {
+      off_t last = size - 1;
+      if (!parseOffset(a, r.first))
+        return RANGE_IGNORE;
+      if (!b.empty() && (!parseOffset(b, last) || last < r.first))
+        return RANGE_IGNORE;
+      if (r.first >= size)
+        continue; // この範囲は満たせない
+      r.last = last < size - 1 ? last : size - 1;
+    }
+    out.push_back(r);
+  }
+  if (specs == 0)
+    return RANGE_IGNORE;
+  if (out.empty())
+    return RANGE_UNSATISFIABLE;
+
+  if (out.size() > 1) {
+    std::sort(out.begin(), out.end(), byFirst);
+    size_t n = 0;
+    for (size_t i = 1; i < out.size(); ++i) {
+      if (out[i].first <= out[n].last + 1) {
+        if (out[i].last > out[n].last)
+          out[n].last = out[i].last;
+      } else {
+        out[++n] = out[i];
+      }
+    }
+    out.resize(n + 1);
+  }
+  return RANGE_OK;
+}
+
+// If-Range が今のファイルと一致するときだけ Range を使う。
+// 比較は強い比較: 強い ETag か、Last-Modified と完全に同じ日付だけ。弱い ETag は一致しない
+static bool ifRangeMatches(const Request &req, FileInfo &file, const LocationRuntime *loc) {
+  std::map<std::string, std::string>::const_iterator it = req.headers.find("if-range");
+  if (it == req.headers.end())
+    return true;
+  ensureValidators(file);
+  std::string v = trimCopy(it->second);
+  if (v.empty() || v.compare(0, 2, "W/") == 0)
+    return false;
+  if (v[0] == '"')
+    return (!loc || loc->etag == ETAG_STRONG) && v == file.etag;
+  return v == file.lastModified;
+}
+
+// ====== 圧縮（Accept-Encoding） ======
+enum { ENC_GZIP = 1, ENC_BR = 2 };
+
+// "q=0" / "q=0.0" なら受け付けない
+static bool qIsZero(const std::string &params) {
+  size_t q = lowerCopy(params).find("q=");
+  if (q == std::string::npos)
+    return false;
+  std::string v = trimCopy(params.substr(q + 2));
+  if (v.empty() || v[0] != '0')
+    return false;
+  for (size_t i = 1; i < v.size(); ++i) {
+    if (v[i] != '.' && v[i] != '0')
+      return false;
+  }
+  return true;
+}
+
+// Accept-Encoding で受け付けると言っている符号化（ENC_* のビット）
+static unsigned acceptedEncodings(const Request &req) {
+  std::map<std::string, std::string>::const_iterator it = req.headers.find("accept-encoding");
+  if (it == req.headers.end())
+    return 0;
+  const std::string &v = it->second;
+  unsigned bits = 0;
+  size_t pos = 0;
+  while (pos <= v.size()) {
+    size_t comma = v.find(',', pos);
+    if (comma == std::string::npos)
+      comma = v.size();
+    std::string item = v.substr(pos, comma - pos);
+    pos = comma + 1;
+    size_t semi = item.find(';');
+    std::string name = lowerCopy(trimCopy(item.substr(0, semi)));
+    if (semi != std::string::npos && qIsZero(item.substr(semi + 1)))
+      continue;
+    if (name == "gzip" || name == "x-gzip")
+      bits |= ENC_GZIP;
+    else if (name == "br")
+      bits |= ENC_BR;
+    else if (name == "*")
+      bits |= ENC_GZIP | ENC_BR;
+  }
+  return bits;
+}
+
+static bool isCompressible(const std::string &mime) {
+  return mime.compare(0, 5, "text/") == 0 ||
+         mime.compare(0, 22, "application/javascript") == 0 ||
+         mime.compare(0, 16, "application/json") == 0 ||
+         mime.compare(0, 15, "application/xml") == 0 ||
+         mime.compare(0, 13, "image/svg+xml") == 0;
+}
+
+// 事前に圧縮されたファイル（path.br / path.gz）を開く。元より古ければ使わない
+static int openSidecar(const std::string &path, time_t origMtime, off_t &size) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_mtime < origMtime) {
+    close(fd);
+    return -1;
+  }
+  size = st.st_size;
+  return fd;
+}
+
+// .br → .gz → その場で gzip（キャッシュ）の順に探す
+bool ResponseBuilder::serveEncoded(const Request &req, FileInfo &file,
+                                   const LocationRuntime *loc, HttpResponse &out) {
+  unsigned enc = acceptedEncodings(req);
+  if (enc == 0)
+    return false;
+  bool headOnly = (req.method == "HEAD");
+  static const struct {
+    unsigned bit;
+    const char *ext;
+    const char *name;
+  } kSidecars[] = {{ENC_BR, ".br", "br"}, {ENC_GZIP, ".gz", "gzip"}};
+
+  for (size_t i = 0; i < sizeof(kSidecars) / sizeof(kSidecars[0]); ++i) {
+    if (!(enc & kSidecars[i].bit))
+      continue;
+    off_t size = 0;
+    int fd = openSidecar(file.path + kSidecars[i].ext, file.mtime, size);
+    if (fd < 0)
+      continue;
+    if (notModified(req, file, loc, kSidecars[i].name)) {
+      close(fd);
+      out = buildNotModified(file, loc, kSidecars[i].name, !keepAlive_);
+      return true;
+    }
+    if (headOnly || size == 0) {
+      close(fd);
+      fd = -1;
+    }
+    out = buildEncodedResponse(file, loc, kSidecars[i].name, fd, size, NULL, headOnly,
+                               !keepAlive_);
+    return true;
+  }
+
+  if (!(enc & ENC_GZIP) || !gzip_ ||
+      static_cast<unsigned long long>(file.size) < loc->gzipMinLength)
+    return false;
+  // ETag で済むなら圧縮もしない
+  if (notModified(req, file, loc, "gzip")) {
+    out = buildNotModified(file, loc, "gzip", !keepAlive_);
+    return true;
+  }
+  const std::string *gz = gzip_->lookup(file);
+  if (!gz)
+    return false; // 大きすぎる / 縮まない
+  out = buildEncodedResponse(file, loc, "gzip", -1, static_cast<off_t>(gz->size()), gz,
+                             headOnly, !keepAlive_);
+  return true;
+}
+
+// 圧縮した表現の 200。本文は sidecar の fd か、メモリ上の body
+HttpResponse ResponseBuilder::buildEncodedResponse(FileInfo &file, const LocationRuntime *loc,
+                                                   const char *encoding, int fd, off_t length,
+                                                   const std::string *body, bool headOnly,
+                                                   bool close) {
+  HttpResponse out;
+  HeaderWriter w(out.data, 320 + (body && !headOnly ? body->size() : 0));
+  w.raw("HTTP/1.1 200 OK\r\n");
+  w.header("Content-Type", file.mime);
+  w.raw("Content-Encoding: ");
+  w.raw(encoding);
+  w.raw("\r\n");
+  w.contentLength(static_cast<unsigned long long>(length));
+  writeValidators(w, file, loc, encoding, true);
+  w.connection(close);
+  w.date(httpDate_());
+  w.end();
+  if (fd >= 0) {
+    out.fileFd = fd;
+    out.fileOffset = 0;
+    out.fileLength = length;
+  } else if (body && !headOnly) {
+    out.data += *body;
+  }
+  return out;
+}
+
+static void appendContentRange(std::string &out, off_t first, off_t last, off_t size) {
+  out += "bytes ";
+  appendDecimal(out, static_cast<unsigned long long>(first));
+  out += '-';
+  appendDecimal(out, static_cast<unsigned long long>(last));
+  out += '/';
+  appendDecimal(out, static_cast<unsigned long long>(size));
+}
+
+HttpResponse ResponseBuilder::serveFile(const Request &req, FileInfo &file,
+                                        const LocationRuntime *loc) {
+  bool headOnly = (req.method == "HEAD");
+  std::map<std::string, std::string>::const_iterator it = req.headers.find("range");
+
+  // 圧縮できる種類なら、そのまま返すときも Vary を付ける（キャッシュに表現を混ぜさせない）
+  if (!file.isDir && loc && loc->gzip && file.size > 0) {
+    if (file.mime.empty())
+      file.mime = guessContentType(file.path);
+    varyEncoding_ = isCompressible(file.mime);
+  }
+  // Range は元の表現に対して答えるので、Range 付きは圧縮しない
+  HttpResponse encoded;
+  if (varyEncoding_ && it == req.headers.end() && serveEncoded(req, file, loc, encoded))
+    return encoded;
+
+  // 再検証はキャッシュ済みの stat 結果だけで答える（fd は dup しない）
+  if (!file.isDir && notModified(req, file, loc, NULL))
+    return buildNotModified(file, loc, NULL, !keepAlive_);
+
+  // Range は GET だけ。空のファイルとディレクトリは全体を返す
+  if (headOnly || it == req.headers.end() || file.isDir || file.size == 0 ||
+      !ifRangeMatches(req, file, loc))
+    return buildOkResponseFromFile(file, loc, headOnly, !keepAlive_);
+
+  std::vector<ByteRange> ranges;
+  switch (parseRange(it->second, file.size, ranges)) {
+  case RANGE_IGNORE:
+    return buildOkResponseFromFile(file, loc, false, !keepAlive_);
+  case RANGE_UNSATISFIABLE: {
+    std::string cr = "bytes */";
+    appendDecimal(cr, static_cast<unsigned long long>(file.size));
+    std::map<std::string, std::string> extra;
+    extra["Content-Range"] = cr;
+    return buildSimpleResponse(416, reasonPhrase(416), !keepAlive_, extra);
+  }
+  case RANGE_OK:
+    break;
+  }
+  return buildRangeResponse(file, loc, ranges, !keepAlive_);
+}
+
+// 206。範囲はファイルのオフセットのまま sendfile で送る（読み込まない）。
+// 複数なら multipart/byteranges で、part ごとの区切りとヘッダだけをメモリに持つ
+HttpResponse ResponseBuilder::buildRangeResponse(FileInfo &file, const LocationRuntime *loc,
+                                                 const std::vector<ByteRange> &ranges,
+                                                 bool close) {
+  HttpResponse out;
+  out.fileFd = fcntl(file.fd, F_DUPFD_CLOEXEC, 0);
+  if (out.fileFd < 0)
+    return buildSimpleResponse(500, reasonPhrase(500), close);
+  if (file.mime.empty())
+    file.mime = guessContentType(file.path);
+
+  HeaderWriter w(out.data);
+  w.status(206, reasonPhrase(206));
+  if (ranges.size() == 1) {
+    out.fileOffset = ranges[0].first;
+    out.fileLength = ranges[0].last - ranges[0].first + 1;
+    w.header("Content-Type", file.mime);
+    w.raw("Content-Range: ");
+    appendContentRange(out.data, ranges[0].first, ranges[0].last, file.size);
+    w.raw("\r\n");
+    w.contentLength(static_cast<unsigned long long>(out.fileLength));
+  } else {
+    static unsigned long counter = 0;
+    std::string boundary = "webserv-";
+    appendDecimal(boundary, static_cast<unsigned long long>(file.mtime));
+    boundary += '-';
+    appendDecimal(boundary, __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+
+    unsigned long long total = 0;
+    out.parts.resize(ranges.size());
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      HttpResponse::Part &p = out.parts[i];
+      p.head = "\r\n--" + boundary + "\r\nContent-Type: " + file.mime +
+               "\r\nContent-Range: ";
+      appendContentRange(p.head, ranges[i].first, ranges[i].last, file.size);
+      p.head += "\r\n\r\n";
+      p.offset = ranges[i].first;
+      p.length = ranges[i].last - ranges[i].first + 1;
+      total += p.head.size() + static_cast<unsigned long long>(p.length);
+    }
+    out.trailer = "\r\n--" + boundary + "--\r\n";
+    total += out.trailer.size();
+    w.header("Content-Type", "multipart/byteranges; boundary=" + boundary);
+    w.contentLength(total);
+  }
+  w.raw("Accept-Ranges: bytes\r\n");
+  writeValidators(w, file, loc, NULL, varyEncoding_);
+  w.connection(close);
+  w.date(httpDate_());
+  w.end();
+  return out;
 }
 
 // 405
@@ -273,34 +710,36 @@ std::string ResponseBuilder::buildMethodNotAllowed(const std::string &allow,
   std::string body = "<!doctype html><title>Method Not Allowed</title>"
                      "<h1>Method Not Allowed</h1>";
 
-  std::ostringstream res;
-  res << "HTTP/1.1 405 " << reasonPhrase(405) << "\r\n"
-      << "Content-Type: text/html\r\n"
-      << "Allow: " << allow << "\r\n"
-      << "Content-Length: " << body.size() << "\r\n"
-      << "Connection: close\r\n"
-      << "Date: " << httpDate_() << "\r\n"
-      << "Server: webserv/0.1\r\n\r\n"
-      << body;
-  return res.str();
+  std::string res;
+  HeaderWriter w(res, 256 + body.size());
+  w.status(405, reasonPhrase(405));
+  w.raw("Content-Type: text/html\r\n");
+  w.header("Allow", allow);
+  w.contentLength(body.size());
+  w.connection(!keepAlive_);
+  w.date(httpDate_());
+  w.end();
+  res += body;
+  return res;
 }
 
 // 汎用「本文なし」レスポンス（例：204, 403, 404の最小版に使える）
 std::string ResponseBuilder::buildSimpleResponse(
     int statusCode, const std::string &reason, bool close,
     const std::map<std::string, std::string> &extraHeaders) const {
-  std::ostringstream res;
-  res << "HTTP/1.1 " << statusCode << " " << reason << "\r\n";
+  std::string res;
+  HeaderWriter w(res);
+  w.status(statusCode, reason);
   for (std::map<std::string, std::string>::const_iterator it =
            extraHeaders.begin();
        it != extraHeaders.end(); ++it) {
-    res << it->first << ": " << it->second << "\r\n";
+    w.header(it->first.c_str(), it->second);
   }
-  res << "Content-Length: 0\r\n"
-      << "Connection: " << (close ? "close" : "keep-alive") << "\r\n"
-      << "Date: " << httpDate_() << "\r\n"
-      << "Server: webserv/0.1\r\n\r\n";
-  return res.str();
+  w.raw("Content-Length: 0\r\n");
+  w.connection(close);
+  w.date(httpDate_());
+  w.end();
+  return res;
 }
 
 std::string ResponseBuilder::buildErrorResponseFromFile(const std::string &path,
@@ -316,15 +755,17 @@ std::string ResponseBuilder::buildErrorResponseFromFile(const std::string &path,
          << "</h1><p>Could not open custom error page.</p></body></html>";
   }
 
-  std::ostringstream res;
-  res << "HTTP/1.1 " << code << " " << reasonPhrase(code) << "\r\n"
-      << "Content-Type: text/html\r\n"
-      << "Content-Length: " << body.str().size() << "\r\n"
-      << "Connection: " << (close ? "close" : "keep-alive") << "\r\n"
-      << "Date: " << httpDate_() << "\r\n"
-      << "Server: webserv/0.1\r\n\r\n"
-      << body.str();
-  return res.str();
+  std::string content = body.str();
+  std::string res;
+  HeaderWriter w(res, 256 + content.size());
+  w.status(code, reasonPhrase(code));
+  w.raw("Content-Type: text/html\r\n");
+  w.contentLength(content.size());
+  w.connection(close);
+  w.date(httpDate_());
+  w.end();
+  res += content;
+  return res;
 }
 
 std::string ResponseBuilder::buildSimpleResponse(int statusCode,
@@ -336,140 +777,109 @@ std::string ResponseBuilder::buildSimpleResponse(int statusCode,
 
 std::string
 ResponseBuilder::buildErrorResponse(const ServerConfig &cfg,
-                                    const ServerConfig::Location *loc,
+                                    const LocationRuntime *loc,
                                     int statusCode, bool close) const {
-  std::string filePath;
-
-  // 1. Location にカスタムページがある場合
-  // ここはエラーじゃなくて、returnで捨て去れたファイルを返す処理しているけど、いいのか？
-  if (loc && loc->ret.count(statusCode)) {
-    filePath = loc->ret.at(statusCode);
-  }
-  // 2. サーバ全体にカスタムページがある場合
-  else if (cfg.errorPages.count(statusCode)) {
-    filePath = cfg.errorPages.at(statusCode);
-  }
-  // ファイルpathの指定があれば返す
-  if (!filePath.empty()) {
-    std::ifstream ifs(filePath.c_str(), std::ios::binary);
-    if (ifs.is_open()) {
-      std::ostringstream oss;
-      oss << ifs.rdbuf();
-      std::string body = oss.str();
-      std::ostringstream res;
-      res << "HTTP/1.1 " << statusCode << " " << reasonPhrase(statusCode)
-          << "\r\n"
-          << "Content-Type: text/html\r\n"
-          << "Content-Length: " << body.size() << "\r\n"
-          << "Connection: " << (close ? "close" : "keep-alive") << "\r\n"
-          << "Date: " << httpDate_() << "\r\n"
-          << "Server: webserv/0.1\r\n\r\n"
-          << body;
-      return res.str();
-    }
-  }
-  // close); シンプル版ではなく、標準のエラーページを返すようにする。
-  filePath = DEFAULT_ERROR_PAGE;
-  std::ifstream ifs(filePath.c_str(), std::ios::binary);
-  if (ifs.is_open()) {
-    std::ostringstream oss;
-    oss << ifs.rdbuf();
-    std::string body = oss.str();
-    std::ostringstream res;
-    res << "HTTP/1.1 " << statusCode << " " << reasonPhrase(statusCode)
-        << "\r\n"
-        << "Content-Type: text/html\r\n"
-        << "Content-Length: " << body.size() << "\r\n"
-        << "Connection: " << (close ? "close" : "keep-alive") << "\r\n"
-        << "Date: " << httpDate_() << "\r\n"
-        << "Server: webserv/0.1\r\n\r\n"
-        << body;
-    return res.str();
-  } else {
-    // デフォルトファイルも見つからなければ、Bodyなしで返す。
+  (void)cfg; // error_page は ErrorPages に読み込み済み
+  // ページは ErrorPages が起動時（と SIGHUP 時）に読み込んで組み立て済み
+  if (!errors_)
     return buildSimpleResponse(statusCode, reasonPhrase(statusCode), close);
-  }
+  std::string res;
+  errors_->append(res, loc, statusCode, close, httpDate_());
+  return res;
 }
 
-std::string buildAutoIndexHtml(const std::string &dirPath,
-                               const std::string &uri) {
-  std::stringstream html;
-  html << "<html><head><title>Index of " << uri << "</title></head>";
-  html << "<body><h1>Index of " << uri << "</h1><ul>";
-
-  DIR *dir = opendir(dirPath.c_str());
-  if (!dir) {
-    // ディレクトリが開けなければ 403 として扱う（呼び出し側で処理可）
-    return "";
+// クエリ文字列から name の値を取り出す（見つからなければ false）
+static bool queryParam(const std::string &query, const char *name, std::string &out) {
+  size_t len = std::strlen(name);
+  size_t pos = 0;
+  while (pos <= query.size()) {
+    size_t amp = query.find('&', pos);
+    if (amp == std::string::npos)
+      amp = query.size();
+    if (amp - pos > len && query.compare(pos, len, name) == 0 && query[pos + len] == '=') {
+      out = query.substr(pos + len + 1, amp - pos - len - 1);
+      return true;
+    }
+    pos = amp + 1;
   }
+  return false;
+}
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != NULL) {
-    std::string name = entry->d_name;
-
-    // 「.」と「..」は表示しない
-    if (name == "." || name == "..")
-      continue;
-
-    // パス組み立て
-    std::string fullPath = dirPath + "/" + name;
-
-    struct stat st;
-    if (stat(fullPath.c_str(), &st) != 0)
-      continue;
-
-    // ディレクトリは末尾に /
-    if (S_ISDIR(st.st_mode))
-      name += "/";
-
-    html << "<li><a href=\"" << uri;
-    if (!uri.empty() && uri[uri.size() - 1] != '/')
-      html << "/";
-    html << name << "\">" << name << "</a></li>";
+// 10 進数の正の整数（不正 / 0 なら def, 上限 max）
+static size_t queryNumber(const std::string &query, const char *name, size_t def, size_t max) {
+  std::string v;
+  if (!queryParam(query, name, v) || v.empty() || v.size() > 9)
+    return def;
+  size_t n = 0;
+  for (size_t i = 0; i < v.size(); ++i) {
+    if (v[i] < '0' || v[i] > '9')
+      return def;
+    n = n * 10 + static_cast<size_t>(v[i] - '0');
   }
-
-  closedir(dir);
-
-  html << "</ul><hr><address>Webserv/1.0</address></body></html>";
-  return html.str();
+  if (n == 0)
+    return def;
+  return n > max ? max : n;
 }
 
-std::string buildOkResponseFromString(const std::string &body,
-                                      const std::string &contentType) {
-  std::stringstream response;
-
-  // ステータスライン
-  response << "HTTP/1.1 200 OK\r\n";
-
-  // ヘッダ
-  response << "Content-Type: " << contentType << "\r\n";
-  response << "Content-Length: " << body.size() << "\r\n";
-  response << "Connection: close\r\n";
-  response << "\r\n";                  // ヘッダ終端
-
-  // ボディ
-  response << body;
-
-  return response.str();
+HttpResponse ResponseBuilder::buildAutoIndexResponse(const DirListing &dir,
+                                                     const LocationRuntime *loc,
+                                                     const std::string &uriPath,
+                                                     const std::string &query,
+                                                     bool headOnly) const {
+  size_t page = queryNumber(query, "page", 1, static_cast<size_t>(-1));
+  size_t limit = queryNumber(query, "limit", AUTOINDEX_DEFAULT_LIMIT, AUTOINDEX_MAX_LIMIT);
+  bool json = loc && loc->autoindexJson;
+  std::string format;
+  if (queryParam(query, "format", format))
+    json = (format == "json") ? true : (format == "html") ? false : json;
+
+  std::string body;
+  if (json)
+    renderDirListingJson(body, dir, uriPath, page, limit);
+  else
+    renderDirListingHtml(body, dir, uriPath, page, limit);
+
+  HttpResponse out;
+  HeaderWriter w(out.data, 256 + (headOnly ? 0 : body.size()));
+  w.raw("HTTP/1.1 200 OK\r\n");
+  w.raw(json ? "Content-Type: application/json\r\n" : "Content-Type: text/html; charset=utf-8\r\n");
+  w.contentLength(body.size());
+  w.connection(!keepAlive_);
+  w.date(httpDate_());
+  w.end();
+  if (!headOnly)
+    out.data += body;
+  return out;
 }
 
 // --- GET/HEAD 処理 (3引数版) ---
-std::string
+HttpResponse
 ResponseBuilder::handleGetLikeCore(const Request &req, const ServerConfig &cfg,
-                                   const ServerConfig::Location *loc,
+                                   const LocationRuntime *loc,
                                    const std::string &locPath) {
   if (isTraversal(req.uri)) {
-    return buildSimpleResponse(403, reasonPhrase(403), true);
+    return buildSimpleResponse(403, reasonPhrase(403), !keepAlive_);
+  }
+  // クエリはパスの解決に使わない（autoindex の page / limit / format だけ見る）
+  std::string uriPath = req.uri;
+  std::string query;
+  size_t qpos = uriPath.find('?');
+  if (qpos != std::string::npos) {
+    query = uriPath.substr(qpos + 1);
+    uriPath.erase(qpos);
   }
   std::string effectiveRoot = mergeRoots(cfg, loc);
   bool isDirFlag = false;
-  std::string absPath = resolvePathForGet(effectiveRoot, req.uri, locPath, isDirFlag);
+  std::string absPath = resolvePathForGet(effectiveRoot, uriPath, locPath, isDirFlag);
 
   // --- ディレクトリ処理 ---
   if (isDirFlag) {
-    if (loc->autoindex == "on") {
-      std::string body = buildAutoIndexHtml(absPath, req.uri);
-      return buildOkResponseFromString(body, "text/html");
+    if (loc->autoindex) {
+      // 一覧はディレクトリの mtime が変わるまで使い回す
+      const DirListing *dir = dirs_->lookup(absPath);
+      if (!dir)
+        return buildErrorResponse(cfg, loc, 403, !keepAlive_);
+      return buildAutoIndexResponse(*dir, loc, uriPath, query, req.method == "HEAD");
     } else {
       // index.htmlが存在すれば返す（将来的な拡張）
       std::string indexPath = absPath;
@@ -478,32 +888,40 @@ ResponseBuilder::handleGetLikeCore(const Request &req, const ServerConfig &cfg,
       //   indexPath += "index.html";
       // index.htmlを直書きじゃなくて、locaiton /のindexから参照するようにする。
       indexPath += loc->index;
-      std::ifstream indexFile(indexPath.c_str(), std::ios::binary);
-      if (indexFile.is_open()) {
-        bool headOnly = (req.method == "HEAD");
-        return buildOkResponseFromFile(indexPath, headOnly, true);
+      FileInfo *index = files_->lookup(indexPath);
+      if (index && !index->isDir) {
+        return serveFile(req, *index, loc);
       }
-      return buildErrorResponse(cfg, loc, 403);
+      return buildErrorResponse(cfg, loc, 403, !keepAlive_);
     }
   }
 
-  // --- 通常のファイル処理 ---
-  std::ifstream ifs(absPath.c_str(), std::ios::binary);
-  if (!ifs.is_open()) {
-    return buildErrorResponse(cfg, loc, 404);
+  // --- 通常のファイル処理（本文はここでは読まない） ---
+  FileInfo *file = files_->lookup(absPath);
+  if (!file) {
+    // 無いものだけ 404。読めない（EACCES）なら 403、それ以外（EMFILE など）は 500
+    switch (errno) {
+      case ENOENT:
+      case ENOTDIR:
+      case ENAMETOOLONG:
+        return buildErrorResponse(cfg, loc, 404, !keepAlive_);
+      case EACCES:
+      case EPERM:
+        return buildErrorResponse(cfg, loc, 403, !keepAlive_);
+      default:
+        return buildErrorResponse(cfg, loc, 500, !keepAlive_);
+    }
   }
 
-
-  bool headOnly = (req.method == "HEAD");
-  return buildOkResponseFromFile(absPath, headOnly, true);
+  return serveFile(req, *file, loc);
 }
 
 // --- DELETE 処理 (3引数版) ---
 std::string
 ResponseBuilder::handleDeleteCore(const Request &req, const ServerConfig &cfg,
-                                  const ServerConfig::Location *loc) {
+                                  const LocationRuntime *loc) {
   if (isTraversal(req.uri)) {
-    return buildErrorResponse(cfg, loc, 403, true);
+    return buildErrorResponse(cfg, loc, 403, !keepAlive_);
   }
 
   std::string effectiveRoot = mergeRoots(cfg, loc);
@@ -512,34 +930,35 @@ ResponseBuilder::handleDeleteCore(const Request &req, const ServerConfig &cfg,
   struct stat st;
   if (stat(absPath.c_str(), &st) != 0) {
     // 物理ファイルが無い
-    return buildErrorResponse(cfg, loc, 404, true);
+    return buildErrorResponse(cfg, loc, 404, !keepAlive_);
   }
 
   // ディレクトリは削除対象外（誤ってrmdir相当の挙動をしないため）
   if (S_ISDIR(st.st_mode)) {
-    return buildErrorResponse(cfg, loc, 403, true);
+    return buildErrorResponse(cfg, loc, 403, !keepAlive_);
   }
 
+  files_->invalidate(absPath);
   if (std::remove(absPath.c_str()) == 0) {
-    return buildSimpleResponse(204, "No Content", true);
+    return buildSimpleResponse(204, "No Content", !keepAlive_);
   } else {
     switch (errno) {
       case EACCES:
       case EPERM:
-        return buildErrorResponse(cfg, loc, 403, true);
+        return buildErrorResponse(cfg, loc, 403, !keepAlive_);
       case ENOENT: // raceで消えていた等
-        return buildErrorResponse(cfg, loc, 404, true);
+        return buildErrorResponse(cfg, loc, 404, !keepAlive_);
       default:
-        return buildErrorResponse(cfg, loc, 500, true);
+        return buildErrorResponse(cfg, loc, 500, !keepAlive_);
     }
   }
 }
 
 // GET / HEAD 処理
 // --- エントリーポイント ---
-std::string ResponseBuilder::generateResponse(const Request &req,
+HttpResponse ResponseBuilder::generateResponse(const Request &req,
                                               const ServerConfig &cfg,
-                                              const ServerConfig::Location *loc,
+                                              const LocationRuntime *loc,
                                               const std::string &locPath) {
 
   // 1. メソッド許可チェック (Location の method ディレクティブ)
@@ -560,9 +979,9 @@ std::string ResponseBuilder::generateResponse(const Request &req,
 }
 
 // --- GET/HEAD (4引数版ラッパー) ---
-std::string ResponseBuilder::handleGetLike(const Request &req,
+HttpResponse ResponseBuilder::handleGetLike(const Request &req,
                                            const ServerConfig &cfg,
-                                           const ServerConfig::Location *loc,
+                                           const LocationRuntime *loc,
                                            const std::string &locPath) {
   (void)locPath; // まだ使用していないが将来的に使う可能性あり
   return handleGetLikeCore(req, cfg, loc, locPath); // 既存の3引数版を再利用
@@ -571,7 +990,7 @@ std::string ResponseBuilder::handleGetLike(const Request &req,
 // --- DELETE (4引数版ラッパー) ---
 std::string ResponseBuilder::handleDelete(const Request &req,
                                           const ServerConfig &cfg,
-                                          const ServerConfig::Location *loc,
+                                          const LocationRuntime *loc,
                                           const std::string &locPath) {
   (void)loc; // Core で使うのでこのまま
   // 1) locPath を剥がして相対URIを得る
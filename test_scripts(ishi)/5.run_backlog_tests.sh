@@ -0,0 +1,697 @@
+#!/usr/bin/env bash
+# バックログで入れた挙動の回帰テスト
+# - 一時ディレクトリに www / CGI スクリプト / conf を作り、リポジトリ直下で ./webserv を起動する
+# - 各チェックは PASS/FAIL/SKIP で記録し、最後にまとめを出す
+# - 先に make しておくこと（usage: ./5.run_backlog_tests.sh）
+
+set -uo pipefail
+
+# -------- settings --------
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+PROJECT_ROOT="$(cd "$SCRIPT_DIR/.." && pwd)"
+WEBSERV="$PROJECT_ROOT/webserv"
+LOG_DIR="$SCRIPT_DIR/test_logs"
+PYTHON="$(command -v python3 || true)"
+
+PORT="${PORT:-18480}"
+PORT2=$((PORT + 1))
+BASE="http://127.0.0.1:$PORT"
+BASE2="http://127.0.0.1:$PORT2"
+
+CURL_BASE_OPTS=(-sS -o /dev/null -w "%{http_code}" --max-time 5)
+RETRY_MAX=50
+RETRY_SLEEP=0.2
+
+mkdir -p "$LOG_DIR"
+WORK="$(mktemp -d "${TMPDIR:-/tmp}/webserv_backlog.XXXXXX")"
+OUT="$WORK/out"
+CONF="$WORK/backlog.conf"
+CONF2="$WORK/backlog2.conf"
+mkdir -p "$OUT"
+
+# -------- state --------
+PASS_COUNT=0
+FAIL_COUNT=0
+SKIP_COUNT=0
+RESULTS=()  # "id|title|label|STATUS|url|detail"
+SERVER_PIDS=()
+PID=""
+
+CURRENT_ID=""
+CURRENT_TITLE=""
+CURRENT_DESC=""
+
+cleanup() {
+  local p
+  for p in ${SERVER_PIDS[@]+"${SERVER_PIDS[@]}"}; do
+    kill "$p" 2>/dev/null || true
+  done
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# -------- ui --------
+hr(){ printf -- "-----------------------------\n\n"; }
+say(){ printf "%s\n" "$1"; }
+ok(){  printf "  ✅ %s\n" "$1"; }
+ng(){  printf "  ❌ %s\n" "$1"; }
+skp(){ printf "  ⏭️  %s\n" "$1"; }
+
+# -------- helpers --------
+start_server() {
+  # args: <conf> <log>
+  # エラーページのパスがリポジトリ直下からの相対なので、そこで起動する
+  local conf="$1" log="$2"
+  ( cd "$PROJECT_ROOT" && exec "$WEBSERV" "$conf" ) >"$log" 2>&1 &
+  SERVER_PIDS+=("$!")
+}
+
+wait_http_up() {
+  # args: <url>
+  local url="$1" tries=0 code=""
+  while (( tries < RETRY_MAX )); do
+    code=$(curl "${CURL_BASE_OPTS[@]}" "$url" || true)
+    [[ "$code" =~ ^[0-9]{3}$ ]] && return 0
+    sleep "$RETRY_SLEEP"
+    ((tries++))
+  done
+  return 1
+}
+
+record_pass(){ RESULTS+=("${CURRENT_ID}|${CURRENT_TITLE}|$1|PASS|$2|$3"); ((PASS_COUNT++)); }
+record_fail(){ RESULTS+=("${CURRENT_ID}|${CURRENT_TITLE}|$1|FAIL|$2|$3"); ((FAIL_COUNT++)); }
+record_skip(){ RESULTS+=("${CURRENT_ID}|${CURRENT_TITLE}|$1|SKIP|$2|$3"); ((SKIP_COUNT++)); }
+
+start_test(){ # args: <id> <title> <desc>
+  CURRENT_ID="$1"; CURRENT_TITLE="$2"; CURRENT_DESC="$3"
+  hr
+  say "[$CURRENT_ID] $CURRENT_TITLE"
+  echo "  - $CURRENT_DESC"
+}
+
+case_check() {
+  # args: <expected> <url> <label> [extra curl args...]
+  local expect="$1"; local url="$2"; local label="$3"; shift 3
+  local code
+  code=$(curl "${CURL_BASE_OPTS[@]}" "$@" "$url" || true)
+  if [[ "$code" == "$expect" ]]; then
+    ok "[$expect] $label  -> $url"
+    record_pass "$label" "$url" "$expect"
+  else
+    ng "[$expect expected / got $code] $label  -> $url"
+    record_fail "$label" "$url" "expected $expect, got $code"
+  fi
+  return 0
+}
+
+case_assert() {
+  # args: <label> <detail> <command...>
+  # コマンドが 0 で終われば PASS（detail は実際の値を残すのに使う）
+  local label="$1" detail="$2"; shift 2
+  if "$@"; then
+    ok "$label  ($detail)"
+    record_pass "$label" "-" "$detail"
+  else
+    ng "$label  ($detail)"
+    record_fail "$label" "-" "$detail"
+  fi
+  return 0
+}
+
+fetch() {
+  # args: <name> <url> [extra curl args...]
+  # ヘッダを $OUT/<name>.h、ボディを $OUT/<name>.b に保存し、ステータスコードを出力する
+  local name="$1" url="$2"; shift 2
+  curl -sS --max-time 10 -D "$OUT/$name.h" -o "$OUT/$name.b" -w "%{http_code}" "$@" "$url" || true
+}
+
+header_of() {
+  # args: <name> <header>  fetch で保存したヘッダの値（CR なし）
+  grep -i "^$2:" "$OUT/$1.h" | head -n 1 | cut -d: -f2- | sed 's/^ *//' | tr -d '\r'
+}
+
+raw_http() {
+  # args: <outfile> <secs> [port]
+  # 標準入力のバイト列をそのまま 1 本の接続で送り、切られるか secs 経つまで受け取る
+  local out="$1" secs="$2" port="${3:-$PORT}"
+  exec 3<>"/dev/tcp/127.0.0.1/$port" || return 1
+  cat >&3
+  timeout "$secs" cat <&3 >"$out"
+  exec 3>&-
+  return 0
+}
+
+file_size(){ if [[ -f "$1" ]]; then wc -c <"$1" | tr -d ' '; else echo 0; fi; }
+
+# -------- fixtures --------
+setup_fixtures() {
+  mkdir -p "$WORK/www"
+  printf '<h1>backlog index</h1>\n' >"$WORK/www/index.html"
+  printf 'small-file-body\n' >"$WORK/www/small.txt"
+  head -c 4194304 /dev/urandom >"$WORK/www/big.bin"
+  printf 'version-one\n' >"$WORK/www/mut.txt"
+  mkdir -p "$WORK/cgi"
+  cat >"$WORK/cgi/echo.py" <<'PY'
+import hashlib, sys
+data = sys.stdin.buffer.read()
+sys.stdout.write("Content-Type: text/plain\r\n\r\n")
+sys.stdout.write("len=%d md5=%s\n" % (len(data), hashlib.md5(data).hexdigest()))
+PY
+  mkdir -p "$WORK/spool"
+  mkdir -p "$WORK/up"
+  cat >"$WORK/cgi/big.py" <<'PY'
+import os, sys
+mb = int(os.environ.get("QUERY_STRING", "mb=1").split("=")[1])
+out = sys.stdout.buffer
+out.write(b"Content-Type: application/octet-stream\r\n\r\n")
+chunk = b"x" * 65536
+for _ in range(mb * 16):
+    out.write(chunk)
+out.flush()
+PY
+  cat >"$WORK/cgi/fds.py" <<'PY'
+import os
+fds = []
+for fd in range(3, 256):
+    try:
+        os.fstat(fd)
+        fds.append(str(fd))
+    except OSError:
+        pass
+print("Content-Type: text/plain\r\n\r\nfds=" + ",".join(fds))
+PY
+  cat >"$WORK/cgi/exit.py" <<'PY'
+print("Content-Type: text/plain\r\n\r\nbye")
+PY
+  cat >"$WORK/cgi/stubborn.py" <<PY
+import os, signal, sys, time
+signal.signal(signal.SIGTERM, signal.SIG_IGN)
+open("$WORK/stubborn.pid", "w").write(str(os.getpid()))
+sys.stdout.write("Content-Type: text/plain\r\n\r\nstarted\n")
+sys.stdout.flush()
+time.sleep(30)
+PY
+  mkdir -p "$WORK/r1" "$WORK/r2"
+  printf 'r1\n' >"$WORK/r1/x.txt"
+  printf 'r2\n' >"$WORK/r2/x.txt"
+  printf '<h1>custom not found</h1>\n' >"$WORK/err404.html"
+  printf '0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghijklmnopqrstuvwxyz!?\n' >"$WORK/www/range.txt"
+  mkdir -p "$WORK/www/gz"
+  for i in $(seq 1 800); do echo "line $i of a very compressible text file"; done >"$WORK/www/gz/text.txt"
+  for i in $(seq 1 400); do echo "sidecar line $i"; done >"$WORK/www/gz/side.txt"
+  gzip -9 -c "$WORK/www/gz/side.txt" >"$WORK/www/gz/side.txt.gz"
+  touch -r "$WORK/www/gz/side.txt" "$WORK/www/gz/side.txt.gz"
+  mkdir -p "$WORK/www/list"
+  for i in 01 02 03 04 05; do printf '%s\n' "$i" >"$WORK/www/list/f$i.txt"; done
+  printf 'partial\n' >"$WORK/www/list/.upload_abc123"
+}
+
+write_conf() {
+  cat >"$CONF" <<EOF
+server {
+	listen $PORT;
+	host 127.0.0.1;
+	root $WORK/www/;
+	keepalive_requests 3;
+	error_page 404 $WORK/err404.html;
+
+	location / {
+		method GET HEAD POST;
+		index index.html;
+		upload_path $WORK/up/;
+		max_body_size 50m;
+	}
+	location /cgi/ {
+		method GET POST;
+		root $WORK/cgi;
+		cgi_path $PYTHON;
+		max_body_size 50m;
+		client_body_buffer_size 65536;
+		upload_path $WORK/spool/;
+	}
+	location /fcgi/ {
+		method GET;
+		root $WORK/cgi;
+		fastcgi_pass unix:$WORK/nothing.sock;
+	}
+	location /fcgitcp/ {
+		method GET;
+		root $WORK/cgi;
+		fastcgi_pass 127.0.0.1:1;
+	}
+	location /badcgi/ {
+		method GET;
+		root $WORK/cgi;
+		cgi_path /nonexistent/python3;
+	}
+	location /a/ {
+		method GET;
+		root $WORK/r1/;
+	}
+	location /a/b/ {
+		method GET;
+		root $WORK/r2/;
+	}
+	location /ro/ {
+		method GET;
+		root $WORK/www/;
+	}
+	location /old/ {
+		method GET;
+		return 301 /small.txt;
+	}
+	location /gz/ {
+		method GET;
+		root $WORK/www/gz/;
+		gzip on;
+	}
+	location /list/ {
+		method GET;
+		root $WORK/www/list/;
+		autoindex on;
+	}
+	location /__status {
+		method GET;
+		stub_status on;
+	}
+}
+EOF
+  cat >"$CONF2" <<EOF
+worker_threads 2;
+
+server {
+	listen $PORT2;
+	host 127.0.0.1;
+	root $WORK/www/;
+	open_file_cache off;
+
+	location / {
+		method GET;
+		index index.html;
+	}
+}
+EOF
+}
+
+# -------- tests --------
+
+test_001() {
+  start_test "001" "Reactor (epoll)" "同時 50 接続がすべて 200 で返る"
+  local i codes n
+  codes=$(for i in $(seq 1 50); do
+            curl -sS -o /dev/null -w "%{http_code}\n" --max-time 5 "$BASE/small.txt" &
+          done; wait)
+  n=$(grep -c '^200$' <<<"$codes")
+  case_assert "50 並列 GET がすべて 200" "200 x $n/50" test "$n" -eq 50
+  case_check 200 "$BASE/" "並列のあとも GET / が通る"
+}
+
+test_002() {
+  start_test "002" "Deadline timers" "何も来ない接続・途中で止まったリクエストは 5 秒前後で閉じられる"
+  local t0 el
+  t0=$(date +%s)
+  raw_http "$OUT/idle.raw" 10 </dev/null
+  el=$(( $(date +%s) - t0 ))
+  case_assert "無通信の接続が 4〜9 秒で閉じられる" "elapsed ${el}s" test "$el" -ge 4 -a "$el" -le 9
+
+  t0=$(date +%s)
+  printf 'GET /small.txt HTTP/1.1\r\nHost: a\r\n' | raw_http "$OUT/partial.raw" 10
+  el=$(( $(date +%s) - t0 ))
+  case_assert "ヘッダ途中で止まった接続が 4〜9 秒で閉じられる" "elapsed ${el}s" test "$el" -ge 4 -a "$el" -le 9
+  case_check 200 "$BASE/small.txt" "タイムアウトのあとも GET が通る"
+}
+
+test_003() {
+  start_test "003" "Multi-reactor" "worker_threads 2 の別インスタンスで並列リクエストが返る"
+  local i codes n
+  case_assert "起動ログに worker threads が出る" "$(grep -o 'Started with [0-9]* worker threads' "$LOG_DIR/backlog2.log" | head -n 1)" \
+    grep -q 'Started with 2 worker threads' "$LOG_DIR/backlog2.log"
+  codes=$(for i in $(seq 1 40); do
+            curl -sS -o /dev/null -w "%{http_code}\n" --max-time 5 "$BASE2/small.txt" &
+          done; wait)
+  n=$(grep -c '^200$' <<<"$codes")
+  case_assert "40 並列 GET がすべて 200" "200 x $n/40" test "$n" -eq 40
+}
+
+test_004() {
+  start_test "004" "Keep-alive / pipelining" "1 回の書き込みで送った 4 リクエストを順に返し、keepalive_requests 3 で閉じる"
+  local req order n closes
+  req='GET /small.txt HTTP/1.1\r\nHost: a\r\n\r\nGET /index.html HTTP/1.1\r\nHost: a\r\n\r\n'
+  req+='GET /small.txt HTTP/1.1\r\nHost: a\r\n\r\nGET /index.html HTTP/1.1\r\nHost: a\r\n\r\n'
+  printf "$req" | raw_http "$OUT/pipe.raw" 8
+  n=$(grep -c '^HTTP/1.1 200' "$OUT/pipe.raw")
+  case_assert "3 件だけ返す（keepalive_requests 3）" "responses=$n" test "$n" -eq 3
+  order=$(grep -o 'small-file-body\|backlog index' "$OUT/pipe.raw" | tr '\n' ',')
+  case_assert "パイプライン順に返す" "$order" test "$order" = "small-file-body,backlog index,small-file-body,"
+  closes=$(grep -ci '^Connection: close' "$OUT/pipe.raw")
+  case_assert "最後の応答だけ Connection: close" "close=$closes" test "$closes" -eq 1
+  printf 'GET /small.txt HTTP/1.0\r\n\r\n' | raw_http "$OUT/http10.raw" 3
+  case_assert "HTTP/1.0 は 1 回で閉じる" "$(head -n 1 "$OUT/http10.raw" | tr -d '\r')" grep -q 'small-file-body' "$OUT/http10.raw"
+}
+
+test_005() {
+  start_test "005" "sendfile" "4 MiB のファイルがバイト単位で一致し、HEAD はボディなし"
+  local code len
+  code=$(fetch big "$BASE/big.bin")
+  case_assert "GET /big.bin が 200 で一致" "code=$code size=$(file_size "$OUT/big.b")" cmp -s "$OUT/big.b" "$WORK/www/big.bin"
+  code=$(fetch bighead "$BASE/big.bin" -I)
+  len=$(header_of bighead Content-Length)
+  case_assert "HEAD の Content-Length が実サイズ" "code=$code len=$len" test "$len" = "4194304"
+}
+
+test_006() {
+  start_test "006" "Open-file cache" "open_file_cache off は書き換え・削除をすぐ反映し、開けない理由でステータスを分ける"
+  local code
+  code=$(fetch mut1 "$BASE2/mut.txt")
+  case_assert "off: 最初の内容" "code=$code" grep -q 'version-one' "$OUT/mut1.b"
+  printf 'version-two-longer\n' >"$WORK/www/mut.txt"
+  code=$(fetch mut2 "$BASE2/mut.txt")
+  case_assert "off: 書き換えがすぐ見える" "code=$code" grep -q 'version-two-longer' "$OUT/mut2.b"
+  rm -f "$WORK/www/mut.txt"
+  case_check 404 "$BASE2/mut.txt" "off: 削除がすぐ 404 になる"
+  case_check 404 "$BASE/no/such/file.txt" "存在しないファイルは 404"
+  if [[ "$(id -u)" != "0" ]]; then
+    printf 'secret\n' >"$WORK/www/locked.txt"
+    chmod 000 "$WORK/www/locked.txt"
+    case_check 403 "$BASE/locked.txt" "読めないファイルは 403"
+  else
+    skp "root では EACCES にならないので 403 は見ない"
+    record_skip "読めないファイルは 403" "$BASE/locked.txt" "running as root"
+  fi
+}
+
+test_007() {
+  start_test "007" "Incremental parser" "細切れに届いたリクエストを組み立て、壊れたリクエストは 400"
+  { printf 'GET /small.t'; sleep 0.3; printf 'xt HTTP/1.1\r\nHo'; sleep 0.3
+    printf 'st: a\r\nConnection: cl'; sleep 0.3; printf 'ose\r\n\r\n'; } | raw_http "$OUT/split.raw" 5
+  case_assert "分割送信でも 200" "$(head -n 1 "$OUT/split.raw" | tr -d '\r')" grep -q '^HTTP/1.1 200' "$OUT/split.raw"
+  case_assert "分割送信でもボディが返る" "$(file_size "$OUT/split.raw") bytes" grep -q 'small-file-body' "$OUT/split.raw"
+  printf 'THIS IS NOT HTTP\r\n\r\n' | raw_http "$OUT/garbage.raw" 3
+  case_assert "壊れたリクエスト行は 400" "$(head -n 1 "$OUT/garbage.raw" | tr -d '\r')" grep -q '^HTTP/1.1 400' "$OUT/garbage.raw"
+  { printf 'POST /cgi/echo.py HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n'; sleep 0.2
+    printf '5\r\nhello\r\n'; sleep 0.2; printf '6\r\n world\r\n0\r\n\r\n'; } | raw_http "$OUT/chunked.raw" 5
+  case_assert "chunked ボディを組み立てて CGI に渡す" "$(grep -a 'len=' "$OUT/chunked.raw" | tr -d '\r')" grep -q 'len=11 ' "$OUT/chunked.raw"
+}
+
+test_008() {
+  start_test "008" "Binary-safe receive" "NUL を含むボディが欠けずに CGI へ届く"
+  local code want
+  printf 'a\0b\0\0c\r\n\0' >"$OUT/nul.dat"
+  want="len=$(file_size "$OUT/nul.dat") md5=$(md5sum <"$OUT/nul.dat" | cut -d' ' -f1)"
+  code=$(fetch nul "$BASE/cgi/echo.py" --data-binary @"$OUT/nul.dat" -H 'Content-Type: application/octet-stream')
+  case_assert "小さい NUL 入りボディ" "code=$code $(cat "$OUT/nul.b")" grep -q "$want" "$OUT/nul.b"
+  head -c 40000 /dev/urandom >"$OUT/rand.dat"
+  want="len=40000 md5=$(md5sum <"$OUT/rand.dat" | cut -d' ' -f1)"
+  code=$(fetch rand "$BASE/cgi/echo.py" --data-binary @"$OUT/rand.dat" -H 'Content-Type: application/octet-stream')
+  case_assert "40 KB のランダムボディ" "code=$code $(cat "$OUT/rand.b")" grep -q "$want" "$OUT/rand.b"
+}
+
+test_009() {
+  start_test "009" "Scatter-gather send queue" "同じ接続で大きい応答のあとに小さい応答が続いても崩れない"
+  local conns
+  conns=$(curl -sS --max-time 10 -w "%{num_connects}," -o "$OUT/sq1.b" "$BASE/big.bin" -o "$OUT/sq2.b" "$BASE/small.txt" || true)
+  case_assert "1 本目（4 MiB）が一致" "$(file_size "$OUT/sq1.b") bytes" cmp -s "$OUT/sq1.b" "$WORK/www/big.bin"
+  case_assert "2 本目が一致" "$(file_size "$OUT/sq2.b") bytes" cmp -s "$OUT/sq2.b" "$WORK/www/small.txt"
+  case_assert "2 本目は接続を使い回す" "num_connects=$conns" test "$conns" = "1,0,"
+}
+
+test_010() {
+  start_test "010" "Request body spooling" "client_body_buffer_size を超えるボディを一時ファイル経由で CGI に渡し、後に残さない"
+  local code want left
+  head -c 3145728 /dev/urandom >"$OUT/spool.dat"
+  want="len=3145728 md5=$(md5sum <"$OUT/spool.dat" | cut -d' ' -f1)"
+  code=$(fetch spool "$BASE/cgi/echo.py" --data-binary @"$OUT/spool.dat" -H 'Content-Type: application/octet-stream')
+  case_assert "3 MiB のボディが CGI に届く" "code=$code $(cat "$OUT/spool.b")" grep -q "$want" "$OUT/spool.b"
+  sleep 0.3
+  left=$(ls -A "$WORK/spool" | wc -l)
+  case_assert "一時ファイルが残らない" "left=$left" test "$left" -eq 0
+}
+
+test_011() {
+  start_test "011" "Streaming multipart upload" "パートはそのまま保存され、途中で切れたアップロードは何も残さない"
+  local code mode left hdr
+  head -c 200000 /dev/urandom >"$OUT/up_src.bin"
+  code=$(fetch up "$BASE/" -F "file=@$OUT/up_src.bin;filename=up.bin")
+  case_assert "multipart で保存（201）" "code=$code" test "$code" = "201"
+  case_assert "保存内容が一致" "$(file_size "$WORK/up/up.bin" 2>/dev/null) bytes" cmp -s "$WORK/up/up.bin" "$OUT/up_src.bin"
+  mode=$(stat -c %a "$WORK/up/up.bin" 2>/dev/null)
+  case_assert "保存後は 644" "mode=$mode" test "$mode" = "644"
+
+  printf 'original\n' >"$WORK/up/keep.bin"
+  hdr='POST / HTTP/1.1\r\nHost: a\r\nContent-Type: multipart/form-data; boundary=XyZ\r\nContent-Length: 1000000\r\n\r\n'
+  hdr+='--XyZ\r\nContent-Disposition: form-data; name="file"; filename="keep.bin"\r\nContent-Type: application/octet-stream\r\n\r\n'
+  { printf "$hdr"; head -c 100000 /dev/zero; } | raw_http "$OUT/abort.raw" 1
+  sleep 0.5
+  case_assert "途中で切れても既存ファイルはそのまま" "$(cat "$WORK/up/keep.bin")" grep -qx 'original' "$WORK/up/keep.bin"
+  left=$(ls -A "$WORK/up" | grep -c '^\.upload_')
+  case_assert "一時パートが残らない" "left=$left" test "$left" -eq 0
+}
+
+test_012() {
+  start_test "012" "Streaming CGI output" "Content-Length のない CGI 出力を chunked で最後まで返す"
+  local code te size
+  code=$(fetch cgibig "$BASE/cgi/big.py?mb=8")
+  te=$(header_of cgibig Transfer-Encoding)
+  size=$(file_size "$OUT/cgibig.b")
+  case_assert "Transfer-Encoding: chunked" "code=$code te=$te" test "$te" = "chunked"
+  case_assert "8 MiB すべて届く" "size=$size" test "$size" -eq 8388608
+}
+
+test_013() {
+  start_test "013" "FastCGI client" "つながらない fastcgi_pass は 502"
+  case_check 502 "$BASE/fcgi/app.py" "unix ソケットが無い"
+  case_check 502 "$BASE/fcgitcp/app.py" "TCP がつながらない"
+  case_check 200 "$BASE/small.txt" "502 のあとも静的ファイルは返る"
+}
+
+test_014() {
+  start_test "014" "posix_spawn + close-on-exec" "CGI には 0/1/2 以外の fd が漏れず、起動できないインタプリタは 500"
+  local code
+  code=$(fetch fds "$BASE/cgi/fds.py")
+  case_assert "CGI に余分な fd がない" "code=$code $(cat "$OUT/fds.b")" grep -qx 'fds=' "$OUT/fds.b"
+  case_check 500 "$BASE/badcgi/x.py" "存在しない cgi_path は 500"
+}
+
+test_015() {
+  start_test "015" "fd dispatch table" "遅いクライアントへの CGI 出力中も他の接続が返り、出力は欠けない"
+  local bg i codes n size
+  curl -sS --max-time 20 --limit-rate 2M -o "$OUT/slow.b" "$BASE/cgi/big.py?mb=4" & bg=$!
+  sleep 0.3
+  codes=$(for i in $(seq 1 20); do
+            curl -sS -o /dev/null -w "%{http_code}\n" --max-time 1 "$BASE/small.txt"
+          done)
+  n=$(grep -c '^200$' <<<"$codes")
+  case_assert "CGI 転送中の GET 20 件がすべて 200" "200 x $n/20" test "$n" -eq 20
+  wait "$bg"
+  size=$(file_size "$OUT/slow.b")
+  case_assert "遅いクライアントにも 4 MiB すべて届く" "size=$size" test "$size" -eq 4194304
+}
+
+test_016() {
+  start_test "016" "SIGCHLD reaping" "CGI の子はゾンビで残らず、切断後は SIGTERM を無視する CGI も SIGKILL で止まる"
+  local i z cpid t
+  for i in $(seq 1 20); do curl "${CURL_BASE_OPTS[@]}" "$BASE/cgi/exit.py" >/dev/null; done
+  sleep 0.5
+  z=$(ps -o stat= --ppid "$PID" | grep -c '^Z')
+  case_assert "20 回実行してもゾンビがいない" "zombies=$z" test "$z" -eq 0
+
+  rm -f "$WORK/stubborn.pid"
+  curl -sS --max-time 1 -o /dev/null "$BASE/cgi/stubborn.py" 2>/dev/null
+  cpid=$(cat "$WORK/stubborn.pid" 2>/dev/null)
+  t=0
+  while [[ -n "$cpid" ]] && ps -p "$cpid" >/dev/null 2>&1 && (( t < 50 )); do
+    sleep 0.1; ((t++))
+  done
+  case_assert "切断後 5 秒以内に CGI が止まり回収される" "pid=${cpid:-none} waited=$((t / 10)).$((t % 10))s" \
+    test -n "$cpid" -a "$t" -lt 50
+}
+
+test_017() {
+  start_test "017" "Radix-trie router" "入れ子の location は最長一致を選ぶ"
+  local code
+  code=$(fetch r1 "$BASE/a/x.txt")
+  case_assert "/a/x.txt → /a/" "code=$code $(cat "$OUT/r1.b")" grep -qx 'r1' "$OUT/r1.b"
+  code=$(fetch r2 "$BASE/a/b/x.txt")
+  case_assert "/a/b/x.txt → /a/b/" "code=$code $(cat "$OUT/r2.b")" grep -qx 'r2' "$OUT/r2.b"
+  code=$(fetch r3 "$BASE/small.txt")
+  case_assert "/small.txt → /" "code=$code $(cat "$OUT/r3.b")" grep -qx 'small-file-body' "$OUT/r3.b"
+}
+
+test_018() {
+  start_test "018" "Per-location runtime" "許可していないメソッドは 405 と Allow を返す"
+  local code allow
+  code=$(fetch ro "$BASE/ro/small.txt" -X POST -d 'x=1')
+  allow=$(header_of ro Allow)
+  case_assert "POST /ro/ は 405" "code=$code" test "$code" = "405"
+  case_assert "Allow に GET が入る" "Allow: $allow" grep -qw 'GET' <<<"$allow"
+  case_check 200 "$BASE/ro/small.txt" "GET /ro/ は 200"
+}
+
+test_019() {
+  start_test "019" "Prerendered responses" "error_page の中身と return の Location を返す"
+  local code loc
+  code=$(fetch e404 "$BASE/missing.html")
+  case_assert "404 は error_page の中身" "code=$code" cmp -s "$OUT/e404.b" "$WORK/err404.html"
+  code=$(fetch redir "$BASE/old/")
+  loc=$(header_of redir Location)
+  case_assert "return 301 の Location" "code=$code Location: $loc" test "$code:$loc" = "301:/small.txt"
+}
+
+test_020() {
+  start_test "020" "Cached Date header" "正常応答にもエラー応答にも RFC 7231 形式の Date が付く"
+  local re code d
+  re='^[A-Z][a-z]{2}, [0-9]{2} [A-Z][a-z]{2} [0-9]{4} [0-9]{2}:[0-9]{2}:[0-9]{2} GMT$'
+  code=$(fetch d200 "$BASE/small.txt")
+  d=$(header_of d200 Date)
+  case_assert "200 に Date" "code=$code Date: $d" grep -Eq "$re" <<<"$d"
+  code=$(fetch d404 "$BASE/missing.html")
+  d=$(header_of d404 Date)
+  case_assert "404 に Date" "code=$code Date: $d" grep -Eq "$re" <<<"$d"
+  printf 'BROKEN\r\n\r\n' | raw_http "$OUT/d400.raw" 3
+  d=$(grep -i '^Date:' "$OUT/d400.raw" | cut -d: -f2- | sed 's/^ *//' | tr -d '\r')
+  case_assert "400 に Date" "Date: $d" grep -Eq "$re" <<<"$d"
+}
+
+test_021() {
+  start_test "021" "Byte ranges" "Range に 206 / 416 / multipart/byteranges で答える"
+  local code cr size ct
+  size=$(file_size "$WORK/www/range.txt")
+  code=$(fetch rg1 "$BASE/range.txt" -H 'Range: bytes=0-9')
+  cr=$(header_of rg1 Content-Range)
+  case_assert "bytes=0-9 は 206" "code=$code Content-Range: $cr" test "$code:$cr" = "206:bytes 0-9/$size"
+  case_assert "先頭 10 バイト" "$(cat "$OUT/rg1.b")" test "$(cat "$OUT/rg1.b")" = "0123456789"
+  code=$(fetch rg2 "$BASE/range.txt" -H 'Range: bytes=-3')
+  case_assert "bytes=-3 は末尾 3 バイト" "code=$code $(tr -d '\n' <"$OUT/rg2.b")" test "$(tr -d '\n' <"$OUT/rg2.b")" = "!?"
+  code=$(fetch rg3 "$BASE/range.txt" -H "Range: bytes=$((size + 10))-")
+  cr=$(header_of rg3 Content-Range)
+  case_assert "範囲外は 416" "code=$code Content-Range: $cr" test "$code:$cr" = "416:bytes */$size"
+  code=$(fetch rg4 "$BASE/range.txt" -H 'Range: bytes=0-1,10-11')
+  ct=$(header_of rg4 Content-Type)
+  case_assert "複数範囲は multipart/byteranges" "code=$code $ct" grep -q '^multipart/byteranges; boundary=' <<<"$ct"
+  case_assert "各パートの Content-Range" "$(grep -ac 'Content-Range' "$OUT/rg4.b") parts" \
+    test "$(grep -ac "Content-Range: bytes [0-9]*-[0-9]*/$size" "$OUT/rg4.b")" -eq 2
+}
+
+test_022() {
+  start_test "022" "Conditional GET" "If-None-Match / If-Modified-Since が一致すれば 304"
+  local code etag lm
+  code=$(fetch c0 "$BASE/small.txt")
+  etag=$(header_of c0 ETag)
+  lm=$(header_of c0 Last-Modified)
+  case_assert "ETag と Last-Modified が付く" "ETag: $etag / Last-Modified: $lm" test -n "$etag" -a -n "$lm"
+  code=$(fetch c1 "$BASE/small.txt" -H "If-None-Match: $etag")
+  case_assert "If-None-Match 一致で 304・ボディなし" "code=$code body=$(file_size "$OUT/c1.b")" \
+    test "$code:$(file_size "$OUT/c1.b")" = "304:0"
+  code=$(fetch c2 "$BASE/small.txt" -H "If-Modified-Since: $lm")
+  case_assert "If-Modified-Since 一致で 304" "code=$code" test "$code" = "304"
+  case_check 200 "$BASE/small.txt" "ETag 不一致は 200" -H 'If-None-Match: "nope"'
+}
+
+test_023() {
+  start_test "023" "Content-Encoding" "gzip on の location は gzip で返し、.gz が並んでいればそれを送る"
+  local code ce
+  code=$(fetch gz1 "$BASE/gz/text.txt" -H 'Accept-Encoding: gzip')
+  ce=$(header_of gz1 Content-Encoding)
+  case_assert "Content-Encoding: gzip" "code=$code ce=$ce" test "$ce" = "gzip"
+  case_assert "展開すると元のファイル" "$(file_size "$OUT/gz1.b") bytes" \
+    cmp -s <(gunzip -c "$OUT/gz1.b" 2>/dev/null) "$WORK/www/gz/text.txt"
+  code=$(fetch gz2 "$BASE/gz/side.txt" -H 'Accept-Encoding: gzip')
+  case_assert ".gz を事前圧縮としてそのまま送る" "code=$code $(file_size "$OUT/gz2.b") bytes" \
+    cmp -s "$OUT/gz2.b" "$WORK/www/gz/side.txt.gz"
+  code=$(fetch gz3 "$BASE/gz/text.txt")
+  ce=$(header_of gz3 Content-Encoding)
+  case_assert "Accept-Encoding なしは無圧縮" "code=$code ce=${ce:-none}" cmp -s "$OUT/gz3.b" "$WORK/www/gz/text.txt"
+}
+
+test_024() {
+  start_test "024" "Autoindex cache / paging" "limit / page / format=json で区切り、一時ファイルは一覧に出さない"
+  local code ct
+  code=$(fetch ls1 "$BASE/list/?format=json&limit=2&page=2")
+  ct=$(header_of ls1 Content-Type)
+  case_assert "format=json は application/json" "code=$code $ct" test "$ct" = "application/json"
+  case_assert "2 ページ目は f03 / f04 だけ" "$(grep -o 'f0[0-9].txt' "$OUT/ls1.b" | tr '\n' ' ')" \
+    test "$(grep -o 'f0[0-9].txt' "$OUT/ls1.b" | tr '\n' ' ')" = "f03.txt f04.txt "
+  code=$(fetch ls2 "$BASE/list/")
+  case_assert "HTML に全ファイル" "code=$code" test "$(grep -o 'f0[0-9].txt' "$OUT/ls2.b" | sort -u | wc -l)" -eq 5
+  case_assert ".upload_ の一時ファイルは出さない" "code=$code" bash -c "! grep -q '.upload_' '$OUT/ls1.b' '$OUT/ls2.b'"
+}
+
+test_025() {
+  start_test "025" "stub_status" "Prometheus テキスト形式でメトリクスを返す"
+  local code ct m
+  code=$(fetch st "$BASE/__status")
+  ct=$(header_of st Content-Type)
+  case_assert "200 / text/plain" "code=$code $ct" grep -q '^text/plain' <<<"$ct"
+  for m in webserv_connections webserv_connections_accepted_total webserv_http_requests_total webserv_cgi_processes; do
+    case_assert "$m がある" "$(grep -m1 "^$m" "$OUT/st.b")" grep -q "^$m" "$OUT/st.b"
+  done
+}
+
+summary() {
+  hr
+  say "Summary" | tee "$LOG_DIR/backlog_summary.log"
+  local row id title label status url detail
+  for row in "${RESULTS[@]}"; do
+    IFS='|' read -r id title label status url detail <<< "$row"
+    case "$status" in
+      PASS) printf "  ✅ [%s] %s — %s  (%s)\n" "$id" "$title" "$label" "$detail" ;;
+      FAIL) printf "  ❌ [%s] %s — %s  (%s)  [%s]\n" "$id" "$title" "$label" "$detail" "$url" ;;
+      SKIP) printf "  ⏭️  [%s] %s — %s  (%s)  [%s]\n" "$id" "$title" "$label" "$detail" "$url" ;;
+    esac
+  done | tee -a "$LOG_DIR/backlog_summary.log"
+  hr | tee -a "$LOG_DIR/backlog_summary.log"
+  printf "PASS: %d, FAIL: %d, SKIP: %d\n" "$PASS_COUNT" "$FAIL_COUNT" "$SKIP_COUNT" \
+    | tee -a "$LOG_DIR/backlog_summary.log"
+}
+
+main() {
+  if [[ ! -x "$WEBSERV" ]]; then
+    echo "ERROR: webserv missing or not executable: $WEBSERV (run make first)"
+    exit 1
+  fi
+  if [[ -z "$PYTHON" ]]; then
+    echo "ERROR: python3 not found (CGI fixtures need it)"
+    exit 1
+  fi
+  setup_fixtures
+  write_conf
+  start_server "$CONF" "$LOG_DIR/backlog.log"
+  PID="${SERVER_PIDS[0]}"
+  if ! wait_http_up "$BASE/"; then
+    echo "ERROR: server not responding on $PORT (see $LOG_DIR/backlog.log)"
+    exit 1
+  fi
+  start_server "$CONF2" "$LOG_DIR/backlog2.log"
+  wait_http_up "$BASE2/" || true
+
+  test_001
+  test_002
+  test_003
+  test_004
+  test_005
+  test_006
+  test_007
+  test_008
+  test_009
+  test_010
+  test_011
+  test_012
+  test_013
+  test_014
+  test_015
+  test_016
+  test_017
+  test_018
+  test_019
+  test_020
+  test_021
+  test_022
+  test_023
+  test_024
+  test_025
+
+  summary
+  (( FAIL_COUNT > 0 )) && return 1 || return 0
+}
+
+main "$@"